@@ -0,0 +1,847 @@
+/*
+ * sim.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Simulated port, SPI0, eDMA, USB module and ColdFire target for the host build (make host).
+ *
+ * The GPIO transport is followed pin by pin: every rising edge of DSCLK (PTA12, or PTC5 while the SPI
+ * transport bit-bangs) clocks the bit on the data line into the target (PTD7 or PTC6) and the target
+ * presents its next bit on PTA13 and PTC7. A PUSHR write shifts the frame through the target at once
+ * and queues the bits received in the Rx FIFO; the eDMA runs its whole major loop when the transfer is
+ * requested. The target answers the BDM commands the probe uses from sim_ram and a register file.
+ *
+ * The USB side plays the host: sim_usb_setup(), sim_usb_out() and sim_usb_in() run one transaction on the
+ * buffer descriptor the module would use, the device's interrupt handler is called for every transaction
+ * which is not NAKed or stalled, like the TOKDNE interrupt on the K20.
+ *
+ * Time is counted in core cycles (sim_cycles): SIM_ACCESS_CYCLES per register access, 3 per delay loop
+ * pass and the SCK periods set in the CTARs for SPI frames. This gives the frame rates the probe would
+ * reach at 96MHz to within the accuracy of SIM_ACCESS_CYCLES.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "bdmcf.h"
+#include "wait.h"
+#include "xprintf.h"
+
+#define SIM_UNWRITTEN       0xdeadbeefu /* what a write-only register holds until it is written */
+#define SIM_NONE            -1
+#define SIM_BITBAND         -2
+#define SIM_ACCESS_CYCLES   4           /* core cycles per GPIO access including the instructions around it */
+#define SIM_FIFO_SIZE       1024        /* the real Rx FIFO has 4 entries, the DMA empties it as it goes */
+
+#define SIM_COMPLETE        0x0ffff     /* BDM responses */
+#define SIM_NOT_READY       0x10000
+#define SIM_BUS_ERROR       0x10001
+#define SIM_ILLEGAL         0x1ffff
+
+#define SIM_BDT_OWN         0x80        /* buffer descriptor bits & the PIDs written back (see tbdm.c) */
+#define SIM_BDT_DATA1       0x40
+#define SIM_BDT_DTS         0x08
+#define SIM_BDT_STALL       0x04
+#define SIM_PID_OUT         0x01
+#define SIM_PID_IN          0x09
+#define SIM_PID_SETUP       0x0d
+
+struct sim_bdt                          /* buffer descriptor table entry, as in tbdm.c */
+{
+    uint32_t desc;
+    void *addr;
+};
+
+void USBOTG_IRQHandler(void);           /* tbdm.c */
+
+int32_t core_clk_khz = SIM_CORE_KHZ;
+uint64_t sim_cycles;
+uint8_t sim_ram[SIM_RAM_SIZE];
+uint32_t sim_target_regs[16];
+uint32_t sim_frames;
+uint32_t sim_frame_log[SIM_FRAME_LOG];
+uint32_t sim_protocol_errors;
+uint32_t sim_pushes;
+uint32_t sim_push_log[SIM_FRAME_LOG];
+uint32_t sim_usb_toggle_errors;
+uint32_t sim_target_wait;
+void (*sim_target_hook)(void);
+uint32_t sim_target_detached;
+uint32_t sim_dsp = 1;
+
+static volatile uint32_t regs[SIM_NREGS];
+static int pending = SIM_NONE;          /* register accessed last, its write is applied by the next access */
+static volatile uint32_t *bitband_reg;
+static uint32_t bitband_bit;
+static volatile uint32_t bitband_cell;
+
+static uint32_t apsr_ge;                /* GE flags of the APSR, bit n for byte n */
+static uint32_t pin_dsclk;              /* DSCLK level seen last */
+
+static uint16_t spi_fifo[SIM_FIFO_SIZE];
+static uint32_t spi_fifo_head;
+static uint32_t spi_fifo_tail;
+static uint8_t spi_second_half;         /* the next frame must be the 8 bit LSB of a message */
+static uint8_t dma_requests;            /* channels enabled by DMA_SERQ */
+
+static uint8_t usb_odd[4][2];           /* buffer the module uses next per endpoint & direction (RX, TX) */
+static uint8_t usb_toggle[4][2];        /* DATA0/1 of the next packet */
+
+/* the target */
+static uint32_t tgt_in;                 /* bits received of the current message */
+static uint8_t tgt_bits;
+static uint32_t tgt_out;                /* message being sent */
+static uint32_t tgt_next;               /* message to send next */
+static uint32_t tgt_queue[2];           /* more result words after tgt_next */
+static uint8_t tgt_queued;
+static uint16_t tgt_cmd;                /* command waiting for extension words */
+static uint16_t tgt_ext[4];
+static uint8_t tgt_ext_count;
+static uint8_t tgt_ext_needed;
+static uint32_t tgt_address;            /* next DUMP/FILL address */
+static uint32_t tgt_busy;               /* messages still to be answered not ready after a memory access */
+static uint32_t tgt_held;               /* the answer given once the access is over */
+static uint32_t tgt_dmregs[16];
+static uint32_t tgt_cregs[0x1000];
+
+/* puts the simulation into its power-up state, the target memory is left alone */
+void sim_reset(void)
+{
+    int i;
+
+    for (i = 0; i < SIM_NREGS; i++)
+    {
+        regs[i] = 0;
+    }
+    regs[SIM_GPIOA_PSOR] = regs[SIM_GPIOA_PCOR] = regs[SIM_GPIOA_PTOR] = SIM_UNWRITTEN;
+    regs[SIM_GPIOC_PSOR] = regs[SIM_GPIOC_PCOR] = regs[SIM_GPIOC_PTOR] = SIM_UNWRITTEN;
+    regs[SIM_GPIOD_PSOR] = regs[SIM_GPIOD_PCOR] = regs[SIM_GPIOD_PTOR] = SIM_UNWRITTEN;
+    regs[SIM_SPI0_PUSHR] = regs[SIM_DMA_SERQ] = regs[SIM_DMA_CDNE] = SIM_UNWRITTEN;
+    pending = SIM_NONE;
+    pin_dsclk = 0;
+    spi_fifo_head = spi_fifo_tail = 0;
+    spi_second_half = 0;
+    dma_requests = 0;
+    memset(usb_odd, 0, sizeof(usb_odd));
+    memset(usb_toggle, 0, sizeof(usb_toggle));
+
+    tgt_in = 0;
+    tgt_bits = 0;
+    tgt_out = tgt_next = SIM_COMPLETE;
+    tgt_queued = 0;
+    tgt_ext_needed = 0;
+    tgt_busy = 0;
+    memset(tgt_dmregs, 0, sizeof(tgt_dmregs));
+    memset(tgt_cregs, 0, sizeof(tgt_cregs));
+    tgt_dmregs[0] = 0x00100000;         /* CSR: debug module version */
+
+    sim_frames = 0;
+    sim_protocol_errors = 0;
+    sim_pushes = 0;
+}
+
+/* stops the target as if it had hit a breakpoint: the CSR status bits (31-28) are set & the PC is moved */
+void sim_target_halt(uint32_t status, uint32_t pc)
+{
+    tgt_dmregs[0] |= status & ~BDMCF_CSR_STATIC_MASK;
+    tgt_cregs[BDMCF_CREG_PC & 0x0fff] = pc;
+}
+
+/* returns the number of extension words of a BDM command, 0xff if the target does not know it */
+static uint8_t tgt_ext_words(uint16_t cmd)
+{
+    switch (cmd & 0xfff0)
+    {
+        case BDMCF_CMD_RDMREG:
+        case BDMCF_CMD_RAREG:
+            return 0;
+        case BDMCF_CMD_WDMREG:
+        case BDMCF_CMD_WAREG:
+            return 2;
+    }
+    switch (cmd)
+    {
+        case BDMCF_CMD_NOP:
+        case BDMCF_CMD_GO:
+        case BDMCF_CMD_DUMP8:
+        case BDMCF_CMD_DUMP16:
+        case BDMCF_CMD_DUMP32:
+            return 0;
+        case BDMCF_CMD_FILL8:
+        case BDMCF_CMD_FILL16:
+            return 1;
+        case BDMCF_CMD_RCREG:
+        case BDMCF_CMD_READ8:
+        case BDMCF_CMD_READ16:
+        case BDMCF_CMD_READ32:
+        case BDMCF_CMD_FILL32:
+            return 2;
+        case BDMCF_CMD_WRITE8:
+        case BDMCF_CMD_WRITE16:
+            return 3;
+        case BDMCF_CMD_WCREG:
+        case BDMCF_CMD_WRITE32:
+            return 4;
+    }
+    return 0xff;
+}
+
+/* queues the result of a read, 32 bit values take two messages */
+static void tgt_result(uint32_t value, uint8_t size)
+{
+    if (size == 4)
+    {
+        tgt_next = value >> 16;
+        tgt_queue[0] = value & 0xffff;
+        tgt_queued = 1;
+    }
+    else
+    {
+        tgt_next = value & 0xffff;
+    }
+}
+
+/* reads (write == 0) or writes size bytes at address of the target memory, big endian */
+/* returns 0 on success and non-zero if there is no memory */
+static uint8_t tgt_memory(uint8_t write, uint32_t address, uint8_t size, uint32_t *value)
+{
+    uint8_t *p = sim_ram + (address - SIM_RAM_BASE);
+    uint8_t i;
+
+    if ((address - SIM_RAM_BASE >= SIM_RAM_SIZE) || (address - SIM_RAM_BASE + size > SIM_RAM_SIZE))
+    {
+        return 1;
+    }
+    if (write)
+    {
+        for (i = 0; i < size; i++)
+        {
+            p[i] = *value >> (8 * (size - 1 - i));
+        }
+    }
+    else
+    {
+        *value = 0;
+        for (i = 0; i < size; i++)
+        {
+            *value = (*value << 8) | p[i];
+        }
+    }
+    return 0;
+}
+
+/* carries out a command once its extension words are there */
+static void tgt_command(uint16_t cmd)
+{
+    uint8_t size = 1 << ((cmd >> 6) & 3);           /* 8, 16 or 32 bit memory access */
+    uint32_t value;
+
+    tgt_next = SIM_COMPLETE;
+    switch (cmd & 0xfff0)
+    {
+        case BDMCF_CMD_RDMREG:
+            tgt_result(tgt_dmregs[cmd & 0x0f], 4);
+            if ((cmd & 0x0f) == 0)
+            {
+                tgt_dmregs[0] &= BDMCF_CSR_STATIC_MASK;     /* the status bits clear when read */
+            }
+            return;
+        case BDMCF_CMD_WDMREG:
+            tgt_dmregs[cmd & 0x0f] = (tgt_ext[0] << 16) | tgt_ext[1];
+            return;
+        case BDMCF_CMD_RAREG:
+            tgt_result(sim_target_regs[cmd & 0x0f], 4);
+            return;
+        case BDMCF_CMD_WAREG:
+            sim_target_regs[cmd & 0x0f] = (tgt_ext[0] << 16) | tgt_ext[1];
+            return;
+    }
+    switch (cmd)
+    {
+        case BDMCF_CMD_RCREG:
+            tgt_result(tgt_cregs[tgt_ext[1] & 0x0fff], 4);
+            return;
+        case BDMCF_CMD_WCREG:
+            tgt_cregs[tgt_ext[1] & 0x0fff] = (tgt_ext[2] << 16) | tgt_ext[3];
+            return;
+        case BDMCF_CMD_GO:
+            if (tgt_dmregs[0] & 0x10)
+            {
+                tgt_cregs[BDMCF_CREG_PC & 0x0fff] += 2;     /* SSM: one instruction, a word long, then halted */
+            }
+            return;
+        case BDMCF_CMD_READ8:
+        case BDMCF_CMD_READ16:
+        case BDMCF_CMD_READ32:
+        case BDMCF_CMD_DUMP8:
+        case BDMCF_CMD_DUMP16:
+        case BDMCF_CMD_DUMP32:
+            if ((cmd & 0x0f00) == 0x0900)
+            {
+                tgt_address = (tgt_ext[0] << 16) | tgt_ext[1];
+            }
+            else
+            {
+                tgt_address += size;
+            }
+            if (tgt_memory(0, tgt_address, size, &value))
+            {
+                tgt_next = SIM_BUS_ERROR;
+                return;
+            }
+            tgt_result(value, size);
+            return;
+        case BDMCF_CMD_WRITE8:
+        case BDMCF_CMD_WRITE16:
+        case BDMCF_CMD_WRITE32:
+        case BDMCF_CMD_FILL8:
+        case BDMCF_CMD_FILL16:
+        case BDMCF_CMD_FILL32:
+            if ((cmd & 0x0f00) == 0x0800)
+            {
+                tgt_address = (tgt_ext[0] << 16) | tgt_ext[1];
+                value = (size == 4) ? (tgt_ext[2] << 16) | tgt_ext[3] : tgt_ext[2];
+            }
+            else
+            {
+                tgt_address += size;
+                value = (size == 4) ? (tgt_ext[0] << 16) | tgt_ext[1] : tgt_ext[0];
+            }
+            if (tgt_memory(1, tgt_address, size, &value))
+            {
+                tgt_next = SIM_BUS_ERROR;
+            }
+            return;
+    }
+}
+
+/* executes a command once its extension words are there, memory accesses keep the target busy for */
+/* sim_target_wait messages */
+static void tgt_exec(uint16_t cmd)
+{
+    tgt_command(cmd);
+    if (sim_target_wait && ((cmd & 0xf000) == 0x1000) && ((cmd & 0x0f00) >= 0x0800))
+    {
+        tgt_held = tgt_next;
+        tgt_next = SIM_NOT_READY;
+        tgt_busy = sim_target_wait;
+    }
+}
+
+/* the target has received a whole message while sending tgt_out, works out what to send next */
+static void tgt_message(uint32_t mess)
+{
+    sim_frame_log[sim_frames++ & (SIM_FRAME_LOG - 1)] = mess;
+    if (mess & 0x10000)
+    {
+        sim_protocol_errors++;          /* the probe always sends the status bit as 0 */
+    }
+    if (sim_target_hook)
+    {
+        sim_target_hook();
+    }
+
+    if (tgt_busy)
+    {
+        tgt_next = (--tgt_busy) ? SIM_NOT_READY : tgt_held;  /* the message answered not ready is ignored */
+        return;
+    }
+
+    if (tgt_queued)
+    {
+        tgt_next = tgt_queue[0];        /* the message sent with a result word which is not the last is ignored */
+        tgt_queued = 0;
+        return;
+    }
+
+    if (tgt_ext_needed)
+    {
+        tgt_ext[tgt_ext_count++] = mess;
+        if (tgt_ext_count < tgt_ext_needed)
+        {
+            tgt_next = SIM_NOT_READY;
+            return;
+        }
+        tgt_ext_needed = 0;
+        tgt_exec(tgt_cmd);
+        return;
+    }
+
+    tgt_cmd = mess;
+    tgt_ext_count = 0;
+    tgt_ext_needed = tgt_ext_words(tgt_cmd);
+    if (tgt_ext_needed == 0xff)
+    {
+        tgt_ext_needed = 0;
+        tgt_next = SIM_ILLEGAL;
+    }
+    else if (tgt_ext_needed)
+    {
+        tgt_next = SIM_NOT_READY;
+    }
+    else
+    {
+        tgt_exec(tgt_cmd);
+    }
+}
+
+/* rising edge of DSCLK: the target latches din and presents its next bit, which is returned */
+static uint32_t tgt_clock(uint32_t din)
+{
+    uint32_t dout = (tgt_out >> (16 - tgt_bits)) & 1;
+
+    if (sim_target_detached)
+    {
+        dout = 1;                       /* nobody drives DSO, the line floats high */
+    }
+    else
+    {
+        tgt_in = (tgt_in << 1) | (din & 1);
+        if (++tgt_bits == 17)
+        {
+            tgt_message(tgt_in);
+            tgt_out = tgt_next;
+            tgt_in = 0;
+            tgt_bits = 0;
+        }
+    }
+
+    regs[SIM_GPIOA_PDIR] = (regs[SIM_GPIOA_PDIR] & ~(1 << 13)) | (dout << 13);
+    regs[SIM_GPIOC_PDIR] = (regs[SIM_GPIOC_PDIR] & ~(1 << 7)) | (dout << 7);
+    return dout;
+}
+
+/* returns non-zero if the pin is muxed to GPIO and an output */
+static uint32_t pin_output(int pcr, int pddr, uint32_t bit)
+{
+    return ((regs[pcr] & PORT_PCR_MUX_MASK) == PORT_PCR_MUX(1)) && (regs[pddr] & (1 << bit));
+}
+
+/* follows DSCLK and the data line of whichever transport drives them from GPIO */
+static void sim_pins(void)
+{
+    uint32_t dsclk;
+    uint32_t din;
+
+    if (pin_output(SIM_PORTA_PCR12, SIM_GPIOA_PDDR, 12))
+    {
+        dsclk = (regs[SIM_GPIOA_PDOR] >> 12) & 1;
+        din = pin_output(SIM_PORTD_PCR7, SIM_GPIOD_PDDR, 7) ? (regs[SIM_GPIOD_PDOR] >> 7) & 1 : 0;
+    }
+    else if (pin_output(SIM_PORTC_PCR5, SIM_GPIOC_PDDR, 5) && pin_output(SIM_PORTC_PCR6, SIM_GPIOC_PDDR, 6))
+    {
+        dsclk = (regs[SIM_GPIOC_PDOR] >> 5) & 1;    /* the SPI transport bit-bangs during resync */
+        din = (regs[SIM_GPIOC_PDOR] >> 6) & 1;
+    }
+    else
+    {
+        return;
+    }
+
+    if (dsclk && !pin_dsclk)
+    {
+        tgt_clock(din);
+    }
+    pin_dsclk = dsclk;
+}
+
+/* core cycles of one SCK period with the CTAR given (bus clock = core clock / 2) */
+static uint32_t spi_bit_cycles(uint32_t ctar)
+{
+    static const uint32_t pbr[4] = { 2, 3, 5, 7 };
+    static const uint32_t br[16] = { 2, 4, 6, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768 };
+
+    return 2 * pbr[(ctar & SPI_CTAR_PBR_MASK) >> SPI_CTAR_PBR_SHIFT] * br[ctar & SPI_CTAR_BR_MASK];
+}
+
+/* shifts a frame written to PUSHR through the target and puts the bits received into the Rx FIFO */
+static void spi_push(uint32_t pushr)
+{
+    uint32_t ctas = (pushr & SPI_PUSHR_CTAS_MASK) >> SPI_PUSHR_CTAS_SHIFT;
+    uint32_t ctar = regs[ctas ? SIM_SPI0_CTAR1 : SIM_SPI0_CTAR0];
+    uint32_t bits = ((ctar & SPI_CTAR_FMSZ_MASK) >> SPI_CTAR_FMSZ_SHIFT) + 1;
+    uint32_t cont = (pushr & SPI_PUSHR_CONT_MASK) != 0;
+    uint32_t rx = 0;
+    uint32_t i;
+
+    sim_push_log[sim_pushes++ & (SIM_FRAME_LOG - 1)] = pushr;
+
+    /* a 17 bit message is a 9 bit frame with continuous chip select followed by an 8 bit frame */
+    if ((ctas > 1) || (spi_second_half ? ((bits != 8) || cont) : ((bits != 9) || !cont)))
+    {
+        sim_protocol_errors++;
+    }
+    spi_second_half ^= 1;
+
+    for (i = bits; i > 0; i--)
+    {
+        rx = (rx << 1) | tgt_clock((pushr >> (i - 1)) & 1);
+    }
+    sim_cycles += bits * spi_bit_cycles(ctar);
+
+    if (spi_fifo_head - spi_fifo_tail < SIM_FIFO_SIZE)
+    {
+        spi_fifo[spi_fifo_head++ % SIM_FIFO_SIZE] = rx;
+    }
+}
+
+/* takes the oldest entry of the Rx FIFO, 0 if it is empty */
+static uint32_t spi_pop(void)
+{
+    if (spi_fifo_tail == spi_fifo_head)
+    {
+        return 0;
+    }
+    return spi_fifo[spi_fifo_tail++ % SIM_FIFO_SIZE];
+}
+
+/* runs the major loop of the DMA channel whose TCD starts at register tcd */
+static void dma_channel(int tcd)
+{
+    uint32_t attr = regs[tcd + 2];
+    uint32_t ssize = 1 << ((attr & DMA_ATTR_SSIZE_MASK) >> DMA_ATTR_SSIZE_SHIFT);
+    uint32_t dsize = 1 << ((attr & DMA_ATTR_DSIZE_MASK) >> DMA_ATTR_DSIZE_SHIFT);
+    uint32_t saddr = regs[tcd + 0];
+    uint32_t daddr = regs[tcd + 5];
+    uint32_t n = regs[tcd + 7];
+    uint32_t value;
+
+    while (n--)
+    {
+        value = 0;
+        if (saddr == (uint32_t) (uintptr_t) &regs[SIM_SPI0_POPR])
+        {
+            value = spi_pop();
+        }
+        else
+        {
+            memcpy(&value, (void *) (uintptr_t) saddr, ssize);
+        }
+        if (daddr == (uint32_t) (uintptr_t) &regs[SIM_SPI0_PUSHR])
+        {
+            spi_push(value);
+        }
+        else
+        {
+            memcpy((void *) (uintptr_t) daddr, &value, dsize);
+        }
+        saddr += (int16_t) regs[tcd + 1];
+        daddr += (int16_t) regs[tcd + 6];
+    }
+    regs[tcd + 10] |= DMA_CSR_DONE_MASK;
+}
+
+/* returns non-zero and the value written if the write-only register id has been written */
+static int sim_written(int id, uint32_t *value)
+{
+    if (regs[id] == SIM_UNWRITTEN)
+    {
+        return 0;
+    }
+    *value = regs[id];
+    regs[id] = SIM_UNWRITTEN;
+    return 1;
+}
+
+/* applies the side effects of the last register access */
+static void sim_commit(void)
+{
+    int id = pending;
+    uint32_t v;
+
+    pending = SIM_NONE;
+    switch (id)
+    {
+        case SIM_NONE:
+            return;
+        case SIM_BITBAND:
+            *bitband_reg = (*bitband_reg & ~(1u << bitband_bit)) | ((bitband_cell & 1) << bitband_bit);
+            break;
+        case SIM_GPIOA_PSOR: case SIM_GPIOC_PSOR: case SIM_GPIOD_PSOR:
+            if (sim_written(id, &v))
+                regs[id - 1] |= v;                  /* PDOR is just before PSOR */
+            break;
+        case SIM_GPIOA_PCOR: case SIM_GPIOC_PCOR: case SIM_GPIOD_PCOR:
+            if (sim_written(id, &v))
+                regs[id - 2] &= ~v;
+            break;
+        case SIM_GPIOA_PTOR: case SIM_GPIOC_PTOR: case SIM_GPIOD_PTOR:
+            if (sim_written(id, &v))
+                regs[id - 3] ^= v;
+            break;
+        case SIM_SPI0_PUSHR:
+            if (sim_written(id, &v))
+                spi_push(v);
+            break;
+        case SIM_SPI0_MCR:
+            if (regs[id] & SPI_MCR_CLR_RXF_MASK)
+                spi_fifo_tail = spi_fifo_head;
+            regs[id] &= ~(SPI_MCR_CLR_TXF_MASK | SPI_MCR_CLR_RXF_MASK);
+            break;
+        case SIM_DMA_SERQ:
+            if (sim_written(id, &v))
+                dma_requests |= 1 << (v & 0x0f);
+            if ((dma_requests & 3) == 3)            /* Tx channel 1 feeds the target, Rx channel 0 collects */
+            {
+                dma_requests &= ~3;
+                dma_channel(SIM_DMA_TCD1_SADDR);
+                dma_channel(SIM_DMA_TCD0_SADDR);
+            }
+            break;
+        case SIM_DMA_CDNE:
+            if (sim_written(id, &v))
+                regs[(v & 0x0f) ? SIM_DMA_TCD1_CSR : SIM_DMA_TCD0_CSR] &= ~DMA_CSR_DONE_MASK;
+            break;
+        case SIM_USB0_CTL:
+            if (regs[id] & USB_CTL_ODDRST_MASK)
+                memset(usb_odd, 0, sizeof(usb_odd));
+            regs[id] &= ~USB_CTL_ODDRST_MASK;
+            break;
+        case SIM_USB0_USBTRC0:
+            regs[id] &= ~USB_USBTRC0_USBRESET_MASK;  /* the module reset is over at once */
+            break;
+    }
+    sim_pins();
+}
+
+/* every access of a simulated register goes through here, see sim.h */
+volatile uint32_t *sim_reg(int id)
+{
+    uint32_t n;
+
+    sim_commit();
+    sim_cycles += SIM_ACCESS_CYCLES;
+
+    switch (id)
+    {
+        case SIM_SPI0_POPR:
+            if (spi_fifo_tail != spi_fifo_head)
+            {
+                regs[id] = spi_pop();
+            }
+            break;
+        case SIM_SPI0_SR:
+            n = spi_fifo_head - spi_fifo_tail;
+            regs[id] = (regs[id] & ~(SPI_SR_RXCTR_MASK | SPI_SR_RFDF_MASK)) | ((n > 15 ? 15 : n) << SPI_SR_RXCTR_SHIFT);
+            if (n)
+            {
+                regs[id] |= SPI_SR_RFDF_MASK;
+            }
+            break;
+        case SIM_DWT_CYCCNT:
+            regs[id] = (uint32_t) sim_cycles;
+            break;
+    }
+    pending = id;
+    return &regs[id];
+}
+
+/* bit-band alias of bit in reg, the bit is written back when the next access starts */
+volatile uint32_t *sim_bitband(volatile uint32_t *reg, uint32_t bit)
+{
+    sim_commit();
+    bitband_reg = reg;
+    bitband_bit = bit;
+    bitband_cell = (*reg >> bit) & 1;
+    pending = SIM_BITBAND;
+    return &bitband_cell;
+}
+
+/* returns the buffer descriptor the USB module uses next for the endpoint & direction (0 = RX, 1 = TX) */
+static struct sim_bdt *usb_bdt(uint8_t ep, uint8_t tx)
+{
+    uintptr_t table = ((regs[SIM_USB0_BDTPAGE3] & 0xff) << 24) | ((regs[SIM_USB0_BDTPAGE2] & 0xff) << 16) |
+                      ((regs[SIM_USB0_BDTPAGE1] & 0xfe) << 8);
+
+    return (struct sim_bdt *) table + ((ep << 2) | (tx << 1) | usb_odd[ep][tx]);
+}
+
+/* returns SIM_USB_NAK or SIM_USB_STALL if the device does not take the transaction, 0 if it does */
+/* a descriptor which does not expect the packet's DATA0/1 is counted in sim_usb_toggle_errors */
+static int usb_ready(uint8_t ep, uint8_t tx, struct sim_bdt *bdt)
+{
+    if (regs[SIM_USB0_ENDPT0 + ep] & USB_ENDPT_EPSTALL_MASK)
+    {
+        return SIM_USB_STALL;
+    }
+    if (!(bdt->desc & SIM_BDT_OWN))
+    {
+        return SIM_USB_NAK;
+    }
+    if (bdt->desc & SIM_BDT_STALL)
+    {
+        return SIM_USB_STALL;
+    }
+    if ((bdt->desc & SIM_BDT_DTS) && (((bdt->desc & SIM_BDT_DATA1) != 0) != usb_toggle[ep][tx]))
+    {
+        sim_usb_toggle_errors++;
+    }
+    return 0;
+}
+
+/* ends a transaction: the descriptor goes back to the device with the PID & byte count and TOKDNE is raised */
+static void usb_token_done(uint8_t ep, uint8_t tx, struct sim_bdt *bdt, uint8_t pid, uint32_t length)
+{
+    bdt->desc = (length << 16) | (bdt->desc & SIM_BDT_DATA1) | (pid << 2);
+    regs[SIM_USB0_STAT] = (ep << USB_STAT_ENDP_SHIFT) | (tx << USB_STAT_TX_SHIFT) | (usb_odd[ep][tx] << USB_STAT_ODD_SHIFT);
+    regs[SIM_USB0_ISTAT] = USB_ISTAT_TOKDNE_MASK;
+    usb_odd[ep][tx] ^= 1;
+    usb_toggle[ep][tx] ^= 1;
+
+    USBOTG_IRQHandler();
+    sim_commit();
+    regs[SIM_USB0_ISTAT] = 0;
+}
+
+/* resets the bus, the device is at address 0 and unconfigured afterwards */
+void sim_usb_reset(void)
+{
+    sim_commit();
+    memset(usb_odd, 0, sizeof(usb_odd));
+    memset(usb_toggle, 0, sizeof(usb_toggle));
+    regs[SIM_USB0_ISTAT] = USB_ISTAT_USBRST_MASK;
+    USBOTG_IRQHandler();
+    sim_commit();
+    regs[SIM_USB0_ISTAT] = 0;
+}
+
+/* sends the 8 bytes of a SETUP packet to EP0, it also ends a stall of the endpoint */
+int sim_usb_setup(const uint8_t *setup)
+{
+    struct sim_bdt *bdt;
+
+    sim_commit();
+    regs[SIM_USB0_ENDPT0] &= ~USB_ENDPT_EPSTALL_MASK;
+    bdt = usb_bdt(0, 0);
+    if (!(bdt->desc & SIM_BDT_OWN))
+    {
+        return SIM_USB_NAK;
+    }
+    memcpy(bdt->addr, setup, 8);
+    usb_toggle[0][0] = 0;
+    usb_toggle[0][1] = 1;               /* the data stage starts with DATA1 */
+    usb_token_done(0, 0, bdt, SIM_PID_SETUP, 8);
+    return 0;
+}
+
+/* sends a packet of length bytes to the endpoint, returns length or SIM_USB_NAK / SIM_USB_STALL */
+int sim_usb_out(uint8_t ep, const uint8_t *data, uint32_t length)
+{
+    struct sim_bdt *bdt;
+    int result;
+
+    sim_commit();
+    bdt = usb_bdt(ep, 0);
+    result = usb_ready(ep, 0, bdt);
+    if (result)
+    {
+        return result;
+    }
+    if (length)
+    {
+        memcpy(bdt->addr, data, length);
+    }
+    usb_token_done(ep, 0, bdt, SIM_PID_OUT, length);
+    return length;
+}
+
+/* reads a packet of up to max bytes from the endpoint, returns its length or SIM_USB_NAK / SIM_USB_STALL */
+int sim_usb_in(uint8_t ep, uint8_t *data, uint32_t max)
+{
+    struct sim_bdt *bdt;
+    uint32_t length;
+    int result;
+
+    sim_commit();
+    bdt = usb_bdt(ep, 1);
+    result = usb_ready(ep, 1, bdt);
+    if (result)
+    {
+        return result;
+    }
+    length = (bdt->desc >> 16) & 0x3ff;
+    if (length > max)
+    {
+        length = max;
+    }
+    if (length)
+    {
+        memcpy(data, bdt->addr, length);
+    }
+    usb_token_done(ep, 1, bdt, SIM_PID_IN, length);
+    return length;
+}
+
+/* the delay loop of the shift engine, 3 cycles per pass */
+void sim_delay(uint32_t loops)
+{
+    sim_cycles += 3 * (uint64_t) loops;
+}
+
+/* USUB8: byte-wise a - b, GE flag n is set if byte n of a is not below byte n of b */
+uint32_t sim_usub8(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+    int i;
+
+    apsr_ge = 0;
+    for (i = 0; i < 4; i++)
+    {
+        r |= ((((a >> (8 * i)) & 0xff) - ((b >> (8 * i)) & 0xff)) & 0xff) << (8 * i);
+        if (((a >> (8 * i)) & 0xff) >= ((b >> (8 * i)) & 0xff))
+        {
+            apsr_ge |= 1 << i;
+        }
+    }
+    return r;
+}
+
+/* SEL: byte n from a if GE flag n is set, from b otherwise */
+uint32_t sim_sel(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        r |= (((apsr_ge >> i) & 1) ? a : b) & (0xffu << (8 * i));
+    }
+    return r;
+}
+
+void wait_us(uint32_t us)
+{
+    sim_cycles += (uint64_t) us * (SIM_CORE_KHZ / 1000);
+}
+
+void wait_ms(uint32_t ms)
+{
+    sim_cycles += (uint64_t) ms * SIM_CORE_KHZ;
+}
+
+void enable_irq(int irq)
+{
+}
+
+void disable_irq(int irq)
+{
+}
+
+void xprintf(const char *fmt, ...)
+{
+}
@@ -0,0 +1,284 @@
+/*
+ * sim.h
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Simulated K20 registers for the host build (make host).
+ *
+ * This header is included ahead of every source of the host build (gcc -include). It pulls in MK20D7.h for
+ * the bit definitions and then points the registers the BDM layer uses at sim_reg(), which keeps them in
+ * an array. An access only takes effect when the next one starts (a register macro cannot tell a read from
+ * a write), sim.c then moves the pins, clocks the simulated target and runs the SPI module and the DMA.
+ * The USB registers are kept for tbdm.c, whose transactions are run by the sim_usb_x() functions.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include "MK20D7.h"
+
+#define SIM_REGS(X) \
+    X(GPIOA_PDOR) X(GPIOA_PSOR) X(GPIOA_PCOR) X(GPIOA_PTOR) X(GPIOA_PDIR) X(GPIOA_PDDR) \
+    X(GPIOC_PDOR) X(GPIOC_PSOR) X(GPIOC_PCOR) X(GPIOC_PTOR) X(GPIOC_PDIR) X(GPIOC_PDDR) \
+    X(GPIOD_PDOR) X(GPIOD_PSOR) X(GPIOD_PCOR) X(GPIOD_PTOR) X(GPIOD_PDIR) X(GPIOD_PDDR) \
+    X(PORTA_PCR12) X(PORTA_PCR13) X(PORTC_PCR5) X(PORTC_PCR6) X(PORTC_PCR7) \
+    X(PORTD_PCR0) X(PORTD_PCR2) X(PORTD_PCR3) X(PORTD_PCR4) X(PORTD_PCR7) X(PORTD_ISFR) \
+    X(SIM_SOPT2) X(SIM_CLKDIV2) X(SIM_SCGC4) X(SIM_SCGC6) X(SIM_SCGC7) \
+    X(SPI0_MCR) X(SPI0_CTAR0) X(SPI0_CTAR1) X(SPI0_SR) X(SPI0_RSER) X(SPI0_PUSHR) X(SPI0_POPR) \
+    X(DMAMUX_CHCFG0) X(DMAMUX_CHCFG1) X(DMA_SERQ) X(DMA_CDNE) \
+    X(DMA_TCD0_SADDR) X(DMA_TCD0_SOFF) X(DMA_TCD0_ATTR) X(DMA_TCD0_NBYTES_MLNO) X(DMA_TCD0_SLAST) X(DMA_TCD0_DADDR) X(DMA_TCD0_DOFF) X(DMA_TCD0_CITER_ELINKNO) X(DMA_TCD0_BITER_ELINKNO) X(DMA_TCD0_DLASTSGA) X(DMA_TCD0_CSR) \
+    X(DMA_TCD1_SADDR) X(DMA_TCD1_SOFF) X(DMA_TCD1_ATTR) X(DMA_TCD1_NBYTES_MLNO) X(DMA_TCD1_SLAST) X(DMA_TCD1_DADDR) X(DMA_TCD1_DOFF) X(DMA_TCD1_CITER_ELINKNO) X(DMA_TCD1_BITER_ELINKNO) X(DMA_TCD1_DLASTSGA) X(DMA_TCD1_CSR) \
+    X(DEMCR) X(DWT_CTRL) X(DWT_CYCCNT) \
+    X(USB0_ISTAT) X(USB0_INTEN) X(USB0_ERRSTAT) X(USB0_ERREN) X(USB0_OTGISTAT) X(USB0_STAT) X(USB0_CTL) X(USB0_ADDR) \
+    X(USB0_BDTPAGE1) X(USB0_BDTPAGE2) X(USB0_BDTPAGE3) X(USB0_ENDPT0) X(USB0_ENDPT1) X(USB0_ENDPT2) X(USB0_ENDPT3) \
+    X(USB0_USBCTRL) X(USB0_CONTROL) X(USB0_USBTRC0)
+
+#define SIM_REG_ID(name)    SIM_##name,
+
+enum
+{
+    SIM_REGS(SIM_REG_ID)
+    SIM_NREGS
+};
+
+#define SIM_REG(name)       (*sim_reg(SIM_##name))
+
+#undef GPIOA_PDOR
+#define GPIOA_PDOR               SIM_REG(GPIOA_PDOR)
+#undef GPIOA_PSOR
+#define GPIOA_PSOR               SIM_REG(GPIOA_PSOR)
+#undef GPIOA_PCOR
+#define GPIOA_PCOR               SIM_REG(GPIOA_PCOR)
+#undef GPIOA_PTOR
+#define GPIOA_PTOR               SIM_REG(GPIOA_PTOR)
+#undef GPIOA_PDIR
+#define GPIOA_PDIR               SIM_REG(GPIOA_PDIR)
+#undef GPIOA_PDDR
+#define GPIOA_PDDR               SIM_REG(GPIOA_PDDR)
+#undef GPIOC_PDOR
+#define GPIOC_PDOR               SIM_REG(GPIOC_PDOR)
+#undef GPIOC_PSOR
+#define GPIOC_PSOR               SIM_REG(GPIOC_PSOR)
+#undef GPIOC_PCOR
+#define GPIOC_PCOR               SIM_REG(GPIOC_PCOR)
+#undef GPIOC_PTOR
+#define GPIOC_PTOR               SIM_REG(GPIOC_PTOR)
+#undef GPIOC_PDIR
+#define GPIOC_PDIR               SIM_REG(GPIOC_PDIR)
+#undef GPIOC_PDDR
+#define GPIOC_PDDR               SIM_REG(GPIOC_PDDR)
+#undef GPIOD_PDOR
+#define GPIOD_PDOR               SIM_REG(GPIOD_PDOR)
+#undef GPIOD_PSOR
+#define GPIOD_PSOR               SIM_REG(GPIOD_PSOR)
+#undef GPIOD_PCOR
+#define GPIOD_PCOR               SIM_REG(GPIOD_PCOR)
+#undef GPIOD_PTOR
+#define GPIOD_PTOR               SIM_REG(GPIOD_PTOR)
+#undef GPIOD_PDIR
+#define GPIOD_PDIR               SIM_REG(GPIOD_PDIR)
+#undef GPIOD_PDDR
+#define GPIOD_PDDR               SIM_REG(GPIOD_PDDR)
+#undef PORTA_PCR12
+#define PORTA_PCR12              SIM_REG(PORTA_PCR12)
+#undef PORTA_PCR13
+#define PORTA_PCR13              SIM_REG(PORTA_PCR13)
+#undef PORTC_PCR5
+#define PORTC_PCR5               SIM_REG(PORTC_PCR5)
+#undef PORTC_PCR6
+#define PORTC_PCR6               SIM_REG(PORTC_PCR6)
+#undef PORTC_PCR7
+#define PORTC_PCR7               SIM_REG(PORTC_PCR7)
+#undef PORTD_PCR0
+#define PORTD_PCR0               SIM_REG(PORTD_PCR0)
+#undef PORTD_PCR2
+#define PORTD_PCR2               SIM_REG(PORTD_PCR2)
+#undef PORTD_PCR3
+#define PORTD_PCR3               SIM_REG(PORTD_PCR3)
+#undef PORTD_PCR4
+#define PORTD_PCR4               SIM_REG(PORTD_PCR4)
+#undef PORTD_PCR7
+#define PORTD_PCR7               SIM_REG(PORTD_PCR7)
+#undef PORTD_ISFR
+#define PORTD_ISFR               SIM_REG(PORTD_ISFR)
+#undef SIM_SOPT2
+#define SIM_SOPT2                SIM_REG(SIM_SOPT2)
+#undef SIM_CLKDIV2
+#define SIM_CLKDIV2              SIM_REG(SIM_CLKDIV2)
+#undef SIM_SCGC4
+#define SIM_SCGC4                SIM_REG(SIM_SCGC4)
+#undef SIM_SCGC6
+#define SIM_SCGC6                SIM_REG(SIM_SCGC6)
+#undef SIM_SCGC7
+#define SIM_SCGC7                SIM_REG(SIM_SCGC7)
+#undef SPI0_MCR
+#define SPI0_MCR                 SIM_REG(SPI0_MCR)
+#undef SPI0_CTAR0
+#define SPI0_CTAR0               SIM_REG(SPI0_CTAR0)
+#undef SPI0_CTAR1
+#define SPI0_CTAR1               SIM_REG(SPI0_CTAR1)
+#undef SPI0_SR
+#define SPI0_SR                  SIM_REG(SPI0_SR)
+#undef SPI0_RSER
+#define SPI0_RSER                SIM_REG(SPI0_RSER)
+#undef SPI0_PUSHR
+#define SPI0_PUSHR               SIM_REG(SPI0_PUSHR)
+#undef SPI0_POPR
+#define SPI0_POPR                SIM_REG(SPI0_POPR)
+#undef DMAMUX_CHCFG0
+#define DMAMUX_CHCFG0            SIM_REG(DMAMUX_CHCFG0)
+#undef DMAMUX_CHCFG1
+#define DMAMUX_CHCFG1            SIM_REG(DMAMUX_CHCFG1)
+#undef DMA_SERQ
+#define DMA_SERQ                 SIM_REG(DMA_SERQ)
+#undef DMA_CDNE
+#define DMA_CDNE                 SIM_REG(DMA_CDNE)
+#undef DMA_TCD0_SADDR
+#define DMA_TCD0_SADDR           SIM_REG(DMA_TCD0_SADDR)
+#undef DMA_TCD0_SOFF
+#define DMA_TCD0_SOFF            SIM_REG(DMA_TCD0_SOFF)
+#undef DMA_TCD0_ATTR
+#define DMA_TCD0_ATTR            SIM_REG(DMA_TCD0_ATTR)
+#undef DMA_TCD0_NBYTES_MLNO
+#define DMA_TCD0_NBYTES_MLNO     SIM_REG(DMA_TCD0_NBYTES_MLNO)
+#undef DMA_TCD0_SLAST
+#define DMA_TCD0_SLAST           SIM_REG(DMA_TCD0_SLAST)
+#undef DMA_TCD0_DADDR
+#define DMA_TCD0_DADDR           SIM_REG(DMA_TCD0_DADDR)
+#undef DMA_TCD0_DOFF
+#define DMA_TCD0_DOFF            SIM_REG(DMA_TCD0_DOFF)
+#undef DMA_TCD0_CITER_ELINKNO
+#define DMA_TCD0_CITER_ELINKNO   SIM_REG(DMA_TCD0_CITER_ELINKNO)
+#undef DMA_TCD0_BITER_ELINKNO
+#define DMA_TCD0_BITER_ELINKNO   SIM_REG(DMA_TCD0_BITER_ELINKNO)
+#undef DMA_TCD0_DLASTSGA
+#define DMA_TCD0_DLASTSGA        SIM_REG(DMA_TCD0_DLASTSGA)
+#undef DMA_TCD0_CSR
+#define DMA_TCD0_CSR             SIM_REG(DMA_TCD0_CSR)
+#undef DMA_TCD1_SADDR
+#define DMA_TCD1_SADDR           SIM_REG(DMA_TCD1_SADDR)
+#undef DMA_TCD1_SOFF
+#define DMA_TCD1_SOFF            SIM_REG(DMA_TCD1_SOFF)
+#undef DMA_TCD1_ATTR
+#define DMA_TCD1_ATTR            SIM_REG(DMA_TCD1_ATTR)
+#undef DMA_TCD1_NBYTES_MLNO
+#define DMA_TCD1_NBYTES_MLNO     SIM_REG(DMA_TCD1_NBYTES_MLNO)
+#undef DMA_TCD1_SLAST
+#define DMA_TCD1_SLAST           SIM_REG(DMA_TCD1_SLAST)
+#undef DMA_TCD1_DADDR
+#define DMA_TCD1_DADDR           SIM_REG(DMA_TCD1_DADDR)
+#undef DMA_TCD1_DOFF
+#define DMA_TCD1_DOFF            SIM_REG(DMA_TCD1_DOFF)
+#undef DMA_TCD1_CITER_ELINKNO
+#define DMA_TCD1_CITER_ELINKNO   SIM_REG(DMA_TCD1_CITER_ELINKNO)
+#undef DMA_TCD1_BITER_ELINKNO
+#define DMA_TCD1_BITER_ELINKNO   SIM_REG(DMA_TCD1_BITER_ELINKNO)
+#undef DMA_TCD1_DLASTSGA
+#define DMA_TCD1_DLASTSGA        SIM_REG(DMA_TCD1_DLASTSGA)
+#undef DMA_TCD1_CSR
+#define DMA_TCD1_CSR             SIM_REG(DMA_TCD1_CSR)
+#undef DEMCR
+#define DEMCR                    SIM_REG(DEMCR)
+#undef DWT_CTRL
+#define DWT_CTRL                 SIM_REG(DWT_CTRL)
+#undef DWT_CYCCNT
+#define DWT_CYCCNT               SIM_REG(DWT_CYCCNT)
+#undef USB0_ISTAT
+#define USB0_ISTAT               SIM_REG(USB0_ISTAT)
+#undef USB0_INTEN
+#define USB0_INTEN               SIM_REG(USB0_INTEN)
+#undef USB0_ERRSTAT
+#define USB0_ERRSTAT             SIM_REG(USB0_ERRSTAT)
+#undef USB0_ERREN
+#define USB0_ERREN               SIM_REG(USB0_ERREN)
+#undef USB0_OTGISTAT
+#define USB0_OTGISTAT            SIM_REG(USB0_OTGISTAT)
+#undef USB0_STAT
+#define USB0_STAT                SIM_REG(USB0_STAT)
+#undef USB0_CTL
+#define USB0_CTL                 SIM_REG(USB0_CTL)
+#undef USB0_ADDR
+#define USB0_ADDR                SIM_REG(USB0_ADDR)
+#undef USB0_BDTPAGE1
+#define USB0_BDTPAGE1            SIM_REG(USB0_BDTPAGE1)
+#undef USB0_BDTPAGE2
+#define USB0_BDTPAGE2            SIM_REG(USB0_BDTPAGE2)
+#undef USB0_BDTPAGE3
+#define USB0_BDTPAGE3            SIM_REG(USB0_BDTPAGE3)
+#undef USB0_ENDPT0
+#define USB0_ENDPT0              SIM_REG(USB0_ENDPT0)
+#undef USB0_ENDPT1
+#define USB0_ENDPT1              SIM_REG(USB0_ENDPT1)
+#undef USB0_ENDPT2
+#define USB0_ENDPT2              SIM_REG(USB0_ENDPT2)
+#undef USB0_ENDPT3
+#define USB0_ENDPT3              SIM_REG(USB0_ENDPT3)
+#undef USB0_USBCTRL
+#define USB0_USBCTRL             SIM_REG(USB0_USBCTRL)
+#undef USB0_CONTROL
+#define USB0_CONTROL             SIM_REG(USB0_CONTROL)
+#undef USB0_USBTRC0
+#define USB0_USBTRC0             SIM_REG(USB0_USBTRC0)
+
+#undef BITBAND_REG
+#define BITBAND_REG(reg, bit)   (*sim_bitband(&(reg), (bit)))
+
+volatile uint32_t *sim_reg(int id);
+volatile uint32_t *sim_bitband(volatile uint32_t *reg, uint32_t bit);
+void sim_delay(uint32_t loops);
+
+/* the SIMD instructions of the Cortex-M4 (bdmcf_mem.c), with sim_dsp 0 the code takes its plain C path instead */
+extern uint32_t sim_dsp;
+
+uint32_t sim_usub8(uint32_t a, uint32_t b);
+uint32_t sim_sel(uint32_t a, uint32_t b);
+
+/* the simulated target and what the tests look at (sim.c) */
+#define SIM_CORE_KHZ        96000
+#define SIM_RAM_BASE        0x20000000u
+#define SIM_RAM_SIZE        0x10000u
+#define SIM_FRAME_LOG       64          /* must be a power of two */
+
+extern uint64_t sim_cycles;             /* core cycles the probe would have spent */
+extern uint8_t sim_ram[SIM_RAM_SIZE];   /* target memory at SIM_RAM_BASE, anything else answers bus error */
+extern uint32_t sim_target_regs[16];    /* D0-D7, A0-A7 */
+extern uint32_t sim_frames;             /* 17 bit messages received by the target */
+extern uint32_t sim_frame_log[SIM_FRAME_LOG];   /* the last ones, message n is at n % SIM_FRAME_LOG */
+extern uint32_t sim_protocol_errors;    /* status bits sent as 1, SPI messages not split 9 + 8 bits */
+extern uint32_t sim_pushes;             /* SPI frames written to PUSHR */
+extern uint32_t sim_push_log[SIM_FRAME_LOG];    /* the last ones, like sim_frame_log */
+extern uint32_t sim_target_wait;        /* messages answered not ready (and ignored) after each memory access */
+extern void (*sim_target_hook)(void);   /* called for each message the target receives, e.g. to interrupt a command */
+extern uint32_t sim_target_detached;    /* no target on the cable: DSO reads 1 */
+
+void sim_reset(void);
+void sim_target_halt(uint32_t status, uint32_t pc);
+
+/* the USB host side (sim.c), endpoints 0-3 */
+#define SIM_USB_NAK         -1
+#define SIM_USB_STALL       -2
+
+extern uint32_t sim_usb_toggle_errors;  /* packets whose DATA0/1 the buffer descriptor did not expect */
+
+void sim_usb_reset(void);
+int sim_usb_setup(const uint8_t *setup);
+int sim_usb_out(uint8_t ep, const uint8_t *data, uint32_t length);
+int sim_usb_in(uint8_t ep, uint8_t *data, uint32_t max);
+
+#endif /* SIM_H */
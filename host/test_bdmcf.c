@@ -0,0 +1,1694 @@
+/*
+ * test_bdmcf.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Tests of the BDM layer against the simulated target (make host).
+ *
+ * Every speed is checked for the encoding of the 17 bit messages on the pins (MSB first, the status bit
+ * sent as 0) and for register and memory commands going through command_exec(). The SPI transport is
+ * also checked for the 9 + 8 bit split of the PUSHR frames and for the messages bdmcf_spi_dump() and
+ * bdmcf_spi_fill() put together from the DMA buffers. The DSCLK rate of each speed is worked out from the
+ * simulated cycle count and compared with the documented one, the host's own message rate is printed
+ * for reference. The USB side is driven through tbdm.c with the main loop of tbdm_main.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+#include "crc32.h"
+#include "events.h"
+#include "rle.h"
+#include "usb.h"
+
+#define TEST_ADDRESS        (SIM_RAM_BASE + 0x100)
+#define TEST_FRAMES         2000        /* messages timed per speed */
+#define TEST_IMAGE          4096        /* bytes of the memory images run length encoded */
+#define TEST_IMAGES         4
+
+#define USB_SET_CONFIGURATION   0x09
+
+static const uint32_t dsclk_hz[BDMCF_SPEEDS] =     /* as documented at BDMCF_DELAY_x & bdmcf_spi_ctar[] */
+{
+    400, 6000, 100000, 330000, 1000000, 2500000, 6000000, 1000000, 2000000, 4000000, 6000000, 8000000, 12000000
+};
+
+static uint8_t buffer[2 + MAX_DATA_SIZE];
+static int failures;
+
+#define CHECK(cond, ...)                                                \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                 \
+            printf(__VA_ARGS__);                                        \
+            printf("\n");                                               \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+/* runs a command with the parameters given, size as command_exec() expects it */
+/* returns the number of bytes of the response, 0 if the command failed */
+static uint8_t exec(uint8_t cmd, const uint8_t *params, uint8_t count, uint32_t size)
+{
+    uint8_t length;
+
+    memset(buffer, 0, sizeof(buffer));
+    buffer[1] = cmd;
+    memcpy(buffer + 2, params, count);
+    length = command_exec(buffer, size, TRANSPORT_BULK);
+    return (buffer[0] == cmd) ? length : 0;
+}
+
+/* returns non-zero if the target has received the count messages given back to back since the log was cleared */
+static int frames_sent(const uint32_t *frames, uint32_t count)
+{
+    uint32_t first;
+    uint32_t i;
+
+    for (first = 0; first + count <= sim_frames && first + count <= SIM_FRAME_LOG; first++)
+    {
+        for (i = 0; (i < count) && (sim_frame_log[first + i] == frames[i]); i++)
+        {
+            ;
+        }
+        if (i == count)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* messages sent for a register write and the value read back */
+static void test_registers(uint8_t speed)
+{
+    static const uint32_t patterns[] = { 0x00000000, 0xffffffff, 0xa5a5a5a5, 0x5a5a5a5a, 0x80000001, 0x12345678 };
+    uint8_t params[5];
+    uint32_t frames[3];
+    uint32_t i;
+
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+    {
+        params[0] = 8 + (i & 7);                    /* A0-A7 */
+        put_be32(params + 1, patterns[i]);
+        sim_frames = 0;
+        CHECK(exec(CMD_WRITE_REG, params, 5, 5) == 1, "speed %u: write A%u failed", speed, i & 7);
+        frames[0] = BDMCF_CMD_WAREG + params[0];
+        frames[1] = patterns[i] >> 16;
+        frames[2] = patterns[i] & 0xffff;
+        CHECK(frames_sent(frames, 3), "speed %u: write A%u sent %05x %05x %05x", speed, i & 7,
+              sim_frame_log[0], sim_frame_log[1], sim_frame_log[2]);
+        CHECK(sim_target_regs[params[0]] == patterns[i], "speed %u: A%u is %08x instead of %08x",
+              speed, i & 7, sim_target_regs[params[0]], patterns[i]);
+
+        sim_target_regs[params[0]] = ~patterns[i];
+        bdmcf_shadow_invalidate();
+        CHECK(exec(CMD_READ_REG, params, 1, 1) == 5 && get_be32(buffer + 1) == ~patterns[i],
+              "speed %u: read A%u returned %08x instead of %08x", speed, i & 7, get_be32(buffer + 1), ~patterns[i]);
+    }
+}
+
+/* block writes & reads of every width, the last one from memory which is not there */
+static void test_memory(uint8_t speed)
+{
+    static const uint8_t cmds[3][2] =
+    {
+        { CMD_WRITE_MEMBLOCK8, CMD_READ_MEMBLOCK8 },
+        { CMD_WRITE_MEMBLOCK16, CMD_READ_MEMBLOCK16 },
+        { CMD_WRITE_MEMBLOCK32, CMD_READ_MEMBLOCK32 },
+    };
+    uint8_t params[4 + 64];
+    uint32_t width;
+    uint32_t i;
+
+    for (width = 0; width < 3; width++)
+    {
+        put_be32(params, TEST_ADDRESS);
+        for (i = 0; i < 64; i++)
+        {
+            params[4 + i] = (speed << 5) + (width << 6) + i * 7;
+        }
+        memset(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE), 0, 64);
+        CHECK(exec(cmds[width][0], params, 4 + 64, 4 + 64) == 1, "speed %u: write block %u failed", speed, 8 << width);
+        CHECK(memcmp(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE), params + 4, 64) == 0,
+              "speed %u: write block %u wrote the wrong data", speed, 8 << width);
+
+        memset(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE), 0x3c ^ width, 64);
+        CHECK(exec(cmds[width][1], params, 4, 64) == 1 + 64, "speed %u: read block %u failed", speed, 8 << width);
+        for (i = 0; i < 64; i++)
+        {
+            if (buffer[1 + i] != (0x3c ^ width))
+            {
+                break;
+            }
+        }
+        CHECK(i == 64, "speed %u: read block %u byte %u is %02x", speed, 8 << width, i, buffer[1 + i]);
+    }
+
+    put_be32(params, 0x10000000);
+    CHECK(exec(CMD_READ_MEM32, params, 4, 4) == 0, "speed %u: read of missing memory passed", speed);
+    CHECK(exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1, "speed %u: resync after a bus error failed", speed);
+}
+
+/* returns non-zero if every SPI frame since the log was cleared is half of a 17 bit message, 9 bits with */
+/* the chip select kept asserted on CTAR0 followed by 8 bits on CTAR1, and they make up the messages received */
+static int pushes_split(void)
+{
+    uint32_t i;
+
+    if ((sim_pushes != 2 * sim_frames) || (sim_pushes > SIM_FRAME_LOG))
+    {
+        return 0;
+    }
+    for (i = 0; i < sim_pushes; i += 2)
+    {
+        if (((sim_push_log[i] & ~0x1ff) != (SPI_PUSHR_CONT_MASK | SPI_PUSHR_CTAS(0))) ||
+            ((sim_push_log[i + 1] & ~0xff) != SPI_PUSHR_CTAS(1)) ||
+            ((((sim_push_log[i] & 0x1ff) << 8) | (sim_push_log[i + 1] & 0xff)) != sim_frame_log[i / 2]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* the SPI transport: PUSHR frames, status bit of the responses & the DMA blocks of both element sizes */
+static void test_spi(void)
+{
+    uint8_t params[4 + 124];
+    uint8_t data[2 * 60];
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint32_t i;
+
+    sim_frames = sim_pushes = 0;
+    bdmcf_txrx17_ptr(BDMCF_CMD_RAREG + 9);
+    bdmcf_txrx17_ptr(0xffff);                   /* not a command, answered illegal */
+    bdmcf_txrx17_ptr(0x5aa5);
+    CHECK(pushes_split(), "SPI: frames not split 9 + 8 bits");
+    sim_target_regs[9] = 0x8001ff00;
+    sim_frames = sim_pushes = 0;
+    bdmcf_txrx17_ptr(BDMCF_CMD_RAREG + 9);
+    CHECK(bdmcf_txrx17_ptr(BDMCF_CMD_NOP) == 0x08001, "SPI: MSW of A1 received wrong");
+    CHECK(bdmcf_txrx17_ptr(0xffff) == 0x0ff00, "SPI: LSW of A1 received wrong");
+    CHECK(bdmcf_txrx17_ptr(BDMCF_CMD_NOP) == 0x1ffff, "SPI: illegal command not reported");
+    CHECK(pushes_split(), "SPI: frames not split 9 + 8 bits");
+
+    /* the largest blocks, 30 & 31 dwords: FILL32 & DUMP32 with 2 messages per element */
+    for (i = 0; i < 124; i++)
+    {
+        params[4 + i] = 0xff - i * 3;
+    }
+    put_be32(params, TEST_ADDRESS);
+    memset(ram, 0, 124);
+    CHECK(exec(CMD_WRITE_MEMBLOCK32, params, 4 + 120, 4 + 120) == 1, "SPI: write block of 120 bytes failed");
+    CHECK(memcmp(ram, params + 4, 120) == 0, "SPI: write block of 120 bytes wrote the wrong data");
+    memset(ram + 4, 0x81, 120);
+    CHECK(exec(CMD_READ_MEMBLOCK32, params, 4, 124) == 1 + 124, "SPI: read block of 124 bytes failed");
+    CHECK(memcmp(buffer + 1, ram, 124) == 0, "SPI: read block of 124 bytes returned the wrong data");
+
+    /* 60 words: DUMP16 & FILL16 with 1 message per element */
+    for (i = 0; i < 2 * 60; i++)
+    {
+        ram[i] = i * 5 + 0x80;
+    }
+    bdmcf_tx_msg(BDMCF_CMD_READ16);
+    bdmcf_tx_msg(TEST_ADDRESS >> 16);
+    bdmcf_tx_msg(TEST_ADDRESS & 0xffff);
+    CHECK(bdmcf_spi_dump(60, 1, data, BDMCF_CMD_DUMP16) == 0, "SPI: dump of 60 words failed");
+    CHECK(memcmp(data, ram, 2 * 60) == 0, "SPI: dump of 60 words returned the wrong data");
+
+    memset(ram, 0, 2 * 60);
+    for (i = 0; i < 2 * 60; i++)
+    {
+        data[i] = 0xfe - i;
+    }
+    bdmcf_tx_msg(BDMCF_CMD_WRITE16);
+    bdmcf_tx_msg(TEST_ADDRESS >> 16);
+    bdmcf_tx_msg(TEST_ADDRESS & 0xffff);
+    bdmcf_tx_msg((data[0] << 8) | data[1]);
+    CHECK(bdmcf_spi_fill(59, 1, data + 2, BDMCF_CMD_FILL16) == 0 && bdmcf_complete_chk_rx() == 0, "SPI: fill of 60 words failed");
+    CHECK(memcmp(ram, data, 2 * 60) == 0, "SPI: fill of 60 words wrote the wrong data");
+
+    /* a target busy after each access answers the next messages not ready and ignores them: the FILLs and */
+    /* DUMPs have to be repeated and no data word may be taken for a command (GO in the second dword) */
+    put_be16(params + 8, BDMCF_CMD_GO);
+    for (sim_target_wait = 1; sim_target_wait <= 3; sim_target_wait++)
+    {
+        memset(ram, 0, 124);
+        CHECK(exec(CMD_WRITE_MEMBLOCK32, params, 4 + 120, 4 + 120) == 1 && bdmcf_complete_chk_rx() == 0 &&
+              memcmp(ram, params + 4, 120) == 0, "SPI: write block to a busy target failed (wait %u)", sim_target_wait);
+        memset(ram + 120, 0x81, 4);
+        CHECK(exec(CMD_READ_MEMBLOCK32, params, 4, 124) == 1 + 124 && memcmp(buffer + 1, ram, 124) == 0,
+              "SPI: read block from a busy target failed (wait %u)", sim_target_wait);
+
+        memset(ram, 0, 2 * 60);
+        bdmcf_tx_msg(BDMCF_CMD_WRITE16);
+        bdmcf_tx_msg(TEST_ADDRESS >> 16);
+        bdmcf_tx_msg(TEST_ADDRESS & 0xffff);
+        bdmcf_tx_msg((data[0] << 8) | data[1]);
+        CHECK(bdmcf_spi_fill(59, 1, data + 2, BDMCF_CMD_FILL16) == 0 && bdmcf_complete_chk_rx() == 0 &&
+              memcmp(ram, data, 2 * 60) == 0, "SPI: fill of a busy target failed (wait %u)", sim_target_wait);
+        bdmcf_tx_msg(BDMCF_CMD_READ16);
+        bdmcf_tx_msg(TEST_ADDRESS >> 16);
+        bdmcf_tx_msg(TEST_ADDRESS & 0xffff);
+        memset(data, 0, 2 * 60);
+        CHECK(bdmcf_spi_dump(60, 1, data, BDMCF_CMD_DUMP16) == 0 && memcmp(data, ram, 2 * 60) == 0,
+              "SPI: dump of a busy target failed (wait %u)", sim_target_wait);
+    }
+    sim_target_wait = 0;
+
+    /* a dump running off the end of the memory reports the bus error */
+    bdmcf_tx_msg(BDMCF_CMD_READ32);
+    bdmcf_tx_msg((SIM_RAM_BASE + SIM_RAM_SIZE - 8) >> 16);
+    bdmcf_tx_msg((SIM_RAM_BASE + SIM_RAM_SIZE - 8) & 0xffff);
+    CHECK(bdmcf_spi_dump(4, 2, data, BDMCF_CMD_DUMP32) != 0, "SPI: bus error in a dump not reported");
+    CHECK(bdmcf_resync() == 0, "SPI: resync after a bus error failed");
+}
+
+/* a halt seen by a CSR read from the host ends the run & is reported, CMD_HALT ends the run itself */
+static void test_halt(void)
+{
+    uint8_t params[1] = { 0 };
+    uint8_t event[EVENT_SIZE];
+
+    while (event_pop(event))
+    {
+        ;                                       /* drop the bus errors of the memory tests */
+    }
+    CHECK(exec(CMD_GO, params, 0, 0) == 1 && bdmcf_running, "go failed");
+    sim_target_halt(0x20000000, TEST_ADDRESS);
+    CHECK(exec(CMD_READ_DREG, params, 1, 4) == 5 && (get_be32(buffer + 1) >> 28) == 2, "CSR read failed");
+    CHECK(!bdmcf_running, "halt read by CMD_READ_DREG did not end the run");
+    CHECK(event_pop(event) && (event[0] == EVENT_HALT) && (get_be32(event + 7) == TEST_ADDRESS) &&
+          (get_be32(event + 11) >> 28 == 2), "halt read by CMD_READ_DREG not reported");
+
+    CHECK(exec(CMD_GO, params, 0, 0) == 1 && bdmcf_running, "go failed");
+    CHECK(exec(CMD_HALT, params, 0, 0) == 1 && !bdmcf_running, "CMD_HALT did not end the run");
+}
+
+/* runs CMD_BREAKPOINT, returns the number of breakpoints or -1 if it failed */
+static int breakpoint(uint8_t op, uint32_t address)
+{
+    uint8_t params[5];
+
+    params[0] = op;
+    put_be32(params + 1, address);
+    return (exec(CMD_BREAKPOINT, params, 5, 5) == 2) ? buffer[1] : -1;
+}
+
+/* CMD_GO patches the HALTs in, they come out once the target is seen stopped or CMD_HALT stops it; a breakpoint */
+/* which cannot be patched in fails CMD_GO and leaves no HALT behind */
+static void test_break(void)
+{
+    uint8_t params[1] = { 0 };
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t event[EVENT_SIZE];
+
+    put_be16(ram + 0x40, 0x4e71);       /* NOP */
+    put_be16(ram + 0x80, 0x2200);       /* MOVE.L D0,D1 */
+    sim_target_halt(0, TEST_ADDRESS);   /* the PC is not on a breakpoint */
+    CHECK(exec(CMD_HALT, params, 0, 0) == 1, "CMD_HALT failed");
+    CHECK(breakpoint(BREAK_CLEAR, 0) == 0 && breakpoint(BREAK_ADD, TEST_ADDRESS + 0x40) == 1 &&
+          breakpoint(BREAK_ADD, TEST_ADDRESS + 0x80) == 2 && breakpoint(BREAK_ADD, TEST_ADDRESS + 0x80) == 2,
+          "breakpoints not added");
+    CHECK(breakpoint(BREAK_ADD, TEST_ADDRESS + 0x41) < 0, "breakpoint at an odd address added");
+
+    CHECK(exec(CMD_GO, params, 0, 0) == 1 && get_be16(ram + 0x40) == BDMCF_HALT_OPCODE &&
+          get_be16(ram + 0x80) == BDMCF_HALT_OPCODE, "CMD_GO did not patch the HALTs in");
+    CHECK(breakpoint(BREAK_REMOVE, TEST_ADDRESS + 0x40) < 0, "breakpoints changed while in memory");
+    sim_target_halt(0x20000000, TEST_ADDRESS + 0x40);
+    CHECK(exec(CMD_READ_DREG, params, 1, 4) == 5 && !bdmcf_running, "halt at the breakpoint not seen");
+    CHECK(get_be16(ram + 0x40) == 0x4e71 && get_be16(ram + 0x80) == 0x2200, "opcodes not put back after the halt");
+
+    CHECK(exec(CMD_GO, params, 0, 0) == 1 && get_be16(ram + 0x80) == BDMCF_HALT_OPCODE, "second CMD_GO failed");
+    CHECK(exec(CMD_HALT, params, 0, 0) == 1 && get_be16(ram + 0x40) == 0x4e71 && get_be16(ram + 0x80) == 0x2200,
+          "opcodes not put back by CMD_HALT");
+
+    CHECK(breakpoint(BREAK_REMOVE, TEST_ADDRESS + 0x80) == 1 && breakpoint(BREAK_ADD, 0x10000000) == 2,
+          "breakpoint in missing memory not added");
+    CHECK(exec(CMD_GO, params, 0, 0) == 0 && !bdmcf_running && get_be16(ram + 0x40) == 0x4e71,
+          "CMD_GO with a breakpoint in missing memory left a HALT behind");
+    CHECK(breakpoint(BREAK_CLEAR, 0) == 0, "breakpoints not cleared");
+    params[0] = 0;
+    CHECK(exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1, "resync after the failed CMD_GO failed");
+    while (event_pop(event))
+    {
+        ;                               /* drop the halts & bus errors */
+    }
+}
+
+/* reads the first dword of TEST_ADDRESS after setting it to value in the target, returns the first byte read */
+static uint8_t cache_read(uint8_t value)
+{
+    uint8_t params[4];
+
+    put_be32(params, TEST_ADDRESS);
+    sim_ram[TEST_ADDRESS - SIM_RAM_BASE] = value;
+    CHECK(exec(CMD_READ_MEMBLOCK32, params, 4, 4) == 5, "read of the cache window failed");
+    return buffer[1];
+}
+
+/* memory is cached only while the target is known to be halted, which it is not after a reset into normal */
+/* mode or once CMD_SET_TARGET has found the target in an unknown state */
+static void test_cache(void)
+{
+    uint8_t params[9] = { 0 };
+
+    put_be32(params + 1, TEST_ADDRESS);
+    put_be32(params + 5, BDMCF_CACHE_PAGE);
+    CHECK(exec(CMD_MEM_CACHE_WINDOW, params, 9, 9) == 1, "cache window failed");
+    CHECK(exec(CMD_HALT, params, 0, 0) == 1 && bdmcf_target_halted, "CMD_HALT did not halt");
+    cache_read(0x11);
+    CHECK(cache_read(0x22) == 0x11, "halted target not read from the cache");
+
+    params[0] = 1;
+    CHECK(exec(CMD_RESET, params, 1, 1) == 1 && bdmcf_running && !bdmcf_target_halted,
+          "target reset into normal mode is not watched");
+    cache_read(0x33);
+    CHECK(cache_read(0x44) == 0x44, "target reset into normal mode read from the cache");
+
+    params[0] = 0;
+    CHECK(exec(CMD_RESET, params, 1, 1) == 1 && !bdmcf_running && bdmcf_target_halted, "reset into BDM mode failed");
+    cache_read(0x55);
+    CHECK(cache_read(0x66) == 0x55, "target reset into BDM mode not read from the cache");
+
+    params[0] = CF_BDM;
+    CHECK(exec(CMD_SET_TARGET, params, 1, 1) == 3 && !bdmcf_target_halted, "set target failed");
+    cache_read(0x77);
+    CHECK(cache_read(0x88) == 0x88, "target of unknown state read from the cache");
+
+    memset(params, 0, sizeof(params));
+    CHECK(exec(CMD_MEM_CACHE_WINDOW, params, 9, 9) == 1, "cache window not disabled");
+}
+
+/* reads A1 after setting it to value in the target, returns the value read */
+static uint32_t shadow_read(uint32_t value)
+{
+    uint8_t params[1] = { 9 };
+
+    sim_target_regs[9] = value;
+    CHECK(exec(CMD_READ_REG, params, 1, 1) == 5, "read of A1 failed");
+    return get_be32(buffer + 1);
+}
+
+/* the register shadow is used under the same condition as the cache */
+static void test_shadow(void)
+{
+    uint8_t params[1] = { 0 };
+
+    CHECK(exec(CMD_HALT, params, 0, 0) == 1, "CMD_HALT failed");
+    shadow_read(0x11111111);
+    CHECK(shadow_read(0x22222222) == 0x11111111, "halted target not read from the shadow");
+
+    params[0] = 1;
+    CHECK(exec(CMD_RESET, params, 1, 1) == 1, "reset into normal mode failed");
+    shadow_read(0x33333333);
+    CHECK(shadow_read(0x44444444) == 0x44444444, "target reset into normal mode read from the shadow");
+
+    params[0] = 0;
+    CHECK(exec(CMD_RESET, params, 1, 1) == 1, "reset into BDM mode failed");
+    shadow_read(0x55555555);
+    CHECK(shadow_read(0x66666666) == 0x55555555, "target reset into BDM mode not read from the shadow");
+
+    params[0] = CF_BDM;
+    CHECK(exec(CMD_SET_TARGET, params, 1, 1) == 3, "set target failed");
+    shadow_read(0x77777777);
+    CHECK(shadow_read(0x88888888) == 0x88888888, "target of unknown state read from the shadow");
+}
+
+/* a read stream hands out no more than the host asked for, status & trailer included, */
+/* and CMD_STREAM_DATA fails a request which is too small to carry a dword */
+static void test_stream(void)
+{
+    uint8_t params[9];
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t data[64];
+    uint32_t received = 0;
+    uint8_t length;
+    uint32_t i;
+
+    for (i = 0; i < sizeof(data); i++)
+    {
+        ram[i] = i * 3 + 1;
+    }
+    put_be32(params, TEST_ADDRESS);
+    put_be32(params + 4, sizeof(data));
+    params[8] = 0;
+    CHECK(exec(CMD_STREAM_READ, params, 9, 9) == 1, "stream: start failed");
+    bdmcf_stream_poll();
+
+    CHECK(exec(CMD_STREAM_DATA, params, 0, 1 + 8 + 3) == 0 && buffer[0] == CMD_FAILED,
+          "stream: request too small for a dword did not fail");
+    do                                  /* 16 bytes requested: room for one dword besides the status & trailer */
+    {
+        length = exec(CMD_STREAM_DATA, params, 0, 1 + 8 + 4 + 2);
+        CHECK(length >= 2 && length <= 1 + 8 + 4 + 2 + 1, "stream: %u bytes returned for %u requested", length, 1 + 8 + 4 + 2 + 1);
+        if ((length < 2) || (buffer[1] != STREAM_MORE && length < 2 + 8))
+        {
+            break;
+        }
+        i = length - 2 - ((buffer[1] == STREAM_MORE) ? 0 : 8);
+        if (received + i > sizeof(data))
+        {
+            break;
+        }
+        memcpy(data + received, buffer + 2, i);
+        received += i;
+    } while (buffer[1] == STREAM_MORE);
+
+    CHECK(buffer[1] == STREAM_DONE && get_be32(buffer + length - 8) == sizeof(data),
+          "stream: status %u, trailer count %u", buffer[1], get_be32(buffer + length - 8));
+    CHECK(received == sizeof(data) && memcmp(data, ram, sizeof(data)) == 0, "stream: %u bytes of wrong data", received);
+}
+
+static uint32_t random_state = 1;
+
+static uint8_t random_byte(void)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return random_state >> 16;
+}
+
+/* fills data with len bytes of a memory image: erased flash, cleared RAM, code (literals & padding of */
+/* growing lengths, one after the other) or random data */
+static const char *make_image(uint8_t kind, uint8_t *data, uint32_t len)
+{
+    uint32_t i = 0;
+    uint32_t n;
+    uint32_t k;
+
+    switch (kind)
+    {
+        case 0:
+            memset(data, 0xff, len);
+            return "erased flash";
+        case 1:
+            memset(data, 0x00, len);
+            return "cleared RAM";
+        case 2:
+            for (n = 1; i < len; n++)
+            {
+                for (k = 0; (k < n) && (i < len); k++, i++)
+                {
+                    data[i] = (n & 1) ? random_byte() : ((i & 0x100) ? 0xff : 0x00);
+                }
+            }
+            return "code";
+        default:
+            for (i = 0; i < len; i++)
+            {
+                data[i] = random_byte();
+            }
+            return "random";
+    }
+}
+
+/* encodes len bytes of the ring buf (mask) from start into max bytes & decodes the result */
+/* returns the number of bytes covered, -1 if the encoding is too long or does not decode to the input */
+static int32_t rle_round_trip(const uint8_t *buf, uint32_t mask, uint32_t start, uint32_t len, uint32_t max)
+{
+    static uint8_t encoded[2 * TEST_IMAGE];
+    static uint8_t decoded[TEST_IMAGE];
+    uint32_t consumed;
+    uint32_t used;
+    uint32_t size;
+    uint32_t n;
+    uint32_t i;
+
+    size = rle_encode(buf, mask, start, len, encoded, max, &consumed);
+    n = rle_decode(encoded, size, decoded, sizeof(decoded), &used);
+    if ((size > max) || (consumed > len) || (used != size) || (n != consumed) || ((max >= 2) && len && !consumed))
+    {
+        return -1;                      /* with room for 2 bytes there is always progress */
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (decoded[i] != buf[(start + i) & mask])
+        {
+            return -1;
+        }
+    }
+    return consumed;
+}
+
+/* rle_encode() & rle_decode() give back the data, in a ring too, and an encoding cut short by max still */
+/* decodes to the start of the data */
+static void test_rle(void)
+{
+    static uint8_t image[TEST_IMAGE];
+    uint8_t ring[256];
+    const char *name;
+    uint32_t max;
+    uint32_t i;
+    uint8_t kind;
+
+    for (kind = 0; kind < TEST_IMAGES; kind++)
+    {
+        name = make_image(kind, image, sizeof(image));
+        CHECK(rle_round_trip(image, 0xffffffff, 0, sizeof(image), 2 * sizeof(image)) == sizeof(image),
+              "RLE: %s does not round trip", name);
+        for (max = 0; max < 300; max++)
+        {
+            if (rle_round_trip(image, 0xffffffff, 0, sizeof(image), max) < 0)
+            {
+                break;
+            }
+        }
+        CHECK(max == 300, "RLE: %s cut to %u bytes does not decode", name, max);
+    }
+
+    for (i = 0; i < sizeof(ring); i++)
+    {
+        ring[i] = ((i < 6) || (i >= 250)) ? 0x55 : random_byte();    /* a run across the end of the ring */
+    }
+    for (i = 0; i < sizeof(ring); i++)
+    {
+        CHECK(rle_round_trip(ring, sizeof(ring) - 1, 240 + i, sizeof(ring), 2 * sizeof(ring)) == sizeof(ring),
+              "RLE: ring from %u does not round trip", (240 + i) & 0xff);
+    }
+}
+
+/* CMD_READ_MEMBLOCK_RLE and a STREAM_RLE read of the images decode to the target memory, the bytes */
+/* on the wire are reported against the raw size */
+static void test_read_rle(void)
+{
+    static uint8_t decoded[2 * TEST_IMAGE];
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t params[9];
+    const char *name;
+    uint32_t covered;
+    uint32_t received;
+    uint32_t wire;
+    uint32_t stream_wire;
+    uint32_t used;
+    uint32_t n;
+    uint8_t length;
+    uint8_t kind;
+
+    for (kind = 0; kind < TEST_IMAGES; kind++)
+    {
+        name = make_image(kind, ram, TEST_IMAGE);
+        bdmcf_cache_invalidate();
+
+        for (received = 0, wire = 0; received < TEST_IMAGE; received += covered, wire += length)
+        {
+            put_be32(params, TEST_ADDRESS + received);
+            put_be32(params + 4, TEST_IMAGE - received);
+            length = exec(CMD_READ_MEMBLOCK_RLE, params, 8, MAX_DATA_SIZE);
+            covered = get_be16(buffer + 1);
+            n = rle_decode(buffer + 3, length - 3, decoded + received, sizeof(decoded) - received, &used);
+            if ((length < 3) || (covered == 0) || (covered & 3) || (n != covered) || (used != length - 3u))
+            {
+                break;
+            }
+        }
+        CHECK(received == TEST_IMAGE && memcmp(decoded, ram, TEST_IMAGE) == 0,
+              "CMD_READ_MEMBLOCK_RLE: %s decoded to the wrong data at %u", name, received);
+
+        put_be32(params, TEST_ADDRESS);
+        put_be32(params + 4, 2 * TEST_IMAGE);   /* twice the image, more than the ring holds */
+        params[8] = STREAM_RLE;
+        memcpy(ram + TEST_IMAGE, ram, TEST_IMAGE);
+        CHECK(exec(CMD_STREAM_READ, params, 9, 9) == 1, "STREAM_RLE: start failed");
+        received = 0;
+        stream_wire = 0;
+        do
+        {
+            bdmcf_stream_poll();
+            length = exec(CMD_STREAM_DATA, params, 0, MAX_DATA_SIZE);
+            n = length - 2 - ((length >= 2 && buffer[1] != STREAM_MORE) ? 8 : 0);
+            if ((length < 2) || (n > MAX_DATA_SIZE))
+            {
+                break;
+            }
+            received += rle_decode(buffer + 2, n, decoded + received, sizeof(decoded) - received, &used);
+            stream_wire += length;
+            if (used != n)
+            {
+                break;
+            }
+        } while (buffer[1] == STREAM_MORE);
+        CHECK(buffer[1] == STREAM_DONE && received == 2 * TEST_IMAGE && memcmp(decoded, ram, 2 * TEST_IMAGE) == 0,
+              "STREAM_RLE: %s decoded to the wrong data (status %u, %u bytes)", name, buffer[1], received);
+        CHECK(get_be32(buffer + length - 8) == 2 * TEST_IMAGE &&
+              get_be32(buffer + length - 4) == crc32_update(0, ram, 2 * TEST_IMAGE), "STREAM_RLE: %s trailer wrong", name);
+
+        printf("RLE: %-12s %5u bytes: %5u bytes CMD_READ_MEMBLOCK_RLE (%3u%%), %5u bytes STREAM_RLE (%3u%%)\n", name,
+               TEST_IMAGE, wire, 100 * wire / TEST_IMAGE, stream_wire / 2, 100 * stream_wire / (2 * TEST_IMAGE));
+    }
+}
+
+/* runs CMD_SEARCH_MEM, returns the number of matches (their addresses are at buffer + 6) or -1 if it failed */
+static int search(uint32_t address, uint32_t length, uint8_t step, uint8_t max, uint8_t size, const uint8_t *pattern,
+                  const uint8_t *mask, uint32_t *cursor)
+{
+    uint8_t params[13 + 2 * BDMCF_SEARCH_PATTERN];
+
+    put_be32(params, address);
+    put_be32(params + 4, length);
+    params[8] = step;
+    params[9] = max;
+    params[10] = size;
+    memcpy(params + 11, pattern, size);
+    memcpy(params + 11 + size, mask, size);
+    if (exec(CMD_SEARCH_MEM, params, 11 + 2 * size, 11 + 2 * size) != 6 + 4 * buffer[1])
+    {
+        return -1;
+    }
+    *cursor = get_be32(buffer + 2);
+    return buffer[1];
+}
+
+/* crc32_update() & CMD_CRC32_MEMBLOCK against the values of zlib's crc32(): strings, chained updates & images */
+/* with every length of the partial last dword and across the DUMP32 blocks */
+static void test_crc(void)
+{
+    static const struct
+    {
+        uint32_t length;
+        uint32_t crc;
+    } image_crcs[] =                    /* zlib's crc32() of the first bytes of the image */
+    {
+        { 0, 0x00000000 }, { 1, 0xd202ef8d }, { 2, 0xdfbd875c }, { 3, 0x57b862d2 }, { 4, 0xd75500fc },
+        { 5, 0x72df58f5 }, { 255, 0x89b9aecb }, { 256, 0x1a5c07a3 }, { 257, 0x04ce1062 }, { 1024, 0x05bbee2c },
+        { 1027, 0xc7cf9379 }
+    };
+    static const uint8_t check[] = "123456789";
+    static const uint8_t fox[] = "The quick brown fox jumps over the lazy dog";
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t params[8];
+    uint32_t i;
+
+    CHECK(crc32_update(0, check, 9) == 0xcbf43926 && crc32_update(crc32_update(0, check, 4), check + 4, 5) == 0xcbf43926 &&
+          crc32_update(0, fox, sizeof(fox) - 1) == 0x414fa339 && crc32_update(0x414fa339, fox, 0) == 0x414fa339,
+          "crc32_update() does not give zlib's CRC-32");
+
+    for (i = 0; i < 1027; i++)
+    {
+        ram[i] = i * 7 + (i >> 8) * 3;
+    }
+    for (i = 0; i < sizeof(image_crcs) / sizeof(image_crcs[0]); i++)
+    {
+        put_be32(params, TEST_ADDRESS);
+        put_be32(params + 4, image_crcs[i].length);
+        CHECK(exec(CMD_CRC32_MEMBLOCK, params, 8, 8) == 5 && get_be32(buffer + 1) == image_crcs[i].crc &&
+              crc32_update(0, ram, image_crcs[i].length) == image_crcs[i].crc,
+              "CRC-32 of %u bytes is %08x instead of %08x", image_crcs[i].length, get_be32(buffer + 1), image_crcs[i].crc);
+    }
+    put_be32(params, TEST_ADDRESS + 1);
+    put_be32(params + 4, 300);
+    CHECK(exec(CMD_CRC32_MEMBLOCK, params, 8, 8) == 5 && get_be32(buffer + 1) == 0xa26931af,
+          "CRC-32 from an odd address is %08x", get_be32(buffer + 1));
+
+    put_be32(params, 0x10000000);
+    CHECK(exec(CMD_CRC32_MEMBLOCK, params, 8, 8) == 0, "CRC-32 of missing memory passed");
+    CHECK(exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1, "resync after the CRC-32 of missing memory failed");
+}
+
+/* CMD_WRITE_CONTEXT & CMD_READ_CONTEXT: SR is written first, a context written reads back the same from the */
+/* target and a second read comes from the shadow without BDM traffic */
+static void test_context(void)
+{
+    static const uint16_t cregs[4] = { 0x0002, 0x0801, 0x0c04, 0x0c05 };   /* CACR, VBR, RAMBAR0 & RAMBAR1 */
+    uint8_t context[BDMCF_CONTEXT_SIZE + 6 * BDMCF_CONTEXT_CREGS];
+    uint8_t params[2 * (BDMCF_CONTEXT_CREGS + 1)];
+    uint8_t expected[BDMCF_CONTEXT_SIZE + 4 * 4];
+    uint32_t i;
+
+    sim_target_halt(0, TEST_ADDRESS);
+    CHECK(exec(CMD_HALT, params, 0, 0) == 1, "CMD_HALT failed");
+    for (i = 0; i < 16; i++)
+    {
+        put_be32(context + 4 * i, 0x10203040 * (i + 1) ^ 0xa5a5a5a5);
+    }
+    put_be32(context + 64, TEST_ADDRESS + 0x20);    /* PC */
+    put_be32(context + 68, 0x2704);                 /* SR */
+    for (i = 0; i < 4; i++)
+    {
+        put_be16(context + BDMCF_CONTEXT_SIZE + 6 * i, cregs[i]);
+        put_be32(context + BDMCF_CONTEXT_SIZE + 6 * i + 2, 0x20000021 + (i << 24));
+        put_be16(params + 2 * i, cregs[i]);
+        put_be32(expected + BDMCF_CONTEXT_SIZE + 4 * i, 0x20000021 + (i << 24));
+    }
+    memcpy(expected, context, BDMCF_CONTEXT_SIZE);
+
+    sim_frames = 0;                     /* the messages of a context without control registers fit the log */
+    CHECK(exec(CMD_WRITE_CONTEXT, context, BDMCF_CONTEXT_SIZE, BDMCF_CONTEXT_SIZE) == 1 && sim_frames < SIM_FRAME_LOG &&
+          sim_frame_log[0] == BDMCF_CMD_WCREG && sim_frame_log[2] == BDMCF_CREG_SR && sim_frame_log[3] == 0 &&
+          sim_frame_log[4] == 0x2704, "CMD_WRITE_CONTEXT did not write SR first");
+    CHECK(exec(CMD_WRITE_CONTEXT, context, BDMCF_CONTEXT_SIZE + 6 * 4, BDMCF_CONTEXT_SIZE + 6 * 4) == 1,
+          "CMD_WRITE_CONTEXT with control registers failed");
+    for (i = 0; (i < 16) && (sim_target_regs[i] == get_be32(context + 4 * i)); i++)
+    {
+        ;
+    }
+    CHECK(i == 16, "CMD_WRITE_CONTEXT wrote %08x to register %u", sim_target_regs[i & 15], i);
+
+    bdmcf_shadow_invalidate();
+    CHECK(exec(CMD_READ_CONTEXT, params, 8, BDMCF_CONTEXT_SIZE + 4 * 4) == 1 + BDMCF_CONTEXT_SIZE + 4 * 4 &&
+          memcmp(buffer + 1, expected, BDMCF_CONTEXT_SIZE + 4 * 4) == 0, "context did not read back as written");
+    sim_frames = 0;
+    sim_target_regs[5] ^= 1;            /* the shadow does not see this */
+    CHECK(exec(CMD_READ_CONTEXT, params, 8, BDMCF_CONTEXT_SIZE + 4 * 4) == 1 + BDMCF_CONTEXT_SIZE + 4 * 4 &&
+          memcmp(buffer + 1, expected, BDMCF_CONTEXT_SIZE + 4 * 4) == 0 && sim_frames == 0,
+          "second read of the context not answered by the shadow (%u messages)", sim_frames);
+    bdmcf_shadow_invalidate();
+    put_be32(expected + 20, sim_target_regs[5]);
+    CHECK(exec(CMD_READ_CONTEXT, params, 0, BDMCF_CONTEXT_SIZE) == 1 + BDMCF_CONTEXT_SIZE &&
+          memcmp(buffer + 1, expected, BDMCF_CONTEXT_SIZE) == 0, "context without control registers is wrong");
+
+    CHECK(exec(CMD_READ_CONTEXT, params, 2 * (BDMCF_CONTEXT_CREGS + 1),
+               BDMCF_CONTEXT_SIZE + 4 * (BDMCF_CONTEXT_CREGS + 1)) == 0 &&
+          exec(CMD_READ_CONTEXT, params, 0, BDMCF_CONTEXT_SIZE - 1) == 0, "context of a bad size read");
+    memset(buffer, 0, sizeof(buffer));
+    buffer[1] = CMD_READ_CONTEXT;
+    CHECK(command_exec(buffer, BDMCF_CONTEXT_SIZE + 4 * 3, TRANSPORT_EP0_IN) == 1 && buffer[0] == CMD_FAILED,
+          "context with 3 control registers read in an EP0 IN request");
+}
+
+static uint32_t step_frames;            /* the target goes away after this many messages */
+
+/* sim_target_hook: detaches the target once step_frames messages have been received */
+static void step_detach(void)
+{
+    if (sim_frames >= step_frames)
+    {
+        sim_target_detached = 1;
+    }
+}
+
+/* runs CMD_STEP_N from TEST_ADDRESS, returns the reason it stopped or 0xff if the command failed */
+/* the simulated target moves the PC on by 2 with each step */
+static uint8_t step_n(uint32_t count, uint32_t start, uint32_t end, uint8_t mode, uint16_t timeout_ms,
+                      uint32_t *pc, uint32_t *steps)
+{
+    uint8_t params[15];
+
+    sim_target_halt(0, TEST_ADDRESS);
+    put_be32(params, count);
+    put_be32(params + 4, start);
+    put_be32(params + 8, end);
+    params[12] = mode;
+    put_be16(params + 13, timeout_ms);
+    if (exec(CMD_STEP_N, params, 15, 15) != 10)
+    {
+        return 0xff;
+    }
+    *pc = get_be32(buffer + 2);
+    *steps = get_be32(buffer + 6);
+    return buffer[1];
+}
+
+/* CMD_STEP_N stops after the count, when the PC leaves or enters the range, on the timeout and when the */
+/* target stops answering, always with the PC & the number of the last step done */
+static void test_step(void)
+{
+    uint8_t params[1] = { 0 };
+    uint32_t pc;
+    uint32_t steps;
+    uint8_t reason;
+
+    CHECK(exec(CMD_HALT, params, 0, 0) == 1, "CMD_HALT failed");
+    reason = step_n(5, 0, 0, STEP_STOP_NONE, 0, &pc, &steps);
+    CHECK(reason == STEP_COUNT && steps == 5 && pc == TEST_ADDRESS + 10, "STEP_N 5: reason %u, %u steps, PC %08x",
+          reason, steps, pc);
+    reason = step_n(100, TEST_ADDRESS, TEST_ADDRESS + 0x10, STEP_STOP_OUTSIDE, 0, &pc, &steps);
+    CHECK(reason == STEP_RANGE && steps == 8 && pc == TEST_ADDRESS + 0x10, "STEP_N outside: reason %u, %u steps, PC %08x",
+          reason, steps, pc);
+    reason = step_n(100, TEST_ADDRESS + 0x20, TEST_ADDRESS + 0x30, STEP_STOP_INSIDE, 0, &pc, &steps);
+    CHECK(reason == STEP_RANGE && steps == 16 && pc == TEST_ADDRESS + 0x20, "STEP_N inside: reason %u, %u steps, PC %08x",
+          reason, steps, pc);
+    reason = step_n(10, TEST_ADDRESS + 0x20, TEST_ADDRESS + 0x30, STEP_STOP_INSIDE, 0, &pc, &steps);
+    CHECK(reason == STEP_COUNT && steps == 10, "STEP_N count before the range: reason %u, %u steps", reason, steps);
+    reason = step_n(5000, 0, 0, STEP_STOP_NONE, 2, &pc, &steps);     /* some 10 steps in 2ms */
+    CHECK(reason == STEP_TIMEOUT && steps > 1 && steps < 5000 && pc == TEST_ADDRESS + 2 * steps,
+          "STEP_N timeout: reason %u, %u steps, PC %08x", reason, steps, pc);
+
+    sim_frames = 0;
+    step_frames = 200;
+    sim_target_hook = step_detach;
+    reason = step_n(100, 0, 0, STEP_STOP_NONE, 0, &pc, &steps);
+    sim_target_hook = NULL;
+    sim_target_detached = 0;
+    CHECK(reason == STEP_ERROR && steps > 1 && steps < 100 && pc == TEST_ADDRESS + 2 * steps,
+          "STEP_N target gone: reason %u, %u steps, PC %08x", reason, steps, pc);
+    CHECK(exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1, "resync after STEP_N failed");
+}
+
+/* runs CMD_FILL_MEM, returns non-zero if it passed */
+static int fill(uint32_t address, uint32_t length, uint8_t width, uint32_t pattern)
+{
+    uint8_t params[15];
+
+    put_be32(params, address);
+    put_be32(params + 4, length);
+    params[8] = width;
+    put_be32(params + 9, pattern);
+    return exec(CMD_FILL_MEM, params, 13, 13) == 1;
+}
+
+/* CMD_FILL_MEM of every width over several FILL chunks, bit-banged & over SPI: the range holds the pattern, */
+/* the bytes around it are left alone and a read afterwards does not come from a stale cache */
+static void test_fill(void)
+{
+    static const uint8_t widths[3] = { 1, 2, 4 };
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t speeds[2] = { bdmcf_speed, BDMCF_SPEED_SPI };
+    uint8_t params[9] = { 0 };
+    uint32_t pattern = 0x9abcdef1;
+    uint32_t length;
+    uint32_t i;
+    uint8_t s;
+    uint8_t w;
+
+    put_be32(params + 1, TEST_ADDRESS);
+    put_be32(params + 5, BDMCF_CACHE_PAGE);
+    CHECK(exec(CMD_MEM_CACHE_WINDOW, params, 9, 9) == 1 && exec(CMD_HALT, params, 0, 0) == 1,
+          "cache window over the fill failed");
+    for (s = 0; s < 2; s++)
+    {
+        params[0] = speeds[s];
+        CHECK(exec(CMD_SET_SPEED, params, 1, 1) == 1, "speed %u: select failed", speeds[s]);
+        for (w = 0; w < 3; w++)
+        {
+            length = 600 * widths[w];   /* more than 2 chunks of FILLs */
+            memset(ram, 0x55, length + 16);
+            put_be32(params, TEST_ADDRESS + 4);
+            CHECK(exec(CMD_READ_MEM32, params, 4, 4) == 5, "speed %u: read before the fill failed", speeds[s]);
+            CHECK(fill(TEST_ADDRESS + 4, length, widths[w], pattern), "speed %u: %u-byte fill failed", speeds[s], widths[w]);
+            for (i = 0; (i < length) && (ram[4 + i] == ((pattern >> (8 * (widths[w] - 1 - i % widths[w]))) & 0xff)); i++)
+            {
+                ;
+            }
+            CHECK(i == length, "speed %u: %u-byte fill wrote %02x at %u", speeds[s], widths[w], ram[4 + i], i);
+            CHECK(get_be32(ram) == 0x55555555 && get_be32(ram + 4 + length) == 0x55555555,
+                  "speed %u: %u-byte fill wrote outside the range", speeds[s], widths[w]);
+            CHECK(exec(CMD_READ_MEM32, params, 4, 4) == 5 && memcmp(buffer + 1, ram + 4, 4) == 0,
+                  "speed %u: %u-byte fill left a stale cache", speeds[s], widths[w]);
+            pattern = (pattern << 8) | (pattern >> 24);
+        }
+    }
+    params[0] = speeds[0];
+    CHECK(exec(CMD_SET_SPEED, params, 1, 1) == 1, "speed %u: select failed", speeds[0]);
+    memset(params, 0, sizeof(params));
+    CHECK(exec(CMD_MEM_CACHE_WINDOW, params, 9, 9) == 1, "cache window not disabled");
+
+    CHECK(!fill(TEST_ADDRESS, 12, 3, pattern) && !fill(TEST_ADDRESS, 6, 4, pattern) &&
+          !fill(TEST_ADDRESS + 2, 8, 4, pattern) && !fill(TEST_ADDRESS + 1, 8, 2, pattern) &&
+          !fill(TEST_ADDRESS, 0, 1, pattern), "fill with bad parameters passed");
+    CHECK(!fill(0x10000000, 16, 4, pattern), "fill of missing memory passed");
+    CHECK(exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1, "resync after the fill of missing memory failed");
+}
+
+static uint32_t message_log[4096];      /* every message the target received since message_count was cleared */
+static uint32_t message_count;
+
+/* sim_target_hook: keeps the message just received in message_log */
+static void message_record(void)
+{
+    if (message_count < sizeof(message_log) / sizeof(message_log[0]))
+    {
+        message_log[message_count++] = sim_frame_log[(sim_frames - 1) & (SIM_FRAME_LOG - 1)];
+    }
+}
+
+/* runs CMD_WRITE_MEMBLOCK_DIFF of strlen(changed) dwords at TEST_ADDRESS with the dwords marked 'c' changed, */
+/* returns non-zero if exactly the dwords marked 'w' in written went out in WRITE32/FILL32s and the memory */
+/* holds the new data afterwards */
+static int write_diff(const char *changed, const char *written)
+{
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t params[4 + 4 * BDMCF_MEM_BLOCK];
+    char seen[BDMCF_MEM_BLOCK + 1];
+    uint32_t count = strlen(changed);
+    uint32_t next = count;              /* dword the next FILL32 writes */
+    uint32_t skipped = 0;
+    uint32_t i;
+
+    memset(seen, '.', count);
+    seen[count] = 0;
+    put_be32(params, TEST_ADDRESS);
+    for (i = 0; i < count; i++)
+    {
+        put_be32(ram + 4 * i, 0x01230000 + i);
+        put_be32(params + 4 + 4 * i, 0x01230000 + i + ((changed[i] == 'c') ? 0x1000 : 0));
+        skipped += (written[i] != 'w');
+    }
+    bdmcf_cache_invalidate();
+
+    message_count = 0;
+    sim_target_hook = message_record;
+    i = exec(CMD_WRITE_MEMBLOCK_DIFF, params, 4 + 4 * count, 4 + 4 * count);
+    sim_target_hook = NULL;
+    if ((i != 2) || (buffer[1] != skipped) || memcmp(ram, params + 4, 4 * count))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < message_count; i++)
+    {
+        switch (message_log[i])
+        {
+            case BDMCF_CMD_WRITE32:
+                next = (((message_log[i + 1] << 16) | message_log[i + 2]) - TEST_ADDRESS) / 4;
+                i += 4;
+                break;
+            case BDMCF_CMD_FILL32:
+                i += 2;
+                break;
+            case BDMCF_CMD_READ32:
+                i += 2;
+                continue;
+            default:
+                continue;
+        }
+        if (next < count)
+        {
+            seen[next++] = 'w';
+        }
+    }
+    if (strcmp(seen, written))
+    {
+        printf("WRITE_MEMBLOCK_DIFF %s: wrote %s instead of %s\n", changed, seen, written);
+        return 0;
+    }
+    return 1;
+}
+
+/* CMD_WRITE_MEMBLOCK_DIFF: which dwords are skipped and which unchanged ones are written along with a run */
+static void test_write_diff(void)
+{
+    uint8_t params[12];
+
+    CHECK(write_diff("c.cc..c.c...cc.c", "wwww..www...wwww"), "single unchanged dwords not bridged");
+    CHECK(write_diff("..c.", "..w.") && write_diff(".c..c", ".w..w") && write_diff("c", "w") && write_diff(".", "."),
+          "runs at the ends of the block wrong");
+    CHECK(write_diff("................", "................"), "unchanged block written");
+    CHECK(write_diff("cccccccccccccccccccccccccccccc", "wwwwwwwwwwwwwwwwwwwwwwwwwwwwww"),
+          "changed block not written");  /* as many dwords as MAX_DATA_SIZE holds */
+    CHECK(write_diff("c.c.c.c.c..c.c", "wwwwwwwww..www"), "alternating dwords not written in one run");
+
+    put_be32(params, TEST_ADDRESS + 2);
+    memset(params + 4, 0, 8);
+    CHECK(exec(CMD_WRITE_MEMBLOCK_DIFF, params, 8, 8) == 0 && exec(CMD_WRITE_MEMBLOCK_DIFF, params, 4, 4) == 0 &&
+          exec(CMD_WRITE_MEMBLOCK_DIFF, params, 10, 10) == 0, "WRITE_MEMBLOCK_DIFF with bad parameters passed");
+    put_be32(params, 0x10000000);
+    CHECK(exec(CMD_WRITE_MEMBLOCK_DIFF, params, 8, 8) == 0, "WRITE_MEMBLOCK_DIFF to missing memory passed");
+    CHECK(exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1, "resync after WRITE_MEMBLOCK_DIFF to missing memory failed");
+}
+
+/* checks the memory accesses in message_log against a read or write of length bytes at address: each must */
+/* be the widest naturally aligned one which fits what is left, in ascending order; returns non-zero if so */
+static int transfer_accesses(uint8_t write, uint32_t address, uint32_t length)
+{
+    uint32_t next = 0;                  /* address after the last access, where DUMP32/FILL32 go on */
+    uint32_t cmd;
+    uint32_t at;
+    uint32_t width;
+    uint32_t expected;
+    uint32_t i;
+
+    for (i = 0; i < message_count; i++)
+    {
+        cmd = message_log[i];
+        width = 1 << ((cmd >> 6) & 3);  /* 8, 16 or 32 bit in bits 7-6 */
+        switch (cmd & ~0x00c0)
+        {
+            case BDMCF_CMD_READ8:
+            case BDMCF_CMD_WRITE8:
+                at = (message_log[i + 1] << 16) | message_log[i + 2];
+                i += 2 + (write ? ((width == 4) ? 2 : 1) : 0);
+                break;
+            case BDMCF_CMD_DUMP32 & ~0x00c0:
+            case BDMCF_CMD_FILL32 & ~0x00c0:
+                at = next;
+                i += write ? ((width == 4) ? 2 : 1) : 0;
+                break;
+            default:
+                continue;               /* NOPs */
+        }
+        if (((cmd & 0x0100) != 0) == write)
+        {
+            return 0;                   /* a read in a write or the other way round */
+        }
+        for (expected = 4; (address & (expected - 1)) || (expected > length); expected >>= 1)
+        {
+            ;
+        }
+        if ((at != address) || (width != expected))
+        {
+            return 0;
+        }
+        address += width;
+        length -= width;
+        next = at + width;
+    }
+    return length == 0;
+}
+
+/* CMD_READ_MEMBLOCK & CMD_WRITE_MEMBLOCK at every alignment: 8 and 16-bit accesses for the head & the tail, */
+/* READ32/DUMP32s or WRITE32/FILL32s for the body, the right data and nothing outside the range touched */
+static void test_transfer(void)
+{
+    static uint8_t data[3 + 8 * BDMCF_MEM_BLOCK + 3];
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t params[4 + 32];
+    uint32_t length;
+    uint32_t offset;
+    uint32_t i;
+    uint8_t ok;
+
+    for (offset = 0; offset < 4; offset++)
+    {
+        for (length = 0; length <= 32; length++)
+        {
+            for (i = 0; i < 40; i++)
+            {
+                ram[i] = 0xa0 + i;
+                params[4 + i % 32] = 0x50 + i;
+            }
+            put_be32(params, TEST_ADDRESS + offset);
+            message_count = 0;
+            sim_target_hook = message_record;
+            ok = (exec(CMD_READ_MEMBLOCK, params, 4, length) == length + 1) && !memcmp(buffer + 1, ram + offset, length);
+            CHECK(ok && transfer_accesses(0, TEST_ADDRESS + offset, length), "READ_MEMBLOCK of %u bytes at +%u",
+                  length, offset);
+
+            message_count = 0;
+            ok = (exec(CMD_WRITE_MEMBLOCK, params, 4 + length, 4 + length) == 1) &&
+                 !memcmp(ram + offset, params + 4, length) && (ram[offset + length] == 0xa0 + offset + length) &&
+                 (!offset || (ram[offset - 1] == 0xa0 + offset - 1));
+            sim_target_hook = NULL;
+            CHECK(ok && transfer_accesses(1, TEST_ADDRESS + offset, length), "WRITE_MEMBLOCK of %u bytes at +%u",
+                  length, offset);
+        }
+    }
+
+    for (i = 0; i < sizeof(data); i++)  /* more than two blocks of DUMP32s/FILL32s from an odd address */
+    {
+        data[i] = i * 13;
+        ram[i + 1] = ~data[i];
+    }
+    message_count = 0;
+    sim_target_hook = message_record;
+    ok = !bdmcf_mem_transfer(1, TEST_ADDRESS + 1, sizeof(data), data) && !memcmp(ram + 1, data, sizeof(data));
+    CHECK(ok && transfer_accesses(1, TEST_ADDRESS + 1, sizeof(data)), "write of %u bytes at +1", (unsigned) sizeof(data));
+    memset(data, 0, sizeof(data));
+    message_count = 0;
+    ok = !bdmcf_mem_transfer(0, TEST_ADDRESS + 1, sizeof(data), data) && !memcmp(ram + 1, data, sizeof(data));
+    sim_target_hook = NULL;
+    CHECK(ok && transfer_accesses(0, TEST_ADDRESS + 1, sizeof(data)), "read of %u bytes at +1", (unsigned) sizeof(data));
+
+    put_be32(params, 0x10000001);
+    CHECK(exec(CMD_READ_MEMBLOCK, params, 4, 8) == 0, "READ_MEMBLOCK of missing memory passed");
+    CHECK(exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1, "resync after READ_MEMBLOCK of missing memory failed");
+}
+
+static uint32_t trace_cycles[512];      /* the messages drained by trace_drain() */
+static uint16_t trace_duration[512];
+static uint16_t trace_tx[512];
+static uint16_t trace_rx[512];
+static uint8_t trace_flags[512];
+
+/* drains the trace with CMD_TRACE_DRAIN until it is empty, stores the number of messages lost into *lost */
+/* returns the number of messages drained, -1 if a response was malformed */
+static int trace_drain(uint32_t *lost)
+{
+    uint8_t params[1];
+    uint8_t length;
+    uint8_t *p;
+    int count = 0;
+    int i;
+
+    *lost = 0;
+    do
+    {
+        length = exec(CMD_TRACE_DRAIN, params, 0, MAX_DATA_SIZE);
+        if ((length != 4 + BDMCF_TRACE_ENTRY_SIZE * buffer[1]) || (buffer[1] > BDMCF_TRACE_DRAIN) ||
+            (count + buffer[1] > 512))
+        {
+            return -1;
+        }
+        *lost += get_be16(buffer + 2);
+        for (i = 0, p = buffer + 4; i < buffer[1]; i++, count++, p += BDMCF_TRACE_ENTRY_SIZE)
+        {
+            trace_cycles[count] = get_be32(p);
+            trace_duration[count] = get_be16(p + 4);
+            trace_tx[count] = get_be16(p + 6);
+            trace_rx[count] = get_be16(p + 8);
+            trace_flags[count] = p[10];
+        }
+    } while (buffer[1]);
+    return count;
+}
+
+/* returns non-zero if the count messages drained are the last ones the target received, in order & timed */
+/* one after the other; the messages of a DMA block share its start & duration */
+static int trace_matches(int count)
+{
+    int i;
+
+    if ((count <= 0) || (count > (int) sim_frames) || (count > SIM_FRAME_LOG))
+    {
+        return 0;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if ((trace_tx[i] != sim_frame_log[(sim_frames - count + i) & (SIM_FRAME_LOG - 1)]) || (trace_duration[i] == 0))
+        {
+            return 0;
+        }
+        if ((i > 0) && (trace_cycles[i] != trace_cycles[i - 1]) &&
+            (trace_cycles[i] - trace_cycles[i - 1] < trace_duration[i - 1]))
+        {
+            return 0;                   /* started before the previous one was over */
+        }
+    }
+    return 1;
+}
+
+/* CMD_TRACE_CONTROL & CMD_TRACE_DRAIN: the messages sent & received with their status bit, time & duration, */
+/* DMA blocks, the count of messages lost when the ring is full, and nothing recorded once it is off */
+static void test_trace(void)
+{
+    uint8_t params[5];
+    uint32_t lost;
+    uint8_t speed = bdmcf_speed;
+    int count;
+    int i;
+
+    params[0] = 1;
+    CHECK(exec(CMD_TRACE_CONTROL, params, 1, 1) == 1 && bdmcf_txrx17_ptr == bdmcf_txrx17_trace, "trace not switched on");
+    sim_frames = 0;
+    params[0] = 9;                      /* A1 */
+    put_be32(params + 1, 0x89abcdef);
+    sim_target_regs[2] = 0x76543210;
+    bdmcf_shadow_invalidate();
+    CHECK(exec(CMD_WRITE_REG, params, 5, 5) == 1, "write A1 failed");
+    params[0] = 2;                      /* D2 */
+    CHECK(exec(CMD_READ_REG, params, 1, 1) == 5, "read D2 failed");
+    count = trace_drain(&lost);
+    CHECK(count == (int) sim_frames && lost == 0 && trace_matches(count), "trace of %u messages drained %d", sim_frames,
+          count);
+    for (i = 0; (i < count) && (trace_tx[i] != BDMCF_CMD_RAREG + 2); i++)
+    {
+        ;
+    }
+    CHECK(i + 2 < count && trace_rx[i + 1] == 0x7654 && trace_rx[i + 2] == 0x3210 && !trace_flags[i + 2],
+          "trace of the register read is wrong");
+
+    put_be32(params, 0x10000000);       /* the bus error comes with the status bit */
+    CHECK(exec(CMD_READ_MEM32, params, 4, 4) == 0 && exec(CMD_RESYNCHRONIZE, params, 0, 0) == 1,
+          "read of missing memory passed");
+    count = trace_drain(&lost);
+    for (i = 0; (i < count) && !((trace_flags[i] & TRACE_STATUS) && (trace_rx[i] == 0x0001)); i++)
+    {
+        ;
+    }
+    CHECK(i < count, "bus error not in the trace");
+
+    sim_frames = 0;                     /* the ring is full after BDMCF_TRACE_ENTRIES (256) messages */
+    for (i = 0; i < 300; i++)
+    {
+        bdmcf_txrx17_ptr(BDMCF_CMD_NOP);
+    }
+    count = trace_drain(&lost);
+    CHECK(count == 256 && lost == 300 - 256 && trace_tx[255] == BDMCF_CMD_NOP, "full trace: %d messages, %u lost",
+          count, lost);
+    count = trace_drain(&lost);
+    CHECK(count == 0 && lost == 0, "trace not empty after the drain");
+
+    params[0] = BDMCF_SPEED_SPI;        /* the trace stays on, the DMA blocks are recorded as a whole */
+    CHECK(exec(CMD_SET_SPEED, params, 1, 1) == 1 && bdmcf_txrx17_ptr == bdmcf_txrx17_trace, "SPI: trace lost");
+    sim_frames = 0;
+    put_be32(params, TEST_ADDRESS);
+    CHECK(exec(CMD_READ_MEMBLOCK32, params, 4, 32) == 33, "SPI: read block failed");
+    count = trace_drain(&lost);
+    for (i = 0; (i < count) && !(trace_flags[i] & TRACE_DMA); i++)
+    {
+        ;
+    }
+    CHECK(count == (int) sim_frames && trace_matches(count) && i + 1 < count && (trace_flags[i + 1] & TRACE_DMA) &&
+          trace_cycles[i + 1] == trace_cycles[i] && trace_duration[i + 1] == trace_duration[i],
+          "SPI: trace of %u messages drained %d", sim_frames, count);
+    params[0] = speed;
+    CHECK(exec(CMD_SET_SPEED, params, 1, 1) == 1, "speed %u: select failed", speed);
+
+    params[0] = 0;
+    CHECK(exec(CMD_TRACE_CONTROL, params, 1, 1) == 1 && bdmcf_txrx17_ptr == bdmcf_txrx17_ptrs[speed],
+          "trace not switched off");
+    bdmcf_txrx17_ptr(BDMCF_CMD_NOP);
+    CHECK(trace_drain(&lost) == 0 && lost == 0, "message recorded with the trace off");
+}
+
+/* appends a sub-command of CMD_BATCH at p, returns where the next one goes */
+static uint8_t *batch_add(uint8_t *p, uint8_t result, uint8_t cmd, const uint8_t *params, uint8_t count)
+{
+    p[0] = count;
+    p[1] = result;
+    p[2] = cmd;
+    memcpy(p + 3, params, count);
+    return p + 3 + count;
+}
+
+/* CMD_BATCH: results back to back, sub-commands after one which failed with & without BATCH_STOP_ON_ERROR, */
+/* the ones whose result would not fit are not executed and malformed batches */
+static void test_batch(void)
+{
+    uint8_t batch[MAX_DATA_SIZE];
+    uint8_t sub[8];
+    uint8_t *p;
+    uint8_t flags;
+
+    batch[0] = 0;
+    sub[0] = 0;                         /* D0 */
+    put_be32(sub + 1, 0x13579bdf);
+    p = batch_add(batch + 1, 0, CMD_WRITE_REG, sub, 5);
+    p = batch_add(p, 5, CMD_READ_REG, sub, 1);
+    put_be32(sub, TEST_ADDRESS);
+    put_be32(sub + 4, 0x2468ace0);
+    p = batch_add(p, 0, CMD_WRITE_MEM32, sub, 8);
+    p = batch_add(p, 5, CMD_READ_MEM32, sub, 4);
+    CHECK(exec(CMD_BATCH, batch, p - batch, p - batch) == 2 + 1 + 5 + 1 + 5 && buffer[1] == 4 &&
+          buffer[2] == CMD_WRITE_REG && buffer[3] == CMD_READ_REG && get_be32(buffer + 4) == 0x13579bdf &&
+          buffer[8] == CMD_WRITE_MEM32 && buffer[9] == CMD_READ_MEM32 && get_be32(buffer + 10) == 0x2468ace0 &&
+          sim_target_regs[0] == 0x13579bdf && get_be32(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE)) == 0x2468ace0,
+          "batch of register & memory accesses failed");
+
+    for (flags = 0; flags <= BATCH_STOP_ON_ERROR; flags += BATCH_STOP_ON_ERROR)
+    {
+        batch[0] = flags;               /* a sub-command without a bounded result fails, the next one still runs */
+        put_be32(sub, TEST_ADDRESS);
+        put_be32(sub + 4, 0);
+        p = batch_add(batch + 1, 0, CMD_WRITE_MEM32, sub, 8);
+        p = batch_add(p, 0, CMD_GET_EVENTS, sub, 0);
+        put_be32(sub + 4, 0x11111111);
+        p = batch_add(p, 0, CMD_WRITE_MEM32, sub, 8);
+        CHECK(exec(CMD_BATCH, batch, p - batch, p - batch) == (flags ? 4 : 5) && buffer[1] == (flags ? 2 : 3) &&
+              buffer[2] == CMD_WRITE_MEM32 && buffer[3] == CMD_FAILED &&
+              get_be32(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE)) == (flags ? 0 : 0x11111111),
+              "batch with flags %02x: failed sub-command", flags);
+
+        put_be32(sub, 0x10000000);      /* so does a bus error */
+        p = batch_add(batch + 1, 5, CMD_READ_MEM32, sub, 4);
+        put_be32(sub, TEST_ADDRESS);
+        put_be32(sub + 4, 0x22222222);
+        p = batch_add(p, 0, CMD_WRITE_MEM32, sub, 8);
+        CHECK(exec(CMD_BATCH, batch, p - batch, p - batch) == (flags ? 3 : 4) && buffer[1] == (flags ? 1 : 2) &&
+              buffer[2] == CMD_FAILED && get_be32(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE)) == (flags ? 0 : 0x22222222),
+              "batch with flags %02x: bus error", flags);
+        CHECK(exec(CMD_RESYNCHRONIZE, sub, 0, 0) == 1, "resync after the batch failed");
+    }
+
+    batch[0] = 0;                       /* 117 bytes read leave no room for the longest unstated result */
+    put_be32(sub, TEST_ADDRESS);
+    p = batch_add(batch + 1, 1 + 116, CMD_READ_MEMBLOCK32, sub, 4);
+    put_be32(sub + 4, 0x33333333);
+    p = batch_add(p, 0, CMD_WRITE_MEM32, sub, 8);
+    CHECK(exec(CMD_BATCH, batch, p - batch, p - batch) == 2 + 117 && buffer[1] == 1 &&
+          get_be32(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE)) != 0x33333333, "batch: result without room executed");
+
+    p = batch_add(batch + 1, 1 + 124, CMD_READ_MEMBLOCK32, sub, 4);
+    sub[0] = 0;                         /* a result longer than stated: executed, reported failed, nothing after it */
+    p = batch_add(p, 1, CMD_READ_REG, sub, 1);
+    p = batch_add(p, 1, CMD_READ_REG, sub, 1);
+    CHECK(exec(CMD_BATCH, batch, p - batch, p - batch) == 1 + MAX_DATA_SIZE && buffer[1] == 2 &&
+          buffer[2] == CMD_READ_MEMBLOCK32 && buffer[127] == CMD_FAILED, "batch: result longer than stated");
+
+    p = batch_add(batch + 1, 0, CMD_BATCH, batch, 1);       /* no nesting */
+    p[0] = 8;                           /* truncated: not executed */
+    p[1] = 0;
+    p[2] = CMD_WRITE_MEM32;
+    CHECK(exec(CMD_BATCH, batch, p + 3 - batch, p + 3 - batch) == 3 && buffer[1] == 1 && buffer[2] == CMD_FAILED,
+          "batch: nested or truncated sub-command executed");
+    CHECK(exec(CMD_BATCH, batch, 0, 0) == 0, "batch without flags passed");
+    memset(buffer, 0, sizeof(buffer));
+    buffer[1] = CMD_BATCH;
+    CHECK(command_exec(buffer, 1 + 3 + 8, TRANSPORT_EP0_IN) == 1 && buffer[0] == CMD_FAILED,
+          "batch passed in an EP0 IN request");
+}
+
+/* returns non-zero if the size bytes of sim_ram at address match pattern under mask */
+static int ram_matches(uint32_t address, uint8_t size, const uint8_t *pattern, const uint8_t *mask)
+{
+    uint8_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        if ((sim_ram[address - SIM_RAM_BASE + i] ^ pattern[i]) & mask[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* searches the range in steps of max matches, resuming from the cursor each time, and compares the addresses */
+/* found with a byte by byte search of sim_ram; returns non-zero if they are the same */
+static int search_check(uint32_t address, uint32_t length, uint8_t step, uint8_t max, uint8_t size, const uint8_t *pattern,
+                        const uint8_t *mask)
+{
+    uint32_t cursor = address;
+    uint32_t a = address;
+    uint32_t found;
+    int n = 0;
+    int i;
+
+    while (cursor < address + length)
+    {
+        n = search(cursor, address + length - cursor, step, max, size, pattern, mask, &cursor);
+        if ((n < 0) || ((n < max) && (cursor != address + length)))
+        {
+            return 0;                   /* a search stopped short must have got to the end */
+        }
+        for (i = 0; i < n; i++)
+        {
+            found = get_be32(buffer + 6 + 4 * i);
+            while ((a + size <= address + length) && !ram_matches(a, size, pattern, mask))
+            {
+                a += step;
+            }
+            if (found != a)
+            {
+                return 0;
+            }
+            a += step;
+        }
+        if ((n == max) && (cursor != found + step))
+        {
+            return 0;
+        }
+        if (address + length - cursor < size)
+        {
+            break;                      /* too short for CMD_SEARCH_MEM, no match fits */
+        }
+    }
+    for (; a + size <= address + length; a += step)         /* nothing missed after the last one */
+    {
+        if (ram_matches(a, size, pattern, mask))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* CMD_SEARCH_MEM with the USUB8/SEL & with the word-wide zero byte matcher: every value of the first byte at */
+/* every alignment, masks, a pattern across the blocks of DUMP32s & resuming from the cursor after max matches */
+static void test_search(void)
+{
+    static const uint8_t ones[BDMCF_SEARCH_PATTERN] =
+    {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
+    uint8_t *ram = sim_ram + (TEST_ADDRESS - SIM_RAM_BASE);
+    uint8_t pattern[BDMCF_SEARCH_PATTERN];
+    uint8_t mask[BDMCF_SEARCH_PATTERN];
+    uint32_t length = 3 * 4 * BDMCF_MEM_BLOCK;
+    uint32_t cursor;
+    uint32_t i;
+    uint8_t step;
+
+    for (sim_dsp = 1; sim_dsp < 2; sim_dsp--)
+    {
+        for (i = 0; i < length; i++)
+        {
+            ram[i] = i * 7 + (i >> 8) * 3;      /* each value 3 times, at a different alignment each time */
+        }
+        bdmcf_cache_invalidate();
+        for (i = 0; i < 256; i++)
+        {
+            pattern[0] = i;
+            pattern[1] = i + 7;
+            CHECK(search_check(TEST_ADDRESS, length, 1, BDMCF_SEARCH_MATCHES, 1, pattern, ones) &&
+                  search_check(TEST_ADDRESS + 1, length - 2, 1, BDMCF_SEARCH_MATCHES, 2, pattern, ones),
+                  "search (%s): first byte %02x", sim_dsp ? "USUB8/SEL" : "SWAR", i);
+        }
+        pattern[0] = 0x80;              /* the top bit only: half of the bytes match */
+        mask[0] = 0x80;
+        CHECK(search_check(TEST_ADDRESS + 3, length - 3, 1, 7, 1, pattern, mask) &&
+              search_check(TEST_ADDRESS + 1, length - 1, 2, 5, 1, pattern, mask) &&
+              search_check(TEST_ADDRESS + 2, length - 5, 4, 3, 1, pattern, mask),
+              "search (%s): masked first byte", sim_dsp ? "USUB8/SEL" : "SWAR");
+
+        for (i = 0; i < BDMCF_SEARCH_PATTERN; i++)
+        {
+            pattern[i] = 0xc3 ^ (i * 0x11);
+            mask[i] = (i & 1) ? 0xff : 0x3c;    /* every other byte partly don't care */
+        }
+        for (i = 0; i < BDMCF_SEARCH_PATTERN; i++)
+        {
+            ram[4 * BDMCF_MEM_BLOCK - 5 + i] = pattern[i] ^ ~mask[i];                   /* across the first blocks */
+            ram[2 * 4 * BDMCF_MEM_BLOCK - BDMCF_SEARCH_PATTERN + 1 + i] = pattern[i];   /* the last byte in the third */
+            ram[0x40 + i] = ram[0x51 + i] = pattern[i];
+        }
+        ram[0x40 + 9] ^= 0x01;          /* a bit under the mask off */
+        bdmcf_cache_invalidate();
+        for (step = 1; step <= 4; step *= 2)
+        {
+            CHECK(search_check(TEST_ADDRESS + 1, length - 2, step, 1, BDMCF_SEARCH_PATTERN, pattern, mask) &&
+                  search_check(TEST_ADDRESS, length, step, BDMCF_SEARCH_MATCHES, BDMCF_SEARCH_PATTERN, pattern, mask),
+                  "search (%s): %u byte pattern at step %u", sim_dsp ? "USUB8/SEL" : "SWAR", BDMCF_SEARCH_PATTERN, step);
+        }
+        CHECK(search(TEST_ADDRESS, length, 1, BDMCF_SEARCH_MATCHES, BDMCF_SEARCH_PATTERN, pattern, mask, &cursor) == 3 &&
+              get_be32(buffer + 6) == TEST_ADDRESS + 0x51 &&
+              get_be32(buffer + 10) == TEST_ADDRESS + 4 * BDMCF_MEM_BLOCK - 5 &&
+              get_be32(buffer + 14) == TEST_ADDRESS + 2 * 4 * BDMCF_MEM_BLOCK - BDMCF_SEARCH_PATTERN + 1 &&
+              cursor == TEST_ADDRESS + length, "search (%s): matches across the blocks not found",
+              sim_dsp ? "USUB8/SEL" : "SWAR");
+    }
+    sim_dsp = 1;
+
+    CHECK(search(TEST_ADDRESS, 8, 3, 1, 1, pattern, mask, &cursor) < 0 &&
+          search(TEST_ADDRESS, 8, 1, 1, BDMCF_SEARCH_PATTERN + 1, pattern, mask, &cursor) < 0 &&
+          search(TEST_ADDRESS, 1, 1, 1, 2, pattern, mask, &cursor) < 0, "search with bad parameters passed");
+    CHECK(search(0x10000000, 16, 1, 1, 1, pattern, mask, &cursor) < 0, "search of missing memory passed");
+    CHECK(exec(CMD_RESYNCHRONIZE, pattern, 0, 0) == 1, "resync after the search of missing memory failed");
+}
+
+/* one pass of the main loop, as in tbdm_main.c */
+static void main_loop(void)
+{
+    usb_command_process();
+    bdmcf_stream_poll();
+    bdmcf_halt_poll();
+    rsto_poll();
+    events_poll();
+    usb_event_process();
+}
+
+/* runs a standard device request without data stage, returns 0 if the device has acknowledged it */
+static int usb_request(uint8_t request, uint16_t value)
+{
+    uint8_t setup[8] = { 0x00, request, value & 0xff, value >> 8, 0, 0, 0, 0 };
+    uint8_t data[1];
+
+    return sim_usb_setup(setup) || sim_usb_in(0, data, sizeof(data)) != 0;
+}
+
+/* events go out on EP3 once the device is configured and leave the queue only when the host has them */
+static void test_events(void)
+{
+    uint8_t params[1] = { 0 };
+    uint8_t data[64];
+    uint16_t seq;
+    uint32_t i;
+
+    while (event_pop(data))
+    {
+        ;                                       /* drop what the other tests left */
+    }
+    usb_init();
+    sim_usb_reset();
+    for (i = 0; i < 6; i++)
+    {
+        event_push(EVENT_RESET, i, i, 0);
+    }
+    event_peek(0, data);
+    seq = get_be16(data + 1);
+
+    main_loop();
+    CHECK(sim_usb_in(3, data, sizeof(data)) == SIM_USB_NAK && event_pending(), "events sent before SET_CONFIGURATION");
+    CHECK(usb_request(USB_SET_CONFIGURATION, 1) == 0, "SET_CONFIGURATION failed");
+
+    /* the host takes the events with CMD_GET_EVENTS while the first 4 are waiting on EP3 */
+    main_loop();
+    CHECK(exec(CMD_GET_EVENTS, params, 0, 0) == 2 + 6 * EVENT_SIZE && buffer[1] == 6 && get_be16(buffer + 3) == seq,
+          "CMD_GET_EVENTS returned %u events from %u instead of 6 from %u", buffer[1], get_be16(buffer + 3), seq);
+    event_push(EVENT_RESET, 6, 6, 0);
+    event_push(EVENT_RESET, 7, 7, 0);
+    CHECK(sim_usb_in(3, data, sizeof(data)) == 4 * EVENT_SIZE && get_be16(data + 1) == seq, "EP3 packet lost");
+    main_loop();
+    CHECK(sim_usb_in(3, data, sizeof(data)) == 2 * EVENT_SIZE && get_be16(data + 1) == (uint16_t) (seq + 6),
+          "events queued after CMD_GET_EVENTS not sent on EP3");
+    main_loop();
+    CHECK(sim_usb_in(3, data, sizeof(data)) == SIM_USB_NAK && !event_pending(), "events sent twice on EP3");
+
+    /* a bus reset drops the packet, not the events */
+    for (i = 0; i < 3; i++)
+    {
+        event_push(EVENT_RESET, i, i, 0);
+    }
+    main_loop();
+    sim_usb_reset();
+    main_loop();
+    CHECK(sim_usb_in(3, data, sizeof(data)) == SIM_USB_NAK && event_pending(), "events sent before SET_CONFIGURATION");
+    CHECK(usb_request(USB_SET_CONFIGURATION, 1) == 0, "SET_CONFIGURATION failed");
+    main_loop();
+    CHECK(sim_usb_in(3, data, sizeof(data)) == 3 * EVENT_SIZE && get_be16(data + 1) == (uint16_t) (seq + 8),
+          "events armed before the bus reset lost");
+    CHECK(sim_usb_toggle_errors == 0, "%u USB packets with the wrong DATA0/1", sim_usb_toggle_errors);
+}
+
+static int vendor_stalled;
+
+/* a vendor request for CMD_GET_VER arriving while the main loop executes a command */
+static void vendor_interrupt(void)
+{
+    uint8_t setup[8] = { 0xc0, CMD_GET_VER, 0, 0, 0, 0, 3, 0 };
+    uint8_t data[8];
+
+    sim_target_hook = NULL;
+    vendor_stalled = (sim_usb_setup(setup) == 0) && (sim_usb_in(0, data, sizeof(data)) == SIM_USB_STALL);
+}
+
+/* a vendor SETUP is stalled while a command executes and the result of the request it replaced is dropped */
+static void test_vendor(void)
+{
+    uint8_t setup[8] = { 0xc0, CMD_READ_MEM32, 0, 0, 0, 0, 5, 0 };
+    uint8_t data[64];
+
+    put_be32(setup + 2, TEST_ADDRESS);  /* wValue & wIndex carry the parameters as they are on the wire */
+    usb_init();
+    sim_usb_reset();
+    bdmcf_cache_invalidate();
+    put_be32(sim_ram + (TEST_ADDRESS - SIM_RAM_BASE), 0x12345678);
+
+    CHECK(sim_usb_setup(setup) == 0 && sim_usb_in(0, data, sizeof(data)) == SIM_USB_NAK, "vendor request not NAKed");
+    vendor_stalled = 0;
+    sim_target_hook = vendor_interrupt;
+    main_loop();
+    sim_target_hook = NULL;
+    CHECK(vendor_stalled, "vendor SETUP taken while a command was executing");
+    CHECK(sim_usb_in(0, data, sizeof(data)) == SIM_USB_STALL, "result of a replaced vendor request sent");
+
+    CHECK(sim_usb_setup(setup) == 0, "vendor SETUP after the stall not taken");
+    main_loop();
+    CHECK(sim_usb_in(0, data, sizeof(data)) == 5 && data[0] == CMD_READ_MEM32 && get_be32(data + 1) == 0x12345678,
+          "vendor request after the stall failed");
+    CHECK(sim_usb_out(0, data, 0) == 0, "status stage of the vendor request failed");
+}
+
+/* times TEST_FRAMES messages on the simulated clock & on the host, returns the modelled DSCLK in Hz */
+static uint32_t test_rate(uint8_t speed)
+{
+    uint64_t cycles = sim_cycles;
+    clock_t start = clock();
+    double seconds;
+    uint32_t i;
+
+    for (i = 0; i < TEST_FRAMES; i++)
+    {
+        bdmcf_txrx17_ptr(BDMCF_CMD_NOP);
+    }
+    cycles = sim_cycles - cycles;
+    seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("speed %u: %9.0f messages/s modelled, DSCLK %8.0f Hz (documented %7u Hz), %9.0f messages/s on the host\n",
+           speed, TEST_FRAMES * SIM_CORE_KHZ * 1000.0 / cycles, 17.0 * TEST_FRAMES * SIM_CORE_KHZ * 1000.0 / cycles,
+           dsclk_hz[speed], seconds > 0 ? TEST_FRAMES / seconds : 0);
+    return 17.0 * TEST_FRAMES * SIM_CORE_KHZ * 1000.0 / cycles;
+}
+
+int main(void)
+{
+    uint8_t params[1] = { CF_BDM };
+    uint8_t speed;
+    uint32_t hz;
+
+    sim_reset();
+    CHECK(exec(CMD_SET_TARGET, params, 1, 1) == 3 && buffer[1] != 0xff, "set target failed");
+    CHECK(buffer[2] == BDMCF_SPEED_GPIO - BDMCF_SPEED_DEFAULT, "negotiation probed %u speeds instead of %u", buffer[2],
+          BDMCF_SPEED_GPIO - BDMCF_SPEED_DEFAULT);    /* upwards from the default, the simulated target takes any speed */
+
+    for (speed = 0; speed < BDMCF_SPEEDS; speed++)
+    {
+        params[0] = speed;
+        CHECK(exec(CMD_SET_SPEED, params, 1, 1) == 1, "speed %u: select failed", speed);
+        test_registers(speed);
+        test_memory(speed);
+        if (speed == BDMCF_SPEED_SPI)
+        {
+            test_spi();
+        }
+
+        hz = test_rate(speed);
+        CHECK((hz > dsclk_hz[speed] * 3 / 4) && (hz < dsclk_hz[speed] * 5 / 4), "speed %u: DSCLK %u Hz instead of %u Hz",
+              speed, hz, dsclk_hz[speed]);
+    }
+
+    params[0] = BDMCF_SPEED_SPI;        /* with SPI0 selected the negotiation stays on its rates */
+    CHECK(exec(CMD_SET_SPEED, params, 1, 1) == 1, "SPI: select failed");
+    params[0] = CF_BDM;
+    CHECK(exec(CMD_SET_TARGET, params, 1, 1) == 3 && buffer[1] == BDMCF_SPEEDS - 1 - BDMCF_NEGOTIATE_MARGIN &&
+          buffer[2] == BDMCF_SPEEDS - BDMCF_SPEED_SPI, "SPI: negotiated speed %u after %u probes", buffer[1], buffer[2]);
+
+    params[0] = BDMCF_SPEED_DEFAULT;    /* no target: the default & every slower speed are probed, the command fails */
+    CHECK(exec(CMD_SET_SPEED, params, 1, 1) == 1, "speed %u: select failed", BDMCF_SPEED_DEFAULT);
+    sim_target_detached = 1;
+    params[0] = CF_BDM;
+    memset(buffer, 0, sizeof(buffer));
+    buffer[1] = CMD_SET_TARGET;
+    buffer[2] = CF_BDM;
+    CHECK(command_exec(buffer, 1, TRANSPORT_BULK) == 3 && buffer[0] == CMD_FAILED && buffer[1] == 0xff &&
+          buffer[2] == BDMCF_SPEED_DEFAULT + 1, "set target without a target: status %u, speed %u after %u probes",
+          buffer[0], buffer[1], buffer[2]);
+    sim_target_detached = 0;
+    CHECK(exec(CMD_SET_TARGET, params, 1, 1) == 3 && buffer[1] == BDMCF_SPEED_GPIO - 1 - BDMCF_NEGOTIATE_MARGIN,
+          "set target after the target is back failed");
+
+    test_halt();
+    test_break();
+    test_batch();
+    test_crc();
+    test_context();
+    test_step();
+    test_fill();
+    test_write_diff();
+    test_transfer();
+    test_trace();
+    test_cache();
+    test_shadow();
+    test_stream();
+    test_rle();
+    test_read_rle();
+    test_search();
+    test_events();
+    test_vendor();
+
+    CHECK(sim_protocol_errors == 0, "%u malformed messages", sim_protocol_errors);
+
+    printf("%s: %d failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+    return failures != 0;
+}
@@ -36,6 +36,11 @@
 #define LED_ON()  BITBAND_REG(GPIOC_PDOR, 5) = 1
 #define LED_OFF() BITBAND_REG(GPIOC_PDOR, 5) = 0
 
+/* free running core clock cycle counter of the DWT unit, for timestamps and timeouts */
+#define CYCCNT_INIT()   do { DEMCR |= (1 << 24); DWT_CYCCNT = 0; DWT_CTRL |= 1; } while (0)   /* TRCENA, CYCCNTENA */
+#define CYCCNT()        DWT_CYCCNT
+#define CYCCNT_US(c)    ((c) / (core_clk_khz / 1000))
+
 /*ARM Cortex M4 implementation for interrupt priority shift*/
 #define ARM_INTERRUPT_LEVEL_BITS          4
 
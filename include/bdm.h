@@ -53,8 +53,10 @@
 
 #define DSI()           (GPIOA_PDIR & (1 << 13))
 
-extern uint32_t bdmcf_txrx(uint32_t mess);
-extern void bdmcf_ta(uint32_t time_ms);
-extern void bdmcf_reset(void);
+extern void bdmcf_ta(uint8_t time_10us);
+extern void bdmcf_reset(uint8_t bkpt);
+extern void bdmcf_stream_poll(void);
+extern void bdmcf_halt_poll(void);
+extern void rsto_poll(void);
 #endif // BDM_H
 
@@ -33,11 +33,11 @@
 #define RSTI_DIRECTION  BITBAND_REG(GPIOD_PDDR, 4)
 #define RSTI_OUT        BITBAND_REG(GPIOD_PDOR, 4)
 
-#define TA_DIRECTION    BITBAND_REG(GPIOD_PDDR, 7)
-#define TA_OUT          BITBAND_REG(GPIOD_PDOR, 7)
+#define TA_DIRECTION    BITBAND_REG(GPIOD_PDDR, 2)
+#define TA_OUT          BITBAND_REG(GPIOD_PDOR, 2)
 
 #define RSTO_DIRECTION  BITBAND_REG(GPIOD_PDDR, 3)
-#define RSTO_IN         BITBAND_REG(GPIOD_PDOR, 3)
+#define RSTO_IN         BITBAND_REG(GPIOD_PDIR, 3)
 
 
 
@@ -129,6 +129,12 @@
 #define BDMCF_CMD_FILL16    0x1C40
 #define BDMCF_CMD_FILL32    0x1C80
 
+#define BDMCF_CREG_PC       0x080F  /* control register addresses for RCREG/WCREG */
+#define BDMCF_CREG_SR       0x080E
+
+#define BDMCF_CSR_STATIC_MASK   0x0fffffff  /* CSR bits 31-28 are status bits which clear when read */
+#define BDMCF_HALT_POLL_US      1000        /* how often the CSR of a running target is checked for a halt */
+
 #ifdef INVERT
 #define BDMCF_IDLE        (DSI_OUT_MASK+TCLK_OUT_MASK+DSCLK_OUT_MASK)
 #define JTAG_IDLE         (TDI_OUT_MASK+TCLK_OUT_MASK)
@@ -169,44 +175,171 @@ unsigned char bdmcf_complete_chk_rx(void);
 unsigned char bdmcf_tx_msg_half_rx(unsigned int data);
 unsigned char bdmcf_rx(unsigned char count, unsigned char *data);
 unsigned char bdmcf_rxtx(unsigned char count, unsigned char *data, unsigned int next_cmd);
-void rsto_detect(void);
+unsigned char bdmcf_fill(unsigned char count, unsigned char size, unsigned char *data, unsigned int fill_cmd);
+void rsto_poll(void);
 void jtag_transition_shift(unsigned char mode);
 void jtag_init(void);
 void jtag_write(unsigned char tap_transition, unsigned char bit_count, unsigned char * datap);
 void jtag_read(unsigned char tap_transition, unsigned char bit_count, unsigned char * datap);
 void jtag_transition_reset(void);
 void bdmcf_ta(unsigned char time_10us);
+unsigned char bdmcf_go(unsigned char step);
+uint8_t bdmcf_step_n(uint32_t count, uint32_t start, uint32_t end, uint8_t mode, uint16_t timeout_ms,
+                     uint32_t *pc, uint32_t *steps);
+void bdmcf_halt_poll(void);
+void bdmcf_halted(uint32_t csr);
+
+/* 17 bit messages as shifted by the Tx/Rx functions: the status bit sits on top of the 16 data bits */
+#define BDMCF_STATUS(mess)  (((mess) >> 16) & 1)
+#define BDMCF_BUS_ERROR(mess)   (((mess) & 0x1ffff) == 0x10001)
+
+extern uint8_t bdmcf_bus_error;
+extern uint8_t bdmcf_running;
+extern uint8_t bdmcf_target_halted;
+
+/* delay loop passes per DSCLK half period (3 core cycles each), DSCLK must not exceed 1/5 of the target's clock */
+#define BDMCF_DELAY_0       40000   /* ~400Hz DSCLK at 96MHz core clock, targets clocked down to 2kHz */
+#define BDMCF_DELAY_1       2600    /* ~6kHz, 32kHz clocked targets */
+#define BDMCF_DELAY_2       160     /* ~100kHz */
+#define BDMCF_DELAY_3       48      /* ~330kHz */
+#define BDMCF_DELAY_4       14      /* ~1MHz */
+#define BDMCF_DELAY_5       4       /* ~2.5MHz */
+#define BDMCF_DELAY_6       0       /* ~6MHz, 30MHz and faster cores (V4) */
 
 /* prototypes for the Rx and Tx functions */
-void bdmcf_tx8_1(unsigned char data);
-unsigned char bdmcf_rx8_1(void);
-unsigned char bdmcf_txrx8_1(unsigned char data);
-unsigned char bdmcf_txrx_start_1(void);
-
-#ifdef MULTIPLE_SPEEDS
-/* until more than one set of rx/tx functions is needed the speed of operation can be improved by not using the pointers */
-
-/* pointers to Tx & Rx functions */
-extern unsigned char near (*bdmcf_rx8_ptr)(void);
-extern void near (*bdmcf_tx8_ptr)(unsigned char);
-extern unsigned char near (*bdmcf_txrx8_ptr)(unsigned char);
-extern unsigned char near (*bdmcf_txrx_start_ptr)(void);
-
-
-/* tables with pointers to Tx & Rx functions */
-extern unsigned char (* const bdmcf_rx8_ptrs[])(void);
-extern void (* const bdmcf_tx8_ptrs[])(unsigned char);
-extern unsigned char (* const bdmcf_txrx8_ptrs[])(unsigned char);
-extern unsigned char (* const bdmcf_txrx_start_ptrs[])(void);
-#else
-void bdmcf_rx8_ptr(unsigned char data);
-unsigned char bdmcf_tx8_ptr(void);
-unsigned char bdmcf_txrx8_ptr(unsigned char data);
-unsigned char bdmcf_txrx_start_ptr(void);
-
-#define bdmcf_rx8_ptr bdmcf_rx8_1
-#define bdmcf_tx8_ptr bdmcf_tx8_1
-#define bdmcf_txrx8_ptr bdmcf_txrx8_1
-#define bdmcf_txrx_start_ptr bdmcf_txrx_start_1
-#endif
-
+uint32_t bdmcf_txrx17_0(uint32_t mess);
+uint32_t bdmcf_txrx17_1(uint32_t mess);
+uint32_t bdmcf_txrx17_2(uint32_t mess);
+uint32_t bdmcf_txrx17_3(uint32_t mess);
+uint32_t bdmcf_txrx17_4(uint32_t mess);
+uint32_t bdmcf_txrx17_5(uint32_t mess);
+uint32_t bdmcf_txrx17_6(uint32_t mess);
+uint32_t bdmcf_txrx_bits_gpio(uint32_t mess, uint8_t bits);
+void bdmcf_init_gpio(void);
+
+/* SPI0 + eDMA transport (bdmcf_spi.c) */
+uint32_t bdmcf_txrx17_spi(uint32_t mess);
+uint32_t bdmcf_txrx_bits_spi(uint32_t mess, uint8_t bits);
+void bdmcf_init_spi(void);
+uint8_t bdmcf_spi_dump(uint8_t count, uint8_t words, uint8_t *data, unsigned int next_cmd);
+uint8_t bdmcf_spi_fill(uint8_t count, uint8_t words, uint8_t *data, unsigned int fill_cmd);
+
+/* transfers beyond MAX_DATA_SIZE (bdmcf_stream.c) */
+#define BDMCF_STREAM_IDLE   0
+#define BDMCF_STREAM_READ   1
+#define BDMCF_STREAM_WRITE  2
+#define BDMCF_STREAM_END    3       /* BDM side finished, waiting for the host to collect the trailer */
+
+#define BDMCF_STREAM_CHUNK  116     /* data bytes per CMD_STREAM_DATA response: cmd + status + data + trailer <= MAX_DATA_SIZE */
+
+uint8_t bdmcf_stream_start(uint8_t write, uint32_t address, uint32_t length, uint8_t flags);
+uint8_t bdmcf_stream_active(void);
+uint8_t bdmcf_stream_writing(void);
+void bdmcf_stream_abort(void);
+uint8_t bdmcf_stream_get(uint8_t *data, uint8_t max);
+uint8_t bdmcf_stream_put(uint8_t *data, uint8_t len);
+uint8_t bdmcf_stream_status(uint8_t *trailer);
+void bdmcf_stream_poll(void);
+
+/* operations on target memory ranges (bdmcf_mem.c) */
+#define BDMCF_MEM_BLOCK     64      /* dwords per READ32/DUMP32 sequence */
+
+uint8_t bdmcf_read_block32(uint32_t address, uint8_t count, uint8_t *data);
+uint8_t bdmcf_write_block32(uint32_t address, uint8_t count, uint8_t *data);
+uint8_t bdmcf_mem_crc32(uint32_t address, uint32_t length, uint32_t *crc);
+uint8_t bdmcf_mem_fill(uint32_t address, uint32_t length, uint8_t width, uint32_t pattern);
+
+uint8_t bdmcf_mem_write_diff(uint32_t address, uint8_t count, uint8_t *data, uint8_t *skipped);
+uint8_t bdmcf_mem_transfer(uint8_t write, uint32_t address, uint32_t length, uint8_t *data);
+
+#define BDMCF_MEM_RLE_MAX       0xfffc  /* most bytes CMD_READ_MEMBLOCK_RLE covers */
+
+uint8_t bdmcf_mem_read_rle(uint32_t address, uint32_t length, uint8_t *out, uint8_t max, uint16_t *covered, uint8_t *size);
+
+#define BDMCF_SEARCH_PATTERN    16  /* longest pattern CMD_SEARCH_MEM looks for */
+#define BDMCF_SEARCH_MATCHES    30  /* most addresses returned, 32-bit each after the 8-bit count & the 32-bit cursor */
+
+uint8_t bdmcf_mem_search(uint32_t address, uint32_t length, uint8_t step, uint8_t size, uint8_t *pattern, uint8_t *mask,
+                         uint8_t max, uint8_t *matches, uint8_t *found, uint32_t *cursor);
+
+/* CPU context (bdmcf_regs.c) */
+#define BDMCF_CONTEXT_SIZE  72      /* D0-D7, A0-A7, PC & SR, 32 bits each */
+#define BDMCF_CONTEXT_CREGS 8       /* control registers the host can add to the context */
+
+#define BDMCF_SHADOW_CREGS  (BDMCF_CONTEXT_CREGS + 4)  /* control registers the shadow holds, a full context & a few more */
+
+uint8_t bdmcf_read_context(uint8_t count, uint8_t *cregs, uint8_t *data);
+uint8_t bdmcf_write_context(uint8_t count, uint8_t *data);
+void bdmcf_shadow_invalidate(void);
+uint8_t bdmcf_read_reg(uint8_t reg, uint8_t *data);
+uint8_t bdmcf_write_reg(uint8_t reg, uint8_t *data);
+uint8_t bdmcf_read_creg(uint16_t creg, uint8_t *data);
+uint8_t bdmcf_write_creg(uint16_t creg, uint8_t *data);
+uint8_t bdmcf_read_dmreg(uint8_t reg, uint8_t *data);
+uint8_t bdmcf_write_dmreg(uint8_t reg, uint8_t *data);
+uint8_t bdmcf_read_csr(uint32_t *csr);
+void bdmcf_shadow_csr(uint32_t csr);
+void bdmcf_shadow_stats(uint8_t clear, uint8_t *data);
+
+/* software breakpoints (bdmcf_break.c) */
+#define BDMCF_BREAKPOINTS   32
+#define BDMCF_HALT_OPCODE   0x4ac8  /* HALT instruction */
+
+uint8_t bdmcf_break_set(uint8_t op, uint32_t address);
+uint8_t bdmcf_break_count(void);
+uint8_t bdmcf_break_at(uint32_t address);
+uint8_t bdmcf_break_insert(void);
+uint8_t bdmcf_break_remove(void);
+
+/* memory cache (bdmcf_cache.c) */
+#define BDMCF_CACHE_PAGE    64      /* bytes per page, must be a power of two */
+
+#define BDMCF_CACHE_HIT     0
+#define BDMCF_CACHE_ERROR   1
+#define BDMCF_CACHE_BYPASS  2       /* not cached, read the target */
+
+void bdmcf_cache_invalidate(void);
+uint8_t bdmcf_cache_window(uint8_t window, uint32_t address, uint32_t length);
+uint8_t bdmcf_cache_read(uint32_t address, uint8_t width, uint32_t length, uint8_t *data);
+void bdmcf_cache_write(uint32_t address, uint32_t length, uint8_t *data);
+
+/* flash programming through a stub on the target (bdmcf_flash.c) */
+#define BDMCF_FLASH_SECTORS 8       /* number of buffers CMD_FLASH_STATUS reports the programming time of */
+
+uint8_t bdmcf_flash_setup(uint32_t entry, uint32_t mailbox, uint32_t buffer0, uint32_t buffer1, uint16_t size);
+uint8_t bdmcf_flash_program(uint32_t address, uint8_t *data, uint8_t length);
+uint8_t bdmcf_flash_flush(void);
+uint8_t bdmcf_flash_status(uint8_t *data);
+
+/* trace of the 17 bit messages (bdmcf_trace.c) */
+#define BDMCF_TRACE_ENTRY_SIZE  11      /* bytes per message in a CMD_TRACE_DRAIN response */
+#define BDMCF_TRACE_DRAIN       11      /* messages per CMD_TRACE_DRAIN response: cmd + 3 + 11 * 11 <= MAX_DATA_SIZE */
+
+extern uint8_t bdmcf_trace_on;
+void bdmcf_trace_frame(uint32_t cycles, uint32_t duration, uint16_t tx, uint32_t rx, uint8_t flags);
+uint32_t bdmcf_txrx17_trace(uint32_t mess);
+void bdmcf_trace_enable(uint8_t on);
+uint8_t bdmcf_trace_drain(uint8_t *data);
+
+/* speeds 0..6 are bit-banged on PTA12/PTA13/PTD7 with the DSCLK period of BDMCF_DELAY_x, slowest first */
+/* speeds 7..12 shift through SPI0 on PTC5/PTC6/PTC7 with the DSCLK of bdmcf_spi_ctar[], slowest first */
+#define BDMCF_SPEED_GPIO    7       /* number of bit-banged speeds */
+#define BDMCF_SPEED_SPI     7       /* first SPI0 speed, block transfers by DMA */
+#define BDMCF_SPEEDS        13
+#define BDMCF_SPEED_DEFAULT 4       /* ~1MHz */
+
+#define BDMCF_NEGOTIATE_ROUNDS  8           /* clean CSR reads required before a speed is accepted */
+#define BDMCF_NEGOTIATE_MARGIN  1           /* number of speeds to step back from the fastest one which passed */
+
+extern uint8_t bdmcf_speed;
+uint8_t bdmcf_select_speed(uint8_t speed);
+uint8_t bdmcf_negotiate_speed(uint8_t *probes);
+
+/* pointers to Tx/Rx functions */
+extern uint32_t (*bdmcf_txrx17_ptr)(uint32_t);
+extern uint32_t (*bdmcf_txrx_bits_ptr)(uint32_t, uint8_t);
+
+/* tables with pointers to Tx/Rx functions */
+extern uint32_t (* const bdmcf_txrx17_ptrs[])(uint32_t);
+extern uint32_t (* const bdmcf_txrx_bits_ptrs[])(uint32_t, uint8_t);
+extern void (* const bdmcf_init_ptrs[])(void);
@@ -1,6 +1,39 @@
 #include <stdint.h>
 
-uint8_t command_exec(uint8_t *, uint32_t);
+/* how a command reached command_exec() */
+typedef enum
+{
+    TRANSPORT_BULK = 0,         /* EP2, all parameters arrive (also the sub-commands of CMD_BATCH) */
+    TRANSPORT_EP0_OUT,          /* vendor request with the parameters in the data stage, the result is not sent */
+    TRANSPORT_EP0_IN            /* vendor request reading data, only wValue & wIndex (4 parameter bytes) arrive */
+} transport_e;
+
+uint8_t command_exec(uint8_t *, uint32_t, transport_e);
+
+/* command parameters and results are transferred in big endian (see commands.h) */
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
 
 typedef enum
 {
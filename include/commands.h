@@ -3,6 +3,9 @@
 1   byte : command number (see below)
 n   bytes: command parameters (data)
 
+   on the bulk endpoints (EP2 OUT, results on EP1 IN) the command is preceded by one byte with the number of
+   bytes expected back from commands which read data (0 for all others), the transfer ends with a short packet
+
    data format:
 
 all 16-bit and 32-bit data is transferred in big endian, i.e. MSB on lower address (first) and LSB on higher address (next)
@@ -14,6 +17,54 @@ data must be converted properly on intel machines (PCs)
 #define RESET_DETECTED_MASK   0x0001
 #define RSTO_STATE_MASK       0x0002
 
+/* CMD_STREAM_DATA status */
+#define STREAM_MORE           0 /* stream is running */
+#define STREAM_BUSY           1 /* no data to read yet / no room for the written data, send the same request again */
+#define STREAM_DONE           2 /* stream finished, followed by the 32-bit byte count & CRC-32 (as zlib) of the data */
+#define STREAM_ERROR          3 /* target failed, followed by the count & CRC-32 of the bytes transferred before the error */
+
+/* CMD_STREAM_READ flags */
+#define STREAM_RLE            0x01 /* the data of CMD_STREAM_DATA is run length encoded (see rle.h), the trailer is of the raw data */
+
+/* mailbox of the flash programming stub (see CMD_FLASH_SETUP), byte offsets of the 32-bit fields */
+#define FLASH_MBOX_COMMAND    0  /* written last by the probe, set back to FLASH_MBOX_IDLE by the stub when done */
+#define FLASH_MBOX_STATUS     4  /* set by the stub, 0 = success, anything else is an error code of the stub */
+#define FLASH_MBOX_ADDRESS    8  /* flash address to program */
+#define FLASH_MBOX_BUFFER     12 /* RAM address of the data */
+#define FLASH_MBOX_COUNT      16 /* number of bytes */
+
+#define FLASH_MBOX_IDLE       0
+#define FLASH_MBOX_PROGRAM    1  /* erase (as the stub sees fit) and program a buffer */
+
+/* events (interrupt endpoint EP3, up to 4 per packet, or CMD_GET_EVENTS), each is 8-bit type, 16-bit sequence number, */
+/* 32-bit timestamp in us since start-up & two 32-bit arguments */
+#define EVENT_HALT            1  /* target stopped after CMD_GO, arguments: PC, CSR (bits 31-28 tell why: FOF, TRG, HALT, BKPT) */
+#define EVENT_RESET           2  /* target reset detected (RSTO asserted), arguments: cycle counter (96MHz) at the edge, number of edges lost so far */
+#define EVENT_BUS_ERROR       3  /* BDM command ended with a bus error, arguments: command number, first 4 parameter bytes (the address of memory commands) */
+#define EVENT_OVERFLOW        4  /* event queue was full, arguments: number of events lost, sequence number of the first one lost */
+
+/* CMD_STEP_N stop conditions (8-bit mode) & the reason it stopped */
+#define STEP_STOP_NONE        0  /* only the count & the timeout */
+#define STEP_STOP_OUTSIDE     1  /* stop once the PC is outside the range */
+#define STEP_STOP_INSIDE      2  /* stop once the PC is inside the range */
+
+#define STEP_COUNT            0  /* all steps done */
+#define STEP_RANGE            1  /* the PC left/entered the range */
+#define STEP_TIMEOUT          2
+#define STEP_ERROR            3  /* the target did not step, the PC & count are of the last good step */
+
+/* CMD_BREAKPOINT operations */
+#define BREAK_ADD             0
+#define BREAK_REMOVE          1
+#define BREAK_CLEAR           2  /* remove all of them */
+
+/* CMD_TRACE_DRAIN message flags */
+#define TRACE_STATUS          0x01 /* status bit of the message received (not ready or error) */
+#define TRACE_DMA             0x02 /* part of a block moved by DMA, the time & duration are of the whole block */
+
+/* CMD_BATCH flags */
+#define BATCH_STOP_ON_ERROR   0x01 /* do not execute the sub-commands following one which failed */
+
 /* target types */
 #define TARGET_TYPE_CF_BDM    0
 #define TARGET_TYPE_JTAG      1
@@ -23,6 +74,9 @@ data must be converted properly on intel machines (PCs)
 
 #define MAX_DATA_SIZE         127 /* maximum command parameter/result block size in bytes; this is to make sure that response of READ_BLOCK plus the command status fit into 16 frames exactly */
 
+/* commands reading data over EP0 (IN vendor requests) only get the 4 parameter bytes of wValue & wIndex, */
+/* the ones marked "bulk only" need more and fail there; EP0 OUT requests carry the parameters but return no result */
+
 /* System related commands */
 #define CMD_FAILED            1  /* command execution failed (incorrect parameters, target not responding, etc.) */
 #define CMD_UNKNOWN           2  /* unknown command */
@@ -32,9 +86,10 @@ data must be converted properly on intel machines (PCs)
 #define CMD_GET_LAST_STATUS   11 /* returns status of the previous command */
 #define CMD_SET_BOOT          12 /* request bootloader firmware upgrade on next power-up, parameters: 'B','O','O','T', returns: none */
 #define CMD_GET_STACK_SIZE    13 /* parameters: none, returns 16-bit stack size required by the application (so far into the execution) */
+#define CMD_BATCH             14 /* parameters 8-bit flags & sub-commands, each 8-bit parameter count, 8-bit result length (bytes requested for reading commands, 0 otherwise), command & parameters; returns 8-bit number of sub-commands executed & their results (status byte & data each) back to back; bulk only (an EP0 IN request carries just 4 parameter bytes), sub-commands without a bounded result (CMD_BATCH, CMD_STREAM_DATA, CMD_FLASH_STATUS, CMD_GET_EVENTS, CMD_SEARCH_MEM, CMD_TRACE_DRAIN) fail */
 
 /* BDM/debugging related commands */
-#define CMD_SET_TARGET        20 /* set target, 8bit parameter: 00=ColdFire(default), 01=JTAG */
+#define CMD_SET_TARGET        20 /* set target, 8bit parameter: 00=ColdFire(default), 01=JTAG; ColdFire returns 8-bit negotiated DSCLK speed index & 8-bit number of speeds probed, fails (speed index 0xff, the probes still reported) if the target does not answer at any speed */
 #define CMD_RESET             21 /* 8bit parameter: 0=reset to BDM Mode, 1=reset to Normal mode */
 #define CMD_GET_STATUS        22 /* returns 16bit status word: bit0 - target was reset since last execution of this command (this bit is cleared after reading), bit1 - current state of the RSTO pin, big endian! */
 #define CMD_HALT              23 /* stop the CPU and bring it into BDM mode */
@@ -42,6 +97,8 @@ data must be converted properly on intel machines (PCs)
 #define CMD_STEP              25 /* perform single step */
 #define CMD_RESYNCHRONIZE     26 /* resynchronize communication with the target (in case of noise, etc.) */
 #define CMD_ASSERT_TA         27 /* parameter: 8-bit number of 10us ticks - duration of the TA assertion */
+#define CMD_SET_SPEED         28 /* parameter: 8-bit DSCLK speed index (0 = slowest, see bdmcf.h), returns none */
+#define CMD_GET_SPEED         29 /* returns 8-bit index of the selected DSCLK speed & 8-bit number of available speeds */
 
 /* CPU related commands */
 #define CMD_READ_MEM8         30 /* parameter 32bit address, returns 8bit value read from address */
@@ -69,6 +126,35 @@ data must be converted properly on intel machines (PCs)
 #define CMD_READ_DREG         46 /* parameter 8-bit register number to read, returns 32-bit debug module register contents */
 #define CMD_WRITE_DREG        47 /* parameter 8-bit register number to write & the 32-bit debug module register contents to be written */
 
+#define CMD_STREAM_READ       48 /* parameter 32bit address, 32-bit byte count (multiple of 4) & optional 8-bit flags (see STREAM_RLE), starts dumping dwords into the stream buffer */
+#define CMD_STREAM_WRITE      49 /* parameter 32bit address & 32-bit byte count (multiple of 4), data follows with CMD_STREAM_DATA */
+#define CMD_STREAM_DATA       50 /* read: returns 8-bit stream status & next block of data (no more than the bytes requested leave besides the status & an 8 byte trailer, fails if that is less than a dword); write: parameter data (multiple of 4 bytes), returns 8-bit stream status; trailer see STREAM_DONE */
+#define CMD_STREAM_ABORT      51 /* drop the running stream */
+
+#define CMD_CRC32_MEMBLOCK    52 /* parameter 32bit address & 32-bit byte count, returns 32-bit CRC-32 (as zlib) of the memory contents; bulk only */
+
+#define CMD_FLASH_SETUP       53 /* parameters 32-bit stub entry point, 32-bit mailbox address, 32-bit addresses of the 2 RAM buffers & 16-bit buffer size, starts the stub already downloaded */
+#define CMD_FLASH_PROGRAM     54 /* parameter 32bit flash address & the data (multiple of 4 bytes), programmed in the background once a buffer is full */
+#define CMD_FLASH_FLUSH       55 /* program the data left in the buffer & wait for the stub to finish */
+#define CMD_FLASH_STATUS      56 /* returns 32-bit stub status of the last buffer, 8-bit count & that many records of the last buffers programmed: 32-bit flash address, 32-bit byte count, 32-bit time in us */
+
+#define CMD_GET_EVENTS        57 /* returns 8-bit number of events & the oldest queued events (see EVENT_x) */
+
+#define CMD_READ_CONTEXT      58 /* parameters up to 8 16-bit control register addresses (as many as the bytes requested allow), returns 32-bit D0-D7, A0-A7, PC, SR & the control registers; bulk only for more than 2 control registers */
+#define CMD_WRITE_CONTEXT     59 /* parameters 32-bit D0-D7, A0-A7, PC, SR & up to 8 16-bit control register addresses with the 32-bit values, SR is written first */
+#define CMD_GET_SHADOW_STATS  60 /* parameter 8-bit flag (!=0 clears the counts), returns 32-bit number of register reads answered from the probe's shadow & 32-bit number which went to the target */
+#define CMD_MEM_CACHE_WINDOW  61 /* parameters 8-bit window number (0-3), 32-bit address & 32-bit length, memory inside the windows is cached in 64-byte pages while the target is halted, length 0 disables the window */
+#define CMD_STEP_N            62 /* parameters 32-bit step count, 32-bit range start & end (exclusive), 8-bit mode (see STEP_STOP_x) & 16-bit timeout in ms (0 = none), returns 8-bit reason (see STEP_x), 32-bit PC & 32-bit number of steps done; bulk only */
+#define CMD_BREAKPOINT        63 /* parameters 8-bit operation (see BREAK_x) & 32-bit address, returns 8-bit number of breakpoints; they are patched in by CMD_GO & taken out once the target stops; bulk only (or EP0 OUT without the count) */
+#define CMD_FILL_MEM          64 /* parameters 32-bit address, 32-bit byte count, 8-bit width (1, 2 or 4) & 32-bit pattern (the low width bytes are used), fills the memory without the data going over USB */
+#define CMD_SEARCH_MEM        65 /* parameters 32-bit address & 32-bit byte count, 8-bit step (1, 2 or 4), 8-bit max number of matches (up to 30), 8-bit pattern size (up to 16), the pattern & a mask of the same size (0 bits are don't care), returns 8-bit number of matches, 32-bit address to resume the search from & the 32-bit addresses found; bulk only */
+#define CMD_READ_MEMBLOCK_RLE 66 /* parameters 32-bit address & 32-bit byte count (multiples of 4), returns 16-bit number of bytes covered (a multiple of 4) & as much of the memory run length encoded (see rle.h) as fits the bytes requested; bulk only */
+#define CMD_WRITE_MEMBLOCK_DIFF 67 /* parameter 32bit address & a block of 32-bit values, only the dwords which differ from the target's are written, returns 8-bit number of dwords skipped; bulk only (or EP0 OUT without the count) */
+#define CMD_READ_MEMBLOCK     68 /* parameter 32bit address (any alignment), returns the block read with the widest accesses the alignment allows (8/16-bit head & tail, 32-bit body) */
+#define CMD_WRITE_MEMBLOCK    69 /* parameter 32bit address (any alignment) & the data, written with the widest accesses the alignment allows */
+#define CMD_TRACE_CONTROL     70 /* parameter 8-bit enable, empties the trace & switches the recording of the 17-bit messages on (!=0) or off */
+#define CMD_TRACE_DRAIN       71 /* no parameters, returns 8-bit count, 16-bit number of messages lost since the last drain & the oldest messages: 32-bit cycle counter (96MHz), 16-bit duration in cycles, 16-bit sent, 16-bit received & 8-bit flags (see TRACE_x) */
+
 /* JTAG commands */
 #define CMD_JTAG_GOTORESET    80 /* no parameters, takes the TAP to TEST-LOGIC-RESET state, re-select the JTAG target to take TAP back to RUN-TEST/IDLE */
 #define CMD_JTAG_GOTOSHIFT    81 /* parameters 8-bit path option; path option ==0 : go to SHIFT-DR, !=0 : go to SHIFT-IR (requires the tap to be in RUN-TEST/IDLE) */
@@ -0,0 +1,30 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+/*
+ * crc32.h
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ */
+#include <stdint.h>
+
+/* start with crc = 0 and feed the result of the previous call back in to continue a running CRC */
+extern uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t len);
+
+#endif // CRC32_H
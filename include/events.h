@@ -0,0 +1,47 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+/*
+ * events.h
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ */
+#include <stdint.h>
+
+#define EVENT_QUEUE_SIZE    16      /* must be a power of two */
+#define EVENT_SIZE          15      /* bytes of an event as sent to the host */
+
+typedef struct
+{
+    uint8_t type;                   /* EVENT_x, see commands.h */
+    uint16_t seq;
+    uint32_t time_us;
+    uint32_t arg[2];
+} event_t;
+
+/* events are queued from the main loop and taken by CMD_GET_EVENTS or, once the host has them, by the EP3 handler */
+extern void event_push(uint8_t type, uint32_t time_us, uint32_t arg0, uint32_t arg1);
+extern uint8_t event_pop(uint8_t *data);
+extern uint8_t event_peek(uint8_t n, uint8_t *data);
+extern uint8_t event_pending(void);
+extern uint32_t event_time_us(void);
+extern uint32_t event_cycles_to_us(uint32_t cycles);
+extern void events_poll(void);
+
+#endif // EVENTS_H
@@ -0,0 +1,45 @@
+#ifndef RLE_H
+#define RLE_H
+
+/*
+ * rle.h
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ */
+#include <stdint.h>
+
+/*
+ * compressed data is a sequence of records, each starting with a control byte c:
+ * c < 0x80: c + 1 literal bytes follow
+ * c >= 0x80: one byte follows, repeated c - 0x80 + RLE_RUN_MIN times
+ */
+#define RLE_RUN_MIN         3
+#define RLE_RUN_MAX         (0x7f + RLE_RUN_MIN)
+#define RLE_LITERAL_MAX     0x80
+
+/* encodes up to len bytes starting at buf[start & mask] (mask lets buf be a ring, 0xffffffff for a plain buffer) */
+/* into at most max bytes of out, stores the number of input bytes encoded into *consumed and returns the output size */
+extern uint32_t rle_encode(const uint8_t *buf, uint32_t mask, uint32_t start, uint32_t len,
+                           uint8_t *out, uint32_t max, uint32_t *consumed);
+
+/* decodes the whole records of the len bytes at in which fit into at most max bytes of out (the host side of */
+/* rle_encode()), stores the number of input bytes decoded into *consumed and returns the output size */
+extern uint32_t rle_decode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t max, uint32_t *consumed);
+
+#endif // RLE_H
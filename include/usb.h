@@ -37,6 +37,16 @@
  */
 void usb_init(void);
 
+/**
+ * Executes commands received on EP0 (vendor requests) and the bulk endpoint, called from the main loop
+ */
+void usb_command_process(void);
+
+/**
+ * Sends queued events on the interrupt endpoint, called from the main loop
+ */
+void usb_event_process(void);
+
 void usb_endp0_handler(uint8_t);
 void usb_endp1_handler(uint8_t);
 void usb_endp2_handler(uint8_t);
@@ -18,28 +18,67 @@
 */
 
 #include "bdmcf.h"
+#include "bdm.h"
 #include "commands.h"
 #include "cmd_processing.h"
+#include "wait.h"
+#include "events.h"
 
-#ifdef MULTIPLE_SPEEDS
-/* until more than one set of rx/tx functions is needed the speed of operation can be improved by not using the pointers */
+/* index of the selected Tx/Rx functions */
+uint8_t bdmcf_speed = BDMCF_SPEED_DEFAULT;
 
-/* pointers to Rx & Tx routines */
-uint8_t near (*bdmcf_rx8_ptr)(void) = bdmcf_rx8_1;
-void near (*bdmcf_tx8_ptr)(uint8_t) = bdmcf_tx8_1;
-uint8_t near (*bdmcf_txrx8_ptr)(uint8_t) = bdmcf_txrx8_1;
-uint8_t near (*bdmcf_txrx_start_ptr)(void) = bdmcf_txrx_start_1;
+/* pointers to Tx/Rx routines */
+uint32_t (*bdmcf_txrx17_ptr)(uint32_t) = bdmcf_txrx17_4;
+uint32_t (*bdmcf_txrx_bits_ptr)(uint32_t, uint8_t) = bdmcf_txrx_bits_gpio;
 
-/* tables with pointers to Tx & Rx functions */
-uint8_t (* const bdmcf_rx8_ptrs[])(void) = { bdmcf_rx8_1 };
-void (* const bdmcf_tx8_ptrs[])(uint8_t) = { bdmcf_tx8_1 };
-uint8_t (* const bdmcf_txrx8_ptrs[])(uint8_t) = { bdmcf_txrx8_1 };
-uint8_t (* const bdmcf_txrx_start_ptrs[])(void) = { bdmcf_txrx_start_1 };
-#endif
+/* tables with pointers to Tx/Rx functions and to the set-up of the pins they use */
+uint32_t (* const bdmcf_txrx17_ptrs[BDMCF_SPEEDS])(uint32_t) =
+{
+    bdmcf_txrx17_0, bdmcf_txrx17_1, bdmcf_txrx17_2, bdmcf_txrx17_3,
+    bdmcf_txrx17_4, bdmcf_txrx17_5, bdmcf_txrx17_6,
+    bdmcf_txrx17_spi, bdmcf_txrx17_spi, bdmcf_txrx17_spi, bdmcf_txrx17_spi, bdmcf_txrx17_spi, bdmcf_txrx17_spi
+};
+uint32_t (* const bdmcf_txrx_bits_ptrs[BDMCF_SPEEDS])(uint32_t, uint8_t) =
+{
+    bdmcf_txrx_bits_gpio, bdmcf_txrx_bits_gpio, bdmcf_txrx_bits_gpio, bdmcf_txrx_bits_gpio,
+    bdmcf_txrx_bits_gpio, bdmcf_txrx_bits_gpio, bdmcf_txrx_bits_gpio,
+    bdmcf_txrx_bits_spi, bdmcf_txrx_bits_spi, bdmcf_txrx_bits_spi, bdmcf_txrx_bits_spi, bdmcf_txrx_bits_spi,
+    bdmcf_txrx_bits_spi
+};
+void (* const bdmcf_init_ptrs[BDMCF_SPEEDS])(void) =
+{
+    bdmcf_init_gpio, bdmcf_init_gpio, bdmcf_init_gpio, bdmcf_init_gpio,
+    bdmcf_init_gpio, bdmcf_init_gpio, bdmcf_init_gpio,
+    bdmcf_init_spi, bdmcf_init_spi, bdmcf_init_spi, bdmcf_init_spi, bdmcf_init_spi, bdmcf_init_spi
+};
+
+/* selects the set of Tx/Rx functions and routes the BDM signals to the pins they use */
+/* the SPI0 speeds need the target wired to PTC5 (DSCLK), PTC6 (DSI) and PTC7 (DSO) instead of the GPIO */
+/* pins; PTC5 also drives the LED of the Teensy, its load on DSCLK may keep the target from the fastest rates */
+/* returns 0 on success and non-zero if there is no such set */
+uint8_t bdmcf_select_speed(uint8_t speed)
+{
+    if (speed >= BDMCF_SPEEDS)
+    {
+        return 1;
+    }
+    bdmcf_speed = speed;
+    bdmcf_init_ptrs[speed]();
+    bdmcf_txrx17_ptr = bdmcf_trace_on ? bdmcf_txrx17_trace : bdmcf_txrx17_ptrs[speed];
+    bdmcf_txrx_bits_ptr = bdmcf_txrx_bits_ptrs[speed];
+
+    return 0;
+}
+
+uint8_t bdmcf_running;                  /* target started by bdmcf_go() or bdmcf_reset(), watched by bdmcf_halt_poll() */
+uint8_t bdmcf_target_halted;            /* target known to be in BDM mode: halted, reset into BDM mode or seen stopped */
+static uint32_t bdmcf_halt_poll_cycles; /* cycle counter at the last CSR poll */
 
 /* halts the target CPU (stops execution of the code and brings the part into BDM mode) */
 void bdmcf_halt(void)
 {
+    uint8_t csr[4];
+
 #ifdef INVERT
     BKPT_OUT = 1;       /* assert BKPT */
 #else
@@ -53,14 +92,24 @@ void bdmcf_halt(void)
     BKPT_OUT=1;
 #endif
 
+    bdmcf_shadow_invalidate();
+    bdmcf_cache_invalidate();
     bdmcf_complete_chk_rx();    /* added in revision 0.3 */
                                 /* it is a workaround for a strange problem: CF CPU V2 seems to ignore the first transfer after a halt */
                                 /* I do not admit I know why it happens, but the extra NOP command fixes the problem... */
                                 /* the problem has nothing to do with the delay: adding up to 400ms of delay between the halt and the read did not fix it */
+    if (bdmcf_running)
+    {
+        bdmcf_read_dmreg(0, csr);   /* reports the halt with the CSR status bits (bdmcf_halted()) */
+        bdmcf_running = 0;
+    }
+    bdmcf_target_halted = 1;
+    bdmcf_break_remove();
 }
 
 /* resets the target CPU either into BDM mode (parameter bkpt=0) or into notmal mode (parameter bkpt!=0) */
 /* length of the reset pulse is 50ms, if BKPT is to be asserted it is held active for 50ms after reset is released */
+/* a target reset into normal mode is watched by bdmcf_halt_poll() like one started by bdmcf_go() */
 void bdmcf_reset(uint8_t bkpt)
 {
     RSTI_OUT = 0;               /* reset is active low */
@@ -85,7 +134,16 @@ void bdmcf_reset(uint8_t bkpt)
 #endif
 
     cable_status.reset = NO_RESET_ACTIVITY;     /* clear the reset flag */
+    bdmcf_shadow_invalidate();
+    bdmcf_cache_invalidate();
     bdmcf_complete_chk_rx();                    /* added in revision 0.3 */
+    bdmcf_target_halted = (bkpt == 0);
+    bdmcf_running = (bkpt != 0);
+    bdmcf_halt_poll_cycles = CYCCNT();
+    if (bkpt == 0)
+    {
+        bdmcf_break_remove();                   /* RAM may have kept the HALTs */
+    }
 }
 
 /* asserts the TA signal for the specified duration */
@@ -99,15 +157,183 @@ void bdmcf_ta(uint8_t time_10us)
     TA_OUT = 0;
 }
 
+/* starts code execution from the current PC, or executes a single instruction if step is non-zero */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_go(uint8_t step)
+{
+    uint8_t csr[6];
+    uint32_t value;
+
+    if (!step && bdmcf_break_count())
+    {
+        if (bdmcf_read_creg(BDMCF_CREG_PC, csr))
+        {
+            return 1;
+        }
+        if (bdmcf_break_at(get_be32(csr)))
+        {
+            if (bdmcf_go(1) || bdmcf_read_creg(BDMCF_CREG_PC, csr))
+            {
+                return 1;               /* step off the breakpoint first, the PC read waits for the step */
+            }
+        }
+        if (bdmcf_break_insert())
+        {
+            return 1;
+        }
+    }
+    if (bdmcf_read_csr(&value))         /* get CSR, no BDM traffic if it is in the shadow */
+    {
+        bdmcf_break_remove();           /* the target has not been started, do not leave the HALTs in memory */
+        return 1;
+    }
+    if (step)
+    {
+        value |= 0x10;                  /* set the SSM bit - Single Step Mode */
+    }
+    else
+    {
+        value &= ~0x10;                 /* clear the SSM bit */
+    }
+    bdmcf_shadow_invalidate();          /* the target changes the registers */
+    bdmcf_cache_invalidate();           /* and memory */
+    if (step)
+    {
+        bdmcf_shadow_csr(value);        /* but single steps leave the CSR alone */
+    }
+    else
+    {
+        bdmcf_target_halted = 0;
+    }
+    csr[0] = BDMCF_CMD_WDMREG >> 8;
+    csr[1] = BDMCF_CMD_WDMREG & 0xff;
+    put_be32(csr + 2, value);
+    bdmcf_tx(3, csr);                   /* write the CSR back */
+    if (bdmcf_complete_chk(BDMCF_CMD_GO))
+    {
+        bdmcf_break_remove();
+        return 1;                       /* GO */
+    }
+#ifdef CMD_COMPLETE_CHECK
+    if (bdmcf_complete_chk_rx())
+    {
+        bdmcf_break_remove();
+        return 1;
+    }
+#endif
+    bdmcf_running = !step;
+    bdmcf_halt_poll_cycles = CYCCNT();
+    return 0;
+}
+
+/* single steps the target until count steps are done, the PC leaves (mode STEP_STOP_OUTSIDE) or enters */
+/* (STEP_STOP_INSIDE) the range start..end-1 or timeout_ms have passed (0 = no timeout) */
+/* stores the PC & the number of steps done, returns the STEP_x reason it stopped or STEP_ERROR */
+uint8_t bdmcf_step_n(uint32_t count, uint32_t start, uint32_t end, uint8_t mode, uint16_t timeout_ms,
+                     uint32_t *pc, uint32_t *steps)
+{
+    uint32_t begin = event_time_us();  /* also keeps the time base going during long runs */
+    uint8_t data[4];
+    uint8_t inside;
+
+    *steps = 0;
+    *pc = 0;
+    while (*steps < count)
+    {
+        if (bdmcf_go(1) || bdmcf_read_creg(BDMCF_CREG_PC, data))
+        {
+            return STEP_ERROR;          /* the PC read waits for the step to finish */
+        }
+        (*steps)++;
+        *pc = get_be32(data);
+
+        inside = (*pc - start) < (end - start);
+        if (((mode == STEP_STOP_OUTSIDE) && !inside) || ((mode == STEP_STOP_INSIDE) && inside))
+        {
+            return STEP_RANGE;
+        }
+        if (timeout_ms && ((event_time_us() - begin) >= (uint32_t) timeout_ms * 1000))
+        {
+            return STEP_TIMEOUT;
+        }
+    }
+    return STEP_COUNT;
+}
+
+/* watches the target started by bdmcf_go() and queues an EVENT_HALT (PC, CSR) once it has stopped */
+/* the CSR status bits (31-28) tell why and clear when read, the event is the only place they show up */
+/* to be called from the main loop */
+void bdmcf_halt_poll(void)
+{
+    uint8_t data[4];
+    uint32_t csr;
+
+    if (!bdmcf_running || bdmcf_stream_active() || (cable_status.target_type != CF_BDM))
+    {
+        return;                         /* a stream owns the BDM between the commands */
+    }
+    if (CYCCNT() - bdmcf_halt_poll_cycles < BDMCF_HALT_POLL_US * (core_clk_khz / 1000))
+    {
+        return;
+    }
+    bdmcf_halt_poll_cycles = CYCCNT();
+
+    bdmcf_tx_msg(BDMCF_CMD_RDMREG);     /* get CSR, can be read while the target is running */
+    if (bdmcf_rx(2, data))
+    {
+        bdmcf_complete_chk_rx();        /* send at least 2 nops to purge the BDM */
+        bdmcf_complete_chk_rx();
+        return;
+    }
+    csr = get_be32(data);
+    if ((csr & ~BDMCF_CSR_STATIC_MASK) == 0)
+    {
+        return;                         /* still running */
+    }
+    bdmcf_halted(csr);
+}
+
+/* the target started by bdmcf_go() has been found stopped, csr is the CSR read with its status bits set */
+/* takes the breakpoints out and queues an EVENT_HALT (PC, CSR); every CSR read made while bdmcf_running is */
+/* set has to end up here as the status bits clear when read, the halt would not be seen again */
+void bdmcf_halted(uint32_t csr)
+{
+    uint8_t data[4];
+
+    bdmcf_running = 0;
+    bdmcf_target_halted = 1;
+    bdmcf_break_remove();
+
+    bdmcf_tx_msg(BDMCF_CMD_RCREG);      /* read the PC it stopped at */
+    bdmcf_tx_msg(0);
+    bdmcf_tx_msg(BDMCF_CREG_PC);
+    if (bdmcf_rx(2, data))
+    {
+        bdmcf_complete_chk_rx();
+        bdmcf_complete_chk_rx();
+        put_be32(data, 0xffffffff);     /* report the halt anyway */
+    }
+    event_push(EVENT_HALT, event_time_us(), get_be32(data), csr);
+}
+
+uint8_t bdmcf_bus_error;        /* set when the target answered a command with a bus error */
+
+/* RSTO edges, the ring is written by PORTD_IRQHandler() and read by rsto_poll() only, no locking needed */
+#define RSTO_RING_SIZE      8           /* must be a power of two */
+
+static volatile uint32_t rsto_ring[RSTO_RING_SIZE];    /* cycle counter at the edge */
+static volatile uint32_t rsto_head;     /* next edge to be recorded */
+static volatile uint32_t rsto_tail;     /* next edge to be taken */
+static volatile uint32_t rsto_lost;     /* edges which did not fit into the ring */
+
 /* transmits series of 17 bit messages, contents of messages is pointed to by *data */
 /* first byte in the buffer is the MSB of the first message */
 void bdmcf_tx(uint8_t count, uint8_t *data)
 {
-    while(count--)
+    while (count--)
     {
-        bdmcf_txrx_start_ptr();
-        bdmcf_tx8_ptr(*(data++));
-        bdmcf_tx8_ptr(*(data++));
+        bdmcf_txrx17_ptr((*(data + 0) << 8) | *(data + 1));
+        data += 2;
     }
 }
 
@@ -117,14 +343,12 @@ void bdmcf_tx(uint8_t count, uint8_t *data)
 uint8_t bdmcf_complete_chk(unsigned int next_cmd)
 {
     uint8_t i = BDMCF_RETRY;
-    uint8_t status;
+    uint32_t mess;
 
     do
     {
-        status = bdmcf_txrx_start_ptr();
-        bdmcf_tx8_ptr(next_cmd >> 8);     /* send in the next command */
-        bdmcf_tx8_ptr(next_cmd & 0xff);
-        if (status == 0)
+        mess = bdmcf_txrx17_ptr(next_cmd);     /* send in the next command */
+        if (BDMCF_STATUS(mess) == 0)
         {
             return 0;
         }
@@ -139,21 +363,19 @@ uint8_t bdmcf_complete_chk(unsigned int next_cmd)
 uint8_t bdmcf_complete_chk_rx(void)
 {
     uint8_t i = BDMCF_RETRY;
-    uint8_t status;
-    uint8_t data;
+    uint32_t mess;
 
     do
     {
-        status = bdmcf_txrx_start_ptr();
-        bdmcf_tx8_ptr(0);
-        data = bdmcf_rx8_ptr();
+        mess = bdmcf_txrx17_ptr(BDMCF_CMD_NOP);
 
-        if (status == 0)
+        if (BDMCF_STATUS(mess) == 0)
         {
             return 0;
         }
-    } while ((data == 0x00) && ((i--) > 0));
+    } while (((mess & 0xff) == 0x00) && ((i--) > 0));
 
+    bdmcf_bus_error |= BDMCF_BUS_ERROR(mess);
     return 1;
 }
 
@@ -161,20 +383,22 @@ uint8_t bdmcf_complete_chk_rx(void)
 /* returns zero on success and non-zero on retry error */
 uint8_t bdmcf_rx(uint8_t count, uint8_t *data)
 {
-    uint8_t i, status;
+    uint8_t i;
+    uint32_t mess;
 
     while (count)
     {
         i = BDMCF_RETRY;
         do
         {
-            status = bdmcf_txrx_start_ptr();
-            *(data + 0) = bdmcf_rx8_ptr();
-            *(data + 1) = bdmcf_rx8_ptr();
-        } while ((status != 0) && ((*(data + 1)) == 0x00) && ((i--) > 0));  /* repeat while status==1 & data+1 == 00 (not ready, come again) */
+            mess = bdmcf_txrx17_ptr(BDMCF_CMD_NOP);
+        } while (BDMCF_STATUS(mess) && ((mess & 0xff) == 0x00) && ((i--) > 0));  /* repeat while status==1 & LSB == 00 (not ready, come again) */
 
-        if (status != 0)
+        *(data + 0) = mess >> 8;
+        *(data + 1) = mess;
+        if (BDMCF_STATUS(mess))
         {
+            bdmcf_bus_error |= BDMCF_BUS_ERROR(mess);
             return 1;
         }
         count--;
@@ -188,37 +412,67 @@ uint8_t bdmcf_rx(uint8_t count, uint8_t *data)
 /* transmits the next command while receiving the last message */
 uint8_t bdmcf_rxtx(uint8_t count, uint8_t *data, unsigned int next_cmd)
 {
-    uint8_t i, status;
+    uint8_t i;
+    uint32_t mess;
+    unsigned int cmd;
 
     while (count)
     {
         i = BDMCF_RETRY;
         count--;
+        cmd = count ? BDMCF_CMD_NOP : next_cmd;     /* last message - send the next command */
 
-        if (count)
+        do
         {
-            do
-            {
-                status = bdmcf_txrx_start_ptr();
-                *(data + 0) = bdmcf_rx8_ptr();
-                *(data + 1) = bdmcf_rx8_ptr();
-            } while ((status != 0) && ((*(data + 1)) == 0x00) && ((i--) > 0));
+            mess = bdmcf_txrx17_ptr(cmd);
+        } while (BDMCF_STATUS(mess) && ((mess & 0xff) == 0x00) && ((i--) > 0));
+
+        *(data + 0) = mess >> 8;
+        *(data + 1) = mess;
+        if (BDMCF_STATUS(mess))
+        {
+            bdmcf_bus_error |= BDMCF_BUS_ERROR(mess);
+            return 1;
         }
-        else
+        data += 2;
+    }
+    return 0;
+}
+
+/* transmits count elements of size bytes (1, 2 or 4) from the buffer, each preceded by fill_cmd */
+/* the counterpart of bdmcf_rxtx() for writes: the status of the FILL command message acknowledges */
+/* the previous write, so the command is only repeated when the target actually answers not ready */
+/* returns zero on success and non-zero on error (bus error, illegal command or retries exhausted) */
+uint8_t bdmcf_fill(uint8_t count, uint8_t size, uint8_t *data, unsigned int fill_cmd)
+{
+    uint8_t i;
+    uint32_t mess;
+
+    while (count--)
+    {
+        i = BDMCF_RETRY;
+        while (BDMCF_STATUS(mess = bdmcf_txrx17_ptr(fill_cmd)))
         {
-            do
-            {                                        /* last message - send the next command */
-                status = bdmcf_txrx_start_ptr();
-                *(data + 0) = bdmcf_txrx8_ptr(next_cmd >> 8);
-                *(data + 1) = bdmcf_txrx8_ptr(next_cmd & 0xff);
-            } while ((status != 0) && ((*(data + 1)) == 0x00) && ((i--) > 0));
+            if (((mess & 0xffff) != 0x0000) || ((i--) == 0))
+            {
+                bdmcf_bus_error |= BDMCF_BUS_ERROR(mess);
+                return 1;
+            }
         }
 
-        if (status != 0)
+        if (size == 1)
         {
-            return 1;
+            bdmcf_txrx17_ptr(*data);
         }
-        data += 2;
+        else
+        {
+            bdmcf_txrx17_ptr((*(data + 0) << 8) | *(data + 1));
+            if (size == 4)
+            {
+                bdmcf_txrx17_ptr((*(data + 2) << 8) | *(data + 3));
+            }
+        }
+        data += size;
     }
     return 0;
 }
@@ -226,13 +480,7 @@ uint8_t bdmcf_rxtx(uint8_t count, uint8_t *data, unsigned int next_cmd)
 /* transmits a 17 bit message, returns the status bit */
 uint8_t bdmcf_tx_msg(unsigned int data)
 {
-    uint8_t status;
-
-    status = bdmcf_txrx_start_ptr();
-    bdmcf_tx8_ptr(data >> 8);
-    bdmcf_tx8_ptr(data & 0xff);
-
-    return status;
+    return BDMCF_STATUS(bdmcf_txrx17_ptr(data));
 }
 
 /* transmits a 17 bit message, returns the least significant byte of the response */
@@ -241,36 +489,31 @@ uint8_t bdmcf_tx_msg(unsigned int data)
 /* the correct response in these cases is Not Ready */
 uint8_t bdmcf_tx_msg_half_rx(unsigned int data)
 {
-    uint8_t ret_val;
-
-    bdmcf_txrx_start_ptr();
-    bdmcf_tx8_ptr(data >> 8);
-    ret_val = bdmcf_txrx8_ptr(data & 0xff);
-
-    return ret_val;
+    return bdmcf_txrx17_ptr(data) & 0xff;
 }
 
 /* receives a 17 bit message, returns the status bit, data is stored into the supplied data buffer MSB first */
 uint8_t bdmcf_rx_msg(uint8_t *data)
 {
-    uint8_t status;
+    uint32_t mess;
 
-    status = bdmcf_txrx_start_ptr();
-    *data = bdmcf_rx8_ptr();
-    *(data + 1) = bdmcf_rx8_ptr();
+    mess = bdmcf_txrx17_ptr(BDMCF_CMD_NOP);
+    *data = mess >> 8;
+    *(data + 1) = mess;
 
-    return status;
+    return BDMCF_STATUS(mess);
 }
 
 /* transmits & receives a 17 bit message, data in the buffer is transmited and then replaced with received data, returns the status bit */
 uint8_t bdmcf_txrx_msg(uint8_t *data)
 {
-    uint8_t status;
+    uint32_t mess;
 
-    status = bdmcf_txrx_start_ptr();
-    *data = bdmcf_txrx8_ptr(*data);
-    *(data + 1) = bdmcf_txrx8_ptr(*(data + 1));
-  return(status);
+    mess = bdmcf_txrx17_ptr((*data << 8) | *(data + 1));
+    *data = mess >> 8;
+    *(data + 1) = mess;
+
+    return BDMCF_STATUS(mess);
 }
 
 /* resynchronizes communication with the target in case of noise of the CLK line, etc. */
@@ -278,21 +521,21 @@ uint8_t bdmcf_txrx_msg(uint8_t *data)
 uint8_t bdmcf_resync(void)
 {
     uint8_t i;
-    unsigned int data = BDMCF_CMD_NOP;
+    uint32_t mess;
 
     bdmcf_tx_msg(BDMCF_CMD_NOP);    /* send in 3 NOPs to clear any error */
     bdmcf_tx_msg(BDMCF_CMD_NOP);
-    bdmcf_txrx_msg(&data);
+    mess = bdmcf_txrx17_ptr(BDMCF_CMD_NOP);
 
-    if ((data & 3) == 0)
+    if ((mess & 3) == 0)
     {
         return 1;     /* the last NOP did not return the expected value (at least one of the two bits should be 1) */
     }
 
-    for (i = 18; i > 0; i++)
+    for (i = 18; i > 0; i--)
     {
         /* now start sending in another nop and watch the result */
-        if (bdmcf_txrx_start_ptr() == 0)
+        if (bdmcf_txrx_bits_ptr(0, 1) == 0)
         {
             break;   /* the first 0 is the status */
         }
@@ -302,15 +545,125 @@ uint8_t bdmcf_resync(void)
         return 1;
     }
     /* transmitted & received the status, finish the nop */
-    bdmcf_tx8_ptr(0x00);
-    bdmcf_tx8_ptr(0x00);
+    bdmcf_txrx_bits_ptr(BDMCF_CMD_NOP, 16);
 
     return 0;
 }
 
+/* checks communication at the selected speed: after a resync CSR is read BDMCF_NEGOTIATE_ROUNDS times */
+/* every read must return the same value and the NOP following it must be answered with "command complete" */
+/* returns 0 on success, non-zero on the first mismatch */
+static uint8_t bdmcf_speed_check(void)
+{
+    uint8_t i;
+    uint8_t csr[4];
+    uint32_t ref = 0;
+
+    if (bdmcf_resync())
+    {
+        return 1;
+    }
+
+    for (i = 0; i < BDMCF_NEGOTIATE_ROUNDS; i++)
+    {
+        bdmcf_tx_msg(BDMCF_CMD_RDMREG);                     /* CSR is debug module register 0 */
+        if (bdmcf_rx(2, csr))
+        {
+            return 1;
+        }
+        if (bdmcf_txrx17_ptr(BDMCF_CMD_NOP) != 0x0ffff)    /* the NOP sent by bdmcf_rx() has completed */
+        {
+            return 1;
+        }
+        if (bdmcf_running && (get_be32(csr) & ~BDMCF_CSR_STATIC_MASK))
+        {
+            bdmcf_halted(get_be32(csr));                    /* the status bits are gone now */
+        }
+        if (i == 0)
+        {
+            ref = get_be32(csr);
+        }
+        else if (((get_be32(csr) ^ ref) & BDMCF_CSR_STATIC_MASK) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* selects the fastest speed of the current transport (bit-banged or SPI0, they use different pins) the target */
+/* answers reliably at, less BDMCF_NEGOTIATE_MARGIN speeds */
+/* the search starts at the current speed and goes up until a speed fails; it only steps down if the first speed */
+/* fails, the slow speeds take long to probe */
+/* *probes returns the number of speeds tried */
+/* returns 0 on success, non-zero (and the default speed of the transport selected) if the target did not answer */
+/* at any speed */
+uint8_t bdmcf_negotiate_speed(uint8_t *probes)
+{
+    uint8_t first = (bdmcf_speed < BDMCF_SPEED_GPIO) ? 0 : BDMCF_SPEED_SPI;
+    uint8_t end = first ? BDMCF_SPEEDS : BDMCF_SPEED_GPIO;
+    uint8_t start = bdmcf_speed;
+    uint8_t speed;
+    uint8_t best = BDMCF_SPEEDS;
+
+    *probes = 0;
+    for (speed = start; speed < end; speed++)
+    {
+        bdmcf_select_speed(speed);
+        (*probes)++;
+        if (bdmcf_speed_check())
+        {
+            break;
+        }
+        best = speed;
+    }
+
+    for (speed = start; (best == BDMCF_SPEEDS) && (speed > first); )
+    {
+        bdmcf_select_speed(--speed);
+        (*probes)++;
+        if (bdmcf_speed_check() == 0)
+        {
+            best = speed;
+        }
+    }
+
+    if (best == BDMCF_SPEEDS)
+    {
+        bdmcf_select_speed(first ? BDMCF_SPEED_SPI : BDMCF_SPEED_DEFAULT);
+        return 1;
+    }
+
+    if (best >= first + BDMCF_NEGOTIATE_MARGIN)
+    {
+        best -= BDMCF_NEGOTIATE_MARGIN;
+    }
+    else
+    {
+        best = first;
+    }
+    bdmcf_select_speed(best);
+
+    return bdmcf_resync();
+}
+
 /* initialises the BDM interface */
 void bdmcf_init(void)
 {
+    bdmcf_target_halted = 0;            /* whatever the target is doing, it is not known yet */
+
+    PORTD_PCR0 = PORT_PCR_MUX(0x1);     /* BKPT */
+    BKPT_HI();                          /* preload the idle state before the pin becomes output */
+    GPIOD_PDDR |= (1 << 0);
+
+    PORTD_PCR2 = PORT_PCR_MUX(0x1);     /* TA */
+    PORTD_PCR4 = PORT_PCR_MUX(0x1);     /* RSTI */
+    TA_OUT = 0;                         /* both are open drain: driven low while output, released as input */
+    RSTI_OUT = 0;
+    GPIOD_PDDR &= ~((1 << 2) | (1 << 4));
+
+    bdmcf_select_speed(bdmcf_speed);
+
 #ifdef NOT_USED
     PTA  = BDMCF_IDLE;    /* preload idle state into port A data register */
 #ifdef DEBUG
@@ -321,563 +674,160 @@ void bdmcf_init(void)
     PTC  = 0;
     DDRC = DDRC_DDRC1;    /* make pin PTC1 output (it is not bonded out on the 20 pin package anyway) */
     POCR = POCR_PTE20P;   /* enable pull-ups on PTE0-2 (unused pins) */
+#endif
 
     /* RSTO edge capture */
-    T1SC = 0;             /* enable timer 1 */
-    T1SC0;                /* read the status and control register */
-
+    GPIOD_PDDR &= ~(1 << 3);
 #ifdef INVERT
-    T1SC0 = T1SC0_ELS0A_MASK;   /* capture rising edge (invert), this write will also clear the interrupt flag if set */
+    PORTD_PCR3 = PORT_PCR_MUX(0x1) | PORT_PCR_ISF_MASK | PORT_PCR_IRQC(0x9);   /* interrupt on the rising edge (invert), clears the flag if set */
 #else
-    T1SC0 = T1SC0_ELS0B_MASK;   /* capture falling edge (non-invert), this write will also clear the interrupt flag if set */
-#endif
-    T1SC0 |= T1SC0_CH0IE_MASK;    /* enable input capture interrupt */
+    PORTD_PCR3 = PORT_PCR_MUX(0x1) | PORT_PCR_ISF_MASK | PORT_PCR_IRQC(0xA);   /* interrupt on the falling edge (non-invert), clears the flag if set */
 #endif
+    rsto_tail = rsto_head;              /* forget edges from before */
+    bdmcf_shadow_invalidate();
+    bdmcf_cache_invalidate();
+    enable_irq(IRQ(INT_PORTD));
+
     cable_status.reset = NO_RESET_ACTIVITY;  /* clear the reset flag */
 }
 
 /* this interrupt is called whenever an active edge is detected on the RSTO input */
-void rsto_detect(void)
+/* it only records the time of the edge, rsto_poll() does the rest */
+void PORTD_IRQHandler(void)
 {
-#ifdef NOT_USED
-    T1SC0 &= ~T1SC0_CH0F_MASK;          /* clear the interrupt flag */
-#endif
-    cable_status.reset = RESET_DETECTED;  /* reset of the target was detected, leave it for the debugger to what it believes is appropriate */
+    uint32_t head = rsto_head;
+
+    PORTD_ISFR = (1 << 3);              /* clear the interrupt flag */
+    if (head - rsto_tail < RSTO_RING_SIZE)
+    {
+        rsto_ring[head & (RSTO_RING_SIZE - 1)] = CYCCNT();
+        rsto_head = head + 1;
+    }
+    else
+    {
+        rsto_lost++;
+    }
 }
 
-/* transmits 8 bits */
-void bdmcf_tx8_1(uint8_t data)
+/* takes the RSTO edges recorded by the interrupt, flags the reset for CMD_GET_STATUS and queues an EVENT_RESET */
+/* for each of them, to be called from the main loop and before the cable status is read */
+void rsto_poll(void)
 {
-#ifdef NOT_USED
-    asm {
-        tax           /* move the input data to X */
-#ifdef INVERT
-        comx        /* invert the data */
-#endif
-#ifdef DEBUG
-        lda   #(BDMCF_IDLE * 2)
-#else
-        lda   #(BDMCF_IDLE/2)
-#endif
-        /* transmit bit 7 */
-        lslx    		  /* shift MSB into C */
-#ifdef DEBUG
-        rora        /* rotate C into A */
-#else
-        rola
-#endif
-        sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-#ifdef DEBUG
-        lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-#else
-        lda   #(BDMCF_IDLE/2)
-#endif
-#ifdef INVERT
-        bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-#else
-        bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-#endif
-        /* transmit bit 6 */
-        lslx    		  /* shift MSB into C */
-#ifdef DEBUG
-        rora        /* rotate C into A */
-#else
-        rola
-#endif
-        sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-#ifdef DEBUG
-        lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-#else
-        lda   #(BDMCF_IDLE/2)
-#endif
-#ifdef INVERT
-        bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-#else
-        bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-#endif
-        /* transmit bit 5 */
-        lslx    		  /* shift MSB into C */
-#ifdef DEBUG
-        rora        /* rotate C into A */
-#else
-        rola
-#endif
-        sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-#ifdef DEBUG
-        lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-#else
-        lda   #(BDMCF_IDLE/2)
-#endif
-#ifdef INVERT
-        bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-#else
-        bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-#endif
-        /* transmit bit 4 */
-        lslx    		  /* shift MSB into C */
-#ifdef DEBUG
-        rora        /* rotate C into A */
-#else
-        rola
-#endif
-        sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-#ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-#else
-      lda   #(BDMCF_IDLE/2)
-#endif
-#ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-#else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-#endif
-    /* transmit bit 3 */
-    lslx    		  /* shift MSB into C */
-#ifdef DEBUG
-      rora        /* rotate C into A */
-#else
-            rola
-#endif
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-#ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-#else
-      lda   #(BDMCF_IDLE/2)
-#endif
-#ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-#else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-#endif
-    /* transmit bit 2 */
-    lslx    		  /* shift MSB into C */
-#ifdef DEBUG
-      rora        /* rotate C into A */
-#else
-            rola
-#endif
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-#ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-#else
-      lda   #(BDMCF_IDLE/2)
-#endif
-#ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-#else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-#endif
-     /* transmit bit 1 */
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    /* transmit bit 0 */
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-        /* finish the transmission */
-    #ifdef INVERT
-      sec           /* bring the DSI_OUT low, we need to spend 2 cycles doing something anyway to make the timing right */
-    #else
-      clc
-    #endif
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    sta     PTA   /* create falling edge on DSCLK */
-  }
-#endif
-}
+    uint32_t tail = rsto_tail;
+    uint32_t cycles;
 
-/* receives 8 bits */
-uint8_t bdmcf_rx8_1(void) {
-#ifdef NOT_USED
-  asm {
-    lda     #BDMCF_IDLE /* preload idle state of signals into A */
-    sta     PTA         /* bring DSCLK and DSI low */
-    clrh                /* load address of PTC to H:X */
-    ldx     @DSO_IN_PORT
-    /* receive bit 7 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    /* receive bit 6 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    /* receive bit 5 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    /* receive bit 4 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    /* receive bit 3 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    /* receive bit 2 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    /* receive bit 1 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    /* receive bit 0 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     ,X    /* shift the input data bit (PTC0) into C */
-    rola          /* shift the sampled bit into A from the bottom */
-    #ifdef INVERT
-      coma        /* invert the data */
-    #endif
-  }
-#endif
+    while (tail != rsto_head)
+    {
+        cycles = rsto_ring[tail & (RSTO_RING_SIZE - 1)];
+        rsto_tail = ++tail;
+        cable_status.reset = RESET_DETECTED;  /* reset of the target was detected, leave it for the debugger to what it believes is appropriate */
+        bdmcf_shadow_invalidate();
+        bdmcf_cache_invalidate();
+        event_push(EVENT_RESET, event_cycles_to_us(cycles), cycles, rsto_lost);
+    }
 }
 
-/* transmits and receives 8 bits */
-uint8_t bdmcf_txrx8_1(uint8_t data)
+/*
+ * Cortex-M4 BDM shift engine
+ *
+ * the pins are driven through the GPIO set/clear registers (see bdm.h): DSCLK on PTA12, the data going into
+ * the target on PTD7 (DSO_xx()) and the data coming from the target on PTA13 (DSI()).
+ * Each bit is set up while DSCLK is low, latched by the target with the rising edge of DSCLK and the
+ * target's answer is sampled right after the falling edge - the same sequence the HCS08 code used.
+ */
+
+/* busy waits for the given number of loop passes, each pass takes 3 core cycles (subs + taken bne) */
+static inline __attribute__((always_inline)) void bdmcf_delay(uint32_t loops)
 {
-#ifdef NOT_USED
-  asm {
-    tax           /* move the input data to X */
-    #ifdef INVERT
-      comx        /* invert the data */
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    sta     PTA   /* bring DSCLK low and write the first (MSB) bit value to the port */
-     /* transmit and receive bit 7 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmit and receive bit 6 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmit and receive bit 5 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmit and receive bit 4 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmit and receive bit 3 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmit and receive bit 2 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmit and receive bit 1 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmit and receive bit 0 */
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    #ifdef DEBUG
-      lda   #(BDMCF_IDLE*2)  /* reload idle value into A */
-    #else
-      lda   #(BDMCF_IDLE/2)
-    #endif
-    lslx    		  /* shift MSB into C */
-    #ifdef DEBUG
-      rora        /* rotate C into A */
-    #else
-            rola
-    #endif
-    lsrx          /* shift X back to what it was */
-    sta     PTA   /* create falling edge on DSCLK and write the next bit value to the port */
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-        rolx          /* shift the sample into X from the bottom */
-     /* transmission and reception is now complete, the result is in X */
-    txa           /* move the result data to A */
-    #ifdef INVERT
-      coma        /* invert the data */
-    #endif
-  }
+    if (loops)
+    {
+#ifdef HOST_BUILD
+        sim_delay(loops);               /* the simulation counts the cycles instead (make host) */
+#else
+        __asm__ __volatile__(
+            "1:     subs    %0, %0, #1          \n\t"
+            "       bne     1b                  \n\t"
+            : "+r" (loops)
+            :
+            : "cc");
 #endif
+    }
 }
 
-/*
- * transmits 1 bit of logic low value and receives 1 bit
- */
-uint8_t bdmcf_txrx_start_1(void)
+/* shifts the lower 'bits' bits of mess out (MSB first) and returns the bits shifted in at the same time */
+/* loops is the number of delay loop passes in each half period of DSCLK */
+static inline __attribute__((always_inline)) uint32_t bdmcf_shift(uint32_t mess, uint32_t bits, uint32_t loops)
 {
-    uint8_t res = 0;
+    uint32_t res = 0;
+    uint32_t mask = 1 << (bits - 1);
 
-    DSO_IN = 0;     /* bring DSI low */
-    DSCLK_OUT = 0;  /* bring DSCLK low */
-    DSCLK_OUT = 1;  /* create rising edge on DSCLK */
-    DSCLK_OUT = 0;  /* create falling edge on DSCLK */
-    res = DSI_OUT;
+    do
+    {
+        if (mess & mask)            /* present the next bit to the target */
+            DSO_HI();
+        else
+            DSO_LO();
+        bdmcf_delay(loops);
+        DSCLK_HI();                 /* create rising edge on DSCLK, the target latches the bit */
+        bdmcf_delay(loops);
+        DSCLK_LO();                 /* create falling edge on DSCLK */
+        res <<= 1;
+        if (DSI())                  /* sample the bit the target has presented */
+            res |= 1;
+        mask >>= 1;
+    } while (mask);
+
+    DSO_LO();                       /* leave the data line idle */
 
     return res;
+}
 
-#ifdef NOT_USED
-  asm {
-    lda     #BDMCF_IDLE   /* preload idle state of signals into A */
-     /* transmit zero and receive 1 bit */
-    sta     PTA   /* bring DSCLK and DSI low */
-        nop           /* make the time between the assignement and the rising edge the same as during normal transmission */
-    nop
-    #ifdef INVERT
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create rising edge on DSCLK */
-    #else
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-        nop           /* make the time between the edges the same as during normal reception */
-    #ifdef INVERT
-      bset  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT  /* create falling edge on DSCLK */
-    #else
-      bclr  DSCLK_OUT_BITNUM,DSCLK_OUT_PORT
-    #endif
-    lsr     PTC   /* shift the input data bit (PTC0) into C */
-    clra					/* clear the accumulator */
-        rola          /* shift the sample into A from the bottom */
-    #ifdef INVERT
-      eor   #0x01 /* negate the received bit */
-    #endif
-  }
-#endif
+/* transmit and receive one 17 bit message with the DSCLK period given by BDMCF_DELAY_n */
+/* the status bit is always sent as 0, the received status bit is returned in bit 16 */
+/* every speed gets its own copy of the shift loop so the delays are compile-time constants */
+#define BDMCF_TXRX17(n)                                             \
+uint32_t bdmcf_txrx17_##n(uint32_t mess)                            \
+{                                                                   \
+    return bdmcf_shift(mess & 0xffff, 17, BDMCF_DELAY_##n);         \
+}
+
+BDMCF_TXRX17(0)
+BDMCF_TXRX17(1)
+BDMCF_TXRX17(2)
+BDMCF_TXRX17(3)
+BDMCF_TXRX17(4)
+BDMCF_TXRX17(5)
+BDMCF_TXRX17(6)
+
+/* delays of the bit-banged speeds for the functions which are not time critical */
+static const uint32_t bdmcf_delays[BDMCF_SPEED_GPIO] =
+{
+    BDMCF_DELAY_0, BDMCF_DELAY_1, BDMCF_DELAY_2, BDMCF_DELAY_3,
+    BDMCF_DELAY_4, BDMCF_DELAY_5, BDMCF_DELAY_6
+};
+
+/* transmits and receives an arbitrary number of bits (up to 32) at the selected speed */
+/* not time critical, used to re-align the message boundary during resync */
+uint32_t bdmcf_txrx_bits_gpio(uint32_t mess, uint8_t bits)
+{
+    return bdmcf_shift(mess, bits, bdmcf_delays[bdmcf_speed]);
+}
+
+/* routes DSCLK, DSI and DSO to the GPIO pins used by the bit-banging Tx/Rx functions */
+void bdmcf_init_gpio(void)
+{
+    PORTC_PCR5 = PORT_PCR_MUX(0x1);     /* give the SPI pins back (PTC5 is the LED) */
+    PORTC_PCR6 = PORT_PCR_MUX(0x0);
+    PORTC_PCR7 = PORT_PCR_MUX(0x0);
+
+    PORTA_PCR12 = PORT_PCR_MUX(0x1) | PORT_PCR_DSE_MASK;    /* DSCLK */
+    PORTA_PCR13 = PORT_PCR_MUX(0x1);                        /* DSI */
+    PORTD_PCR7 = PORT_PCR_MUX(0x1) | PORT_PCR_DSE_MASK;     /* DSO */
+
+    DSCLK_LO();                         /* preload the idle state before the pins become outputs */
+    DSO_LO();
+    GPIOA_PDDR = (GPIOA_PDDR | (1 << 12)) & ~(1 << 13);
+    GPIOD_PDDR |= (1 << 7);
 }
 
 /* JTAG support */
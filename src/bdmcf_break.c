@@ -0,0 +1,191 @@
+/*
+ * bdmcf_break.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Software breakpoints kept by the probe (CMD_BREAKPOINT).
+ *
+ * bdmcf_go() patches a HALT instruction over every entry just before the target is started and the
+ * original opcodes are put back as soon as the target is found stopped (bdmcf_halted(), bdmcf_halt()
+ * or a reset into BDM mode) or when it could not be started. The opcode is read when the HALT goes in,
+ * so code downloaded after the breakpoint was set is not damaged. Only RAM can be patched this way.
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+
+typedef struct
+{
+    uint32_t address;
+    uint16_t opcode;                    /* the original instruction word while inserted */
+    uint8_t inserted;
+} breakpoint_t;
+
+static breakpoint_t breakpoints[BDMCF_BREAKPOINTS];
+static uint8_t break_count;
+static uint8_t break_inserted;          /* number of entries with the HALT in memory */
+
+/* reads the word at address into *value */
+/* returns 0 on success and non-zero on error */
+static uint8_t break_read16(uint32_t address, uint16_t *value)
+{
+    uint8_t data[2];
+
+    bdmcf_tx_msg(BDMCF_CMD_READ16);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    if (bdmcf_rx(1, data))
+    {
+        return 1;
+    }
+    *value = get_be16(data);
+    return 0;
+}
+
+/* writes value to the word at address */
+/* returns 0 on success and non-zero on error */
+static uint8_t break_write16(uint32_t address, uint16_t value)
+{
+    bdmcf_tx_msg(BDMCF_CMD_WRITE16);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    bdmcf_tx_msg(value);
+    return bdmcf_complete_chk_rx();
+}
+
+/* adds (BREAK_ADD) or removes (BREAK_REMOVE) the breakpoint at address, or removes all of them (BREAK_CLEAR) */
+/* returns 0 on success and non-zero if the table cannot be changed (full, no such entry, odd address or */
+/* the breakpoints are in memory) */
+uint8_t bdmcf_break_set(uint8_t op, uint32_t address)
+{
+    uint8_t i;
+
+    if (break_inserted || (address & 1))
+    {
+        return 1;
+    }
+
+    if (op == BREAK_CLEAR)
+    {
+        break_count = 0;
+        return 0;
+    }
+
+    for (i = 0; i < break_count; i++)
+    {
+        if (breakpoints[i].address == address)
+        {
+            break;
+        }
+    }
+
+    if (op == BREAK_ADD)
+    {
+        if (i < break_count)
+        {
+            return 0;                   /* already there */
+        }
+        if (break_count == BDMCF_BREAKPOINTS)
+        {
+            return 1;
+        }
+        breakpoints[break_count].address = address;
+        breakpoints[break_count].inserted = 0;
+        break_count++;
+        return 0;
+    }
+
+    if ((op != BREAK_REMOVE) || (i == break_count))
+    {
+        return 1;
+    }
+    breakpoints[i] = breakpoints[--break_count];    /* the last entry takes its place */
+    return 0;
+}
+
+/* returns the number of breakpoints in the table */
+uint8_t bdmcf_break_count(void)
+{
+    return break_count;
+}
+
+/* returns non-zero if there is a breakpoint at address */
+uint8_t bdmcf_break_at(uint32_t address)
+{
+    uint8_t i;
+
+    for (i = 0; i < break_count; i++)
+    {
+        if (breakpoints[i].address == address)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* puts the original opcodes back where a HALT was inserted */
+/* returns 0 on success and non-zero if some could not be written (the target is still running), */
+/* those are tried again by the next call */
+uint8_t bdmcf_break_remove(void)
+{
+    uint8_t i;
+
+    for (i = 0; break_inserted && (i < break_count); i++)
+    {
+        if (breakpoints[i].inserted)
+        {
+            if (break_write16(breakpoints[i].address, breakpoints[i].opcode))
+            {
+                bdmcf_complete_chk_rx();    /* purge the BDM */
+                bdmcf_complete_chk_rx();
+                return 1;
+            }
+            breakpoints[i].inserted = 0;
+            break_inserted--;
+        }
+    }
+    return 0;
+}
+
+/* patches a HALT instruction over every breakpoint */
+/* returns 0 on success, on error the ones already inserted are removed again and non-zero is returned */
+uint8_t bdmcf_break_insert(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < break_count; i++)
+    {
+        if (breakpoints[i].inserted)
+        {
+            continue;
+        }
+        if (break_read16(breakpoints[i].address, &breakpoints[i].opcode) ||
+            break_write16(breakpoints[i].address, BDMCF_HALT_OPCODE))
+        {
+            bdmcf_complete_chk_rx();    /* purge the BDM */
+            bdmcf_complete_chk_rx();
+            bdmcf_break_remove();
+            return 1;
+        }
+        breakpoints[i].inserted = 1;
+        break_inserted++;
+    }
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * bdmcf_cache.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Cache of target memory pages for a halted target.
+ *
+ * Only memory inside the windows set up by the host (CMD_MEM_CACHE_WINDOW) is cached, reading a whole page
+ * of peripheral registers could have side effects. Pages are BDMCF_CACHE_PAGE bytes, direct mapped, and
+ * tagged with the access width they were read with, so a byte read is never answered from a dword read.
+ * Writes go to the target first and then update a cached copy of the page (of any width).
+ * The cache is bypassed unless the target is known to be halted (bdmcf_target_halted) and dropped whenever
+ * the target may have changed memory or its memory map: GO, STEP, HALT, reset, RSTO and writes of the
+ * control registers.
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+#include "xstring.h"
+
+#define BDMCF_CACHE_PAGES       128     /* must be a power of two */
+#define BDMCF_CACHE_WINDOWS     4
+
+static uint8_t cache_data[BDMCF_CACHE_PAGES][BDMCF_CACHE_PAGE];
+static uint32_t cache_tag[BDMCF_CACHE_PAGES];   /* page address + access width, 0 = empty */
+static uint32_t cache_window_start[BDMCF_CACHE_WINDOWS];
+static uint32_t cache_window_length[BDMCF_CACHE_WINDOWS];
+
+/* drops all pages */
+void bdmcf_cache_invalidate(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < BDMCF_CACHE_PAGES; i++)
+    {
+        cache_tag[i] = 0;
+    }
+}
+
+/* sets cache window number window to length bytes from address, a length of 0 disables it */
+/* returns 0 on success and non-zero if there is no such window */
+uint8_t bdmcf_cache_window(uint8_t window, uint32_t address, uint32_t length)
+{
+    if (window >= BDMCF_CACHE_WINDOWS)
+    {
+        return 1;
+    }
+    cache_window_start[window] = address;
+    cache_window_length[window] = length;
+    bdmcf_cache_invalidate();
+    return 0;
+}
+
+/* returns non-zero if length bytes from address are all inside one of the windows, */
+/* a page is only read if all of it is inside */
+static uint8_t cache_cacheable(uint32_t address, uint32_t length)
+{
+    uint8_t i;
+
+    for (i = 0; i < BDMCF_CACHE_WINDOWS; i++)
+    {
+        if ((address - cache_window_start[i] < cache_window_length[i]) &&
+            (length <= cache_window_length[i] - (address - cache_window_start[i])))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* reads the page at address with accesses of width bytes into data */
+/* returns 0 on success and non-zero on error */
+static uint8_t cache_fill(uint32_t address, uint8_t width, uint8_t *data)
+{
+    uint8_t count = BDMCF_CACHE_PAGE / width;
+    unsigned int dump_cmd = (width == 1) ? BDMCF_CMD_DUMP8 : BDMCF_CMD_DUMP16;
+    uint8_t word[2];
+
+    if (width == 4)
+    {
+        return bdmcf_read_block32(address, count, data);
+    }
+
+    bdmcf_tx_msg((width == 1) ? BDMCF_CMD_READ8 : BDMCF_CMD_READ16);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    while (count--)
+    {
+        if (count ? bdmcf_rxtx(1, word, dump_cmd) : bdmcf_rx(1, word))
+        {
+            return 1;
+        }
+        if (width == 1)
+        {
+            *data++ = word[1];          /* the byte is LSB of the received word */
+        }
+        else
+        {
+            *data++ = word[0];
+            *data++ = word[1];
+        }
+    }
+    return 0;
+}
+
+/* reads length bytes from address with accesses of width bytes (1, 2 or 4) into data, */
+/* from the cache if the pages are there, otherwise the pages are read first */
+/* returns BDMCF_CACHE_HIT on success, BDMCF_CACHE_ERROR if reading a page failed or */
+/* BDMCF_CACHE_BYPASS if the memory is not cached, the caller then reads it the usual way */
+uint8_t bdmcf_cache_read(uint32_t address, uint8_t width, uint32_t length, uint8_t *data)
+{
+    uint32_t page;
+    uint32_t offset;
+    uint32_t n;
+    uint8_t i;
+
+    page = address & ~(BDMCF_CACHE_PAGE - 1);
+    if (!bdmcf_target_halted || (length == 0) || (address & (width - 1)) ||
+        !cache_cacheable(page, ((address + length + BDMCF_CACHE_PAGE - 1) & ~(BDMCF_CACHE_PAGE - 1)) - page))
+    {
+        return BDMCF_CACHE_BYPASS;
+    }
+
+    while (length)
+    {
+        page = address & ~(BDMCF_CACHE_PAGE - 1);
+        offset = address - page;
+        n = BDMCF_CACHE_PAGE - offset;
+        if (n > length)
+        {
+            n = length;
+        }
+        i = (page / BDMCF_CACHE_PAGE) & (BDMCF_CACHE_PAGES - 1);
+        if (cache_tag[i] != (page | width))
+        {
+            cache_tag[i] = 0;
+            if (cache_fill(page, width, cache_data[i]))
+            {
+                return BDMCF_CACHE_ERROR;
+            }
+            cache_tag[i] = page | width;
+        }
+        memcpy(data, cache_data[i] + offset, n);
+        data += n;
+        address += n;
+        length -= n;
+    }
+    return BDMCF_CACHE_HIT;
+}
+
+/* updates the cached copies of length bytes at address just written to the target */
+void bdmcf_cache_write(uint32_t address, uint32_t length, uint8_t *data)
+{
+    uint32_t page;
+    uint32_t offset;
+    uint32_t n;
+    uint8_t i;
+
+    while (length)
+    {
+        page = address & ~(BDMCF_CACHE_PAGE - 1);
+        offset = address - page;
+        n = BDMCF_CACHE_PAGE - offset;
+        if (n > length)
+        {
+            n = length;
+        }
+        i = (page / BDMCF_CACHE_PAGE) & (BDMCF_CACHE_PAGES - 1);
+        if (cache_tag[i] && ((cache_tag[i] & ~(BDMCF_CACHE_PAGE - 1)) == page))
+        {
+            memcpy(cache_data[i] + offset, data, n);
+        }
+        data += n;
+        address += n;
+        length -= n;
+    }
+}
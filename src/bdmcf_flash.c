@@ -0,0 +1,251 @@
+/*
+ * bdmcf_flash.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Flash programming through a stub running on the target.
+ *
+ * The host downloads a programming stub for its flash into target RAM (CMD_WRITE_MEMBLOCK32 or
+ * CMD_STREAM_WRITE) and starts it with CMD_FLASH_SETUP, which also tells the probe where the mailbox and
+ * the two RAM buffers are. The data of CMD_FLASH_PROGRAM is written into one buffer while the stub programs
+ * the other one. A full buffer is handed over through the mailbox (see FLASH_MBOX_x in commands.h), the
+ * probe only polls the mailbox when it needs the buffer back. The time the stub took for every buffer
+ * ("sector") is recorded and can be read with CMD_FLASH_STATUS.
+ *
+ * The target keeps running while the probe reads and writes its RAM.
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+
+#define BDMCF_FLASH_TIMEOUT_MS  5000    /* longest time the stub may take for a buffer (sector erase included) */
+
+struct flash_sector
+{
+    uint32_t address;
+    uint32_t count;
+    uint32_t time_us;
+};
+
+static uint8_t flash_active;
+static uint32_t flash_mailbox;
+static uint32_t flash_buffer[2];
+static uint16_t flash_size;             /* size of each buffer */
+
+static uint8_t flash_fill;              /* buffer being filled */
+static uint32_t flash_address;          /* flash address of the data in the buffer being filled */
+static uint16_t flash_count;            /* bytes in the buffer being filled */
+
+static uint8_t flash_busy;              /* the stub is programming the other buffer */
+static uint32_t flash_busy_start;       /* cycle counter when it was handed over */
+static uint32_t flash_status;           /* status the stub reported for the last buffer */
+
+static struct flash_sector flash_sectors[BDMCF_FLASH_SECTORS];
+static uint32_t flash_nsectors;         /* number of buffers programmed since CMD_FLASH_SETUP */
+
+/* writes a single dword to target memory */
+static uint8_t flash_write32(uint32_t address, uint32_t value)
+{
+    uint8_t data[4];
+
+    put_be32(data, value);
+    return bdmcf_write_block32(address, 1, data);
+}
+
+/* sets up the double buffer & mailbox and starts the stub at entry */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_flash_setup(uint32_t entry, uint32_t mailbox, uint32_t buffer0, uint32_t buffer1, uint16_t size)
+{
+    uint8_t pc[4];
+
+    flash_active = 0;
+    if ((size == 0) || (size & 3))
+    {
+        return 1;
+    }
+
+    flash_mailbox = mailbox;
+    flash_buffer[0] = buffer0;
+    flash_buffer[1] = buffer1;
+    flash_size = size;
+    flash_fill = 0;
+    flash_count = 0;
+    flash_busy = 0;
+    flash_status = 0;
+    flash_nsectors = 0;
+
+    if (flash_write32(mailbox + FLASH_MBOX_COMMAND, FLASH_MBOX_IDLE))
+    {
+        return 1;
+    }
+
+    put_be32(pc, entry);                /* PC = entry point of the stub */
+    if (bdmcf_write_creg(BDMCF_CREG_PC, pc) || bdmcf_complete_chk_rx() || bdmcf_go(0))
+    {
+        return 1;
+    }
+
+    flash_active = 1;
+    return 0;
+}
+
+/* waits until the stub has finished the buffer handed over last and records how long it took */
+/* returns 0 on success and non-zero on error (timeout or the stub reported an error) */
+static uint8_t flash_wait(void)
+{
+    uint8_t mbox[8];
+    struct flash_sector *sector;
+    uint32_t timeout = BDMCF_FLASH_TIMEOUT_MS * core_clk_khz;
+
+    if (!flash_busy)
+    {
+        return 0;
+    }
+
+    do
+    {
+        if (bdmcf_read_block32(flash_mailbox + FLASH_MBOX_COMMAND, 2, mbox))   /* command & status */
+        {
+            return 1;
+        }
+        if ((CYCCNT() - flash_busy_start) > timeout)
+        {
+            return 1;
+        }
+    } while (get_be32(mbox) != FLASH_MBOX_IDLE);
+
+    sector = &flash_sectors[flash_nsectors % BDMCF_FLASH_SECTORS];
+    sector->time_us = CYCCNT_US(CYCCNT() - flash_busy_start);
+    flash_nsectors++;
+    flash_busy = 0;
+
+    flash_status = get_be32(mbox + 4);
+    return flash_status != 0;
+}
+
+/* hands the buffer being filled over to the stub and switches to the other one */
+/* returns 0 on success and non-zero on error */
+static uint8_t flash_post(void)
+{
+    uint8_t mbox[16];
+    struct flash_sector *sector;
+
+    if (flash_count == 0)
+    {
+        return 0;
+    }
+    if (flash_wait())
+    {
+        return 1;                       /* the other buffer has to be done first */
+    }
+
+    put_be32(mbox + 0, 0);              /* status, address, buffer & count in one go */
+    put_be32(mbox + 4, flash_address);
+    put_be32(mbox + 8, flash_buffer[flash_fill]);
+    put_be32(mbox + 12, flash_count);
+    if (bdmcf_write_block32(flash_mailbox + FLASH_MBOX_STATUS, 4, mbox) ||
+        flash_write32(flash_mailbox + FLASH_MBOX_COMMAND, FLASH_MBOX_PROGRAM))  /* the command goes last */
+    {
+        return 1;
+    }
+    flash_busy_start = CYCCNT();
+    flash_busy = 1;
+
+    sector = &flash_sectors[flash_nsectors % BDMCF_FLASH_SECTORS];
+    sector->address = flash_address;
+    sector->count = flash_count;
+
+    flash_fill ^= 1;
+    flash_count = 0;
+    return 0;
+}
+
+/* queues length bytes (a multiple of 4) to be programmed at address */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_flash_program(uint32_t address, uint8_t *data, uint8_t length)
+{
+    uint16_t n;
+
+    if (!flash_active || (length & 3))
+    {
+        return 1;
+    }
+    if (flash_count && (address != flash_address + flash_count) && flash_post())
+    {
+        return 1;                       /* not contiguous, the buffer so far is programmed on its own */
+    }
+
+    while (length)
+    {
+        if (flash_count == 0)
+        {
+            flash_address = address;
+        }
+        n = flash_size - flash_count;
+        if (n > length)
+        {
+            n = length;
+        }
+        if (bdmcf_write_block32(flash_buffer[flash_fill] + flash_count, n >> 2, data))
+        {
+            return 1;
+        }
+        flash_count += n;
+        address += n;
+        data += n;
+        length -= n;
+        if ((flash_count == flash_size) && flash_post())
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* programs what is left in the buffer and waits for the stub to finish */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_flash_flush(void)
+{
+    if (!flash_active || flash_post())
+    {
+        return 1;
+    }
+    return flash_wait();
+}
+
+/* stores the last stub status, the number of records and the records of the last BDMCF_FLASH_SECTORS */
+/* buffers (oldest first) into data, returns the number of bytes stored */
+uint8_t bdmcf_flash_status(uint8_t *data)
+{
+    uint32_t first = (flash_nsectors > BDMCF_FLASH_SECTORS) ? flash_nsectors - BDMCF_FLASH_SECTORS : 0;
+    uint8_t *ptr = data + 5;
+    struct flash_sector *sector;
+
+    put_be32(data, flash_status);
+    data[4] = flash_nsectors - first;
+    for (; first < flash_nsectors; first++)
+    {
+        sector = &flash_sectors[first % BDMCF_FLASH_SECTORS];
+        put_be32(ptr + 0, sector->address);
+        put_be32(ptr + 4, sector->count);
+        put_be32(ptr + 8, sector->time_us);
+        ptr += 12;
+    }
+    return ptr - data;
+}
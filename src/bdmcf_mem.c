@@ -0,0 +1,543 @@
+/*
+ * bdmcf_mem.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Operations on target memory ranges which run on the probe and only return a short result.
+ * Ranges are read in blocks of BDMCF_MEM_BLOCK dwords (a READ32 followed by DUMP32s), by DMA when the
+ * SPI transport is selected.
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+#include "crc32.h"
+#include "rle.h"
+#include "xstring.h"
+
+static uint8_t mem_block[4 * BDMCF_MEM_BLOCK];
+
+/* reads count (1..BDMCF_MEM_BLOCK) dwords from address into data */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_read_block32(uint32_t address, uint8_t count, uint8_t *data)
+{
+    bdmcf_tx_msg(BDMCF_CMD_READ32);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+
+    if (bdmcf_speed >= BDMCF_SPEED_SPI)
+    {
+        return bdmcf_spi_dump(count, 2, data, BDMCF_CMD_DUMP32);
+    }
+
+    while (--count)
+    {
+        if (bdmcf_rxtx(2, data, BDMCF_CMD_DUMP32))
+        {
+            return 1;                   /* get the result & send in new DUMP command */
+        }
+        data += 4;
+    }
+    return bdmcf_rx(2, data);           /* read the last result (and send NOP) */
+}
+
+/* writes count (1..BDMCF_MEM_BLOCK) dwords from data to address and checks the last write has completed */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_write_block32(uint32_t address, uint8_t count, uint8_t *data)
+{
+    uint8_t *start = data;
+    uint8_t length = count;
+
+    bdmcf_tx_msg(BDMCF_CMD_WRITE32);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    bdmcf_tx(2, data);                  /* the first dword goes with WRITE32, the rest is filled */
+    data += 4;
+    count--;
+
+    if (count && (bdmcf_speed >= BDMCF_SPEED_SPI))
+    {
+        if (bdmcf_spi_fill(count, 2, data, BDMCF_CMD_FILL32))
+        {
+            return 1;
+        }
+    }
+    else if (count && bdmcf_fill(count, 4, data, BDMCF_CMD_FILL32))
+    {
+        return 1;
+    }
+    if (bdmcf_complete_chk_rx())
+    {
+        return 1;
+    }
+    bdmcf_cache_write(address, 4 * length, start);
+    return 0;
+}
+
+/* reads a single byte from address into *data */
+/* returns 0 on success and non-zero on error */
+static uint8_t bdmcf_read8(uint32_t address, uint8_t *data)
+{
+    uint8_t word[2];
+
+    bdmcf_tx_msg(BDMCF_CMD_READ8);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    if (bdmcf_rx(1, word))
+    {
+        return 1;
+    }
+    *data = word[1];                    /* the byte is LSB of the received word */
+    return 0;
+}
+
+/* calculates the CRC-32 (as zlib) of length bytes of target memory starting at address */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_mem_crc32(uint32_t address, uint32_t length, uint32_t *crc)
+{
+    uint32_t dwords = length >> 2;
+    uint8_t count;
+    uint8_t byte;
+
+    *crc = 0;
+    while (dwords)
+    {
+        count = (dwords > BDMCF_MEM_BLOCK) ? BDMCF_MEM_BLOCK : dwords;
+        if (bdmcf_read_block32(address, count, mem_block))
+        {
+            return 1;
+        }
+        *crc = crc32_update(*crc, mem_block, 4 * count);
+        address += 4 * count;
+        dwords -= count;
+    }
+
+    length &= 3;                        /* bytes which do not make up a dword */
+    while (length--)
+    {
+        if (bdmcf_read8(address++, &byte))
+        {
+            return 1;
+        }
+        *crc = crc32_update(*crc, &byte, 1);
+    }
+    return 0;
+}
+
+/* fills length bytes (a multiple of width) from address with pattern, width (1, 2 or 4) bytes at a time */
+/* the pattern is repeated in a buffer once and streamed with FILL commands from there */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_mem_fill(uint32_t address, uint32_t length, uint8_t width, uint32_t pattern)
+{
+    uint32_t count;
+    uint8_t size = width;               /* bytes per element in the buffer */
+    uint8_t chunk;
+    uint8_t n;
+    uint8_t i;
+    unsigned int fill_cmd;
+
+    if ((width != 1) && (width != 2) && (width != 4))
+    {
+        return 1;
+    }
+    count = length / width;
+    if ((count == 0) || (length % width) || (address & (width - 1)))
+    {
+        return 1;
+    }
+
+    bdmcf_cache_invalidate();
+    if (width == 4)
+    {
+        bdmcf_tx_msg(BDMCF_CMD_WRITE32);
+        fill_cmd = BDMCF_CMD_FILL32;
+        chunk = BDMCF_MEM_BLOCK;
+    }
+    else
+    {
+        bdmcf_tx_msg((width == 2) ? BDMCF_CMD_WRITE16 : BDMCF_CMD_WRITE8);
+        fill_cmd = (width == 2) ? BDMCF_CMD_FILL16 : BDMCF_CMD_FILL8;
+        if (bdmcf_speed >= BDMCF_SPEED_SPI)
+        {
+            size = 2;                   /* DMA sends whole frames, the byte is the LSB */
+            chunk = 2 * BDMCF_MEM_BLOCK;
+        }
+        else
+        {
+            chunk = (width == 2) ? 2 * BDMCF_MEM_BLOCK : 255;
+        }
+    }
+    for (i = 0; i < chunk; i++)
+    {
+        if (size == 4)
+        {
+            put_be32(mem_block + 4 * i, pattern);
+        }
+        else if (size == 2)
+        {
+            put_be16(mem_block + 2 * i, (width == 2) ? pattern : (pattern & 0xff));
+        }
+        else
+        {
+            mem_block[i] = pattern;
+        }
+    }
+
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    if (width == 4)
+    {
+        bdmcf_tx_msg(pattern >> 16);    /* the first element goes with the WRITE, the rest is filled */
+    }
+    bdmcf_tx_msg((width == 1) ? (pattern & 0xff) : (pattern & 0xffff));
+    count--;
+
+    while (count)
+    {
+        n = (count > chunk) ? chunk : count;
+        if (bdmcf_speed >= BDMCF_SPEED_SPI)
+        {
+            if (bdmcf_spi_fill(n, (width == 4) ? 2 : 1, mem_block, fill_cmd))
+            {
+                return 1;
+            }
+        }
+        else if (bdmcf_fill(n, width, mem_block, fill_cmd))
+        {
+            return 1;
+        }
+        count -= n;
+    }
+    return bdmcf_complete_chk_rx();
+}
+
+static uint8_t search_pattern[BDMCF_SEARCH_PATTERN];
+static uint8_t search_mask[BDMCF_SEARCH_PATTERN];
+static uint8_t search_buf[BDMCF_SEARCH_PATTERN - 1 + 4 * BDMCF_MEM_BLOCK + 3];  /* carry, block & room for the last word load */
+
+/* returns 0x80 (or 0xff) in every byte of x which is zero and 0 in the others */
+static inline uint32_t search_zero_bytes(uint32_t x)
+{
+#ifdef HOST_BUILD
+    if (sim_dsp)
+    {
+        sim_usub8(0, x);                /* the simulation models the instructions (make host) */
+        return sim_sel(0xffffffff, 0);
+    }
+#elif defined(__ARM_ARCH_7EM__)
+    uint32_t r;
+
+    /* the GE flag of each byte is set if 0 >= x, sel then picks 0xff for those */
+    __asm__("usub8 %0, %1, %2\n\tsel %0, %3, %1" : "=&r" (r) : "r" (0), "r" (x), "r" (0xffffffff));
+    return r;
+#endif
+    return ~((((x & 0x7f7f7f7f) + 0x7f7f7f7f) | x) | 0x7f7f7f7f);
+}
+
+/* returns non-zero if the size bytes at data match the search pattern under the mask */
+static uint8_t search_match(uint8_t *data, uint8_t size)
+{
+    uint8_t i;
+
+    for (i = 1; i < size; i++)          /* the first byte has been checked already */
+    {
+        if ((data[i] ^ search_pattern[i]) & search_mask[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* searches length bytes from address for the size byte pattern, bytes */
+/* only compared where mask has bits set, at every step (1, 2 or 4) bytes from address */
+/* stores up to max addresses found (32-bit each) into matches & their number into *found; *cursor is where */
+/* to carry on searching, the end of the range if all of it was searched */
+/* the memory is read in blocks of DUMP32s, a match may cross the blocks; candidates for the first byte of */
+/* the pattern are found 4 at a time with the byte-wise SIMD instructions of the Cortex-M4 */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_mem_search(uint32_t address, uint32_t length, uint8_t step, uint8_t size, uint8_t *pattern, uint8_t *mask,
+                         uint8_t max, uint8_t *matches, uint8_t *found, uint32_t *cursor)
+{
+    uint32_t base = address & ~3;       /* target address of search_buf[0] */
+    uint32_t next = base;               /* next dword to read */
+    uint32_t end = (address + length + 3) & ~3;
+    uint32_t first;
+    uint32_t first_mask;
+    uint32_t hits;
+    uint16_t n = 0;                     /* bytes in the buffer */
+    uint16_t p = 0;                     /* next position to check */
+    uint8_t count;
+    uint8_t i;
+
+    *found = 0;
+    if ((size == 0) || (size > BDMCF_SEARCH_PATTERN) || ((step != 1) && (step != 2) && (step != 4)) ||
+        (length < size) || (max == 0))
+    {
+        return 1;
+    }
+    memcpy(search_pattern, pattern, size);  /* the results overwrite the parameters */
+    memcpy(search_mask, mask, size);
+    first_mask = search_mask[0] * 0x01010101;
+    first = (search_pattern[0] * 0x01010101) & first_mask;
+
+    for (;;)
+    {
+        while (p + size <= n)
+        {
+            hits = search_zero_bytes(((search_buf[p] | (search_buf[p + 1] << 8) | (search_buf[p + 2] << 16) |
+                                      (search_buf[p + 3] << 24)) & first_mask) ^ first);
+            for (i = 0; (i < 4) && (p + i + size <= n); i++)
+            {
+                if (((hits >> (8 * i)) & 0x80) && (base + p + i >= address) && (((base + p + i - address) & (step - 1)) == 0) &&
+                    search_match(search_buf + p + i, size))
+                {
+                    put_be32(matches + 4 * *found, base + p + i);
+                    if (++(*found) == max)
+                    {
+                        *cursor = base + p + i + step;
+                        return 0;
+                    }
+                }
+            }
+            p += i;
+        }
+        if (next == end)
+        {
+            break;
+        }
+
+        for (i = 0; p + i < n; i++)
+        {
+            search_buf[i] = search_buf[p + i];  /* keep the bytes a match may start in */
+        }
+        base += p;
+        n -= p;
+        p = 0;
+        count = ((end - next) >> 2 > BDMCF_MEM_BLOCK) ? BDMCF_MEM_BLOCK : (end - next) >> 2;
+        if (bdmcf_read_block32(next, count, search_buf + n))
+        {
+            return 1;
+        }
+        n += 4 * count;
+        next += 4 * count;
+        if (next == end)
+        {
+            n -= end - (address + length);  /* the bytes of the last dword beyond the range */
+        }
+    }
+    *cursor = address + length;
+    return 0;
+}
+
+/* reads from address and run length encodes into at most max bytes of out as much of the following length bytes */
+/* as fits; stores the number of bytes covered into *covered & the size of the encoded data into *size */
+/* address, length & the bytes covered are multiples of 4, so the host can carry on from address + *covered */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_mem_read_rle(uint32_t address, uint32_t length, uint8_t *out, uint8_t max, uint16_t *covered, uint8_t *size)
+{
+    uint32_t n = 0;
+    uint32_t o = 0;
+    uint32_t consumed;
+    uint32_t len;
+    uint8_t count;
+
+    *covered = 0;
+    *size = 0;
+    if ((address & 3) || (length & 3))
+    {
+        return 1;
+    }
+    if (length > BDMCF_MEM_RLE_MAX)
+    {
+        length = BDMCF_MEM_RLE_MAX;
+    }
+
+    while (length)
+    {
+        count = (length >> 2 > BDMCF_MEM_BLOCK) ? BDMCF_MEM_BLOCK : length >> 2;
+        if (bdmcf_read_block32(address, count, mem_block))
+        {
+            return 1;
+        }
+        len = 4 * count;
+        for (;;)
+        {
+            n = rle_encode(mem_block, 0xffffffff, 0, len, out + o, max - o, &consumed);
+            if (consumed == len)
+            {
+                break;
+            }
+            len = consumed & ~3;        /* the output is full, stop at the last whole dword */
+        }
+        o += n;
+        *covered += len;
+        if (len < 4 * count)
+        {
+            break;
+        }
+        address += len;
+        length -= len;
+    }
+    *size = o;
+    return 0;
+}
+
+/* writes count (1..BDMCF_MEM_BLOCK) dwords from data to address, but only those which differ from what the */
+/* target has; changed dwords are written in runs of WRITE32 + FILL32s, a single unchanged dword between two */
+/* changes is written along (3 FILL32 frames cost less than the 5 of a new WRITE32) */
+/* stores the number of dwords not written into *skipped, returns 0 on success and non-zero on error */
+uint8_t bdmcf_mem_write_diff(uint32_t address, uint8_t count, uint8_t *data, uint8_t *skipped)
+{
+    uint8_t i = 0;
+    uint8_t run;
+
+    *skipped = 0;
+    if ((count == 0) || (count > BDMCF_MEM_BLOCK) || (address & 3))
+    {
+        return 1;
+    }
+    if (bdmcf_read_block32(address, count, mem_block))
+    {
+        return 1;
+    }
+
+    while (i < count)
+    {
+        if (memcmp(mem_block + 4 * i, data + 4 * i, 4) == 0)
+        {
+            (*skipped)++;
+            i++;
+            continue;
+        }
+        run = 1;
+        while (i + run < count)
+        {
+            if (memcmp(mem_block + 4 * (i + run), data + 4 * (i + run), 4) != 0)
+            {
+                run++;
+            }
+            else if ((i + run + 1 < count) && (memcmp(mem_block + 4 * (i + run + 1), data + 4 * (i + run + 1), 4) != 0))
+            {
+                run += 2;               /* bridge the single unchanged dword */
+            }
+            else
+            {
+                break;
+            }
+        }
+        if (bdmcf_write_block32(address + 4 * i, run, data + 4 * i))
+        {
+            return 1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/* writes a byte (size 1) or word (size 2) from data to address */
+/* returns 0 on success and non-zero on error */
+static uint8_t bdmcf_write_small(uint32_t address, uint8_t size, uint8_t *data)
+{
+    bdmcf_tx_msg((size == 1) ? BDMCF_CMD_WRITE8 : BDMCF_CMD_WRITE16);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    bdmcf_tx_msg((size == 1) ? *data : get_be16(data));
+    if (bdmcf_complete_chk_rx())
+    {
+        return 1;
+    }
+    bdmcf_cache_write(address, size, data);
+    return 0;
+}
+
+/* reads a byte (size 1) or word (size 2) from address into data */
+/* returns 0 on success and non-zero on error */
+static uint8_t bdmcf_read_small(uint32_t address, uint8_t size, uint8_t *data)
+{
+    uint8_t word[2];
+
+    if (size == 1)
+    {
+        return bdmcf_read8(address, data);
+    }
+    bdmcf_tx_msg(BDMCF_CMD_READ16);
+    bdmcf_tx_msg(address >> 16);
+    bdmcf_tx_msg(address & 0xffff);
+    if (bdmcf_rx(1, word))
+    {
+        return 1;
+    }
+    data[0] = word[0];
+    data[1] = word[1];
+    return 0;
+}
+
+/* returns the access size to use for the next part of a transfer of length bytes at address: */
+/* bytes & words up to the first dword boundary (the head) and after the last one (the tail), dwords in between */
+static uint8_t bdmcf_mem_width(uint32_t address, uint32_t length)
+{
+    if ((address & 1) || (length == 1))
+    {
+        return 1;
+    }
+    if ((address & 2) || (length < 4))
+    {
+        return 2;
+    }
+    return 4;
+}
+
+/* reads (write == 0) or writes length bytes at any address from/to data, with 8 and 16-bit accesses for */
+/* the unaligned head & tail and blocks of READ32/DUMP32 or WRITE32/FILL32 for the aligned body */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_mem_transfer(uint8_t write, uint32_t address, uint32_t length, uint8_t *data)
+{
+    uint32_t n;
+    uint8_t width;
+
+    while (length)
+    {
+        width = bdmcf_mem_width(address, length);
+        if (width == 4)
+        {
+            n = length >> 2;
+            if (n > BDMCF_MEM_BLOCK)
+            {
+                n = BDMCF_MEM_BLOCK;
+            }
+            if (write ? bdmcf_write_block32(address, n, data) : bdmcf_read_block32(address, n, data))
+            {
+                return 1;
+            }
+            n *= 4;
+        }
+        else
+        {
+            if (write ? bdmcf_write_small(address, width, data) : bdmcf_read_small(address, width, data))
+            {
+                return 1;
+            }
+            n = width;
+        }
+        address += n;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,459 @@
+/*
+ * bdmcf_regs.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * CPU context of a halted target in one go. The register commands are pipelined: the next command
+ * goes out while the last message of the previous one is received (reads) or acknowledged (writes).
+ * A context is D0-D7, A0-A7 (the active stack pointer), PC, SR and up to BDMCF_CONTEXT_CREGS
+ * control registers chosen by the host, 32 bits each.
+ * The single register accesses of the commands go through a shadow which answers repeated reads of a
+ * halted target without any BDM traffic.
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+
+static uint16_t context_creg[2 + BDMCF_CONTEXT_CREGS] = { BDMCF_CREG_PC, BDMCF_CREG_SR };
+
+static uint8_t shadow_context(uint8_t total, uint8_t *data);
+static void shadow_context_store(uint8_t total, uint8_t *data);
+
+/* returns the first command message of context entry n, RAREG/WAREG + register number */
+/* for the CPU registers, RCREG/WCREG for the control registers */
+static unsigned int context_cmd(uint8_t n, unsigned int reg_cmd, unsigned int creg_cmd)
+{
+    return (n < 16) ? reg_cmd + n : creg_cmd;
+}
+
+/* sends the rest of the command of context entry n, the control register address */
+static void context_addr(uint8_t n)
+{
+    if (n >= 16)
+    {
+        bdmcf_tx_msg(0);
+        bdmcf_tx_msg(context_creg[n - 16]);
+    }
+}
+
+/* reads D0-D7, A0-A7, PC, SR and count control registers (16-bit addresses in cregs) into data */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_read_context(uint8_t count, uint8_t *cregs, uint8_t *data)
+{
+    uint8_t total = BDMCF_CONTEXT_SIZE / 4 + count;
+    uint8_t n;
+
+    for (n = 0; n < count; n++)
+    {
+        context_creg[2 + n] = get_be16(cregs + 2 * n);  /* the results overwrite the parameters */
+    }
+    if (shadow_context(total, data))
+    {
+        return 0;
+    }
+
+    bdmcf_tx_msg(context_cmd(0, BDMCF_CMD_RAREG, BDMCF_CMD_RCREG));
+    for (n = 1; n < total; n++)
+    {
+        if (bdmcf_rxtx(2, data, context_cmd(n, BDMCF_CMD_RAREG, BDMCF_CMD_RCREG)))
+        {
+            return 1;                   /* get the register & send in the next command */
+        }
+        context_addr(n);
+        data += 4;
+    }
+    if (bdmcf_rx(2, data))              /* read the last register (and send NOP) */
+    {
+        return 1;
+    }
+    shadow_context_store(total, data - 4 * (total - 1));
+    return 0;
+}
+
+/* writes a context as read by bdmcf_read_context(), count control registers follow as 16-bit address */
+/* & 32-bit value each; SR goes first, so A7 ends up in the stack pointer of the mode the target resumes in */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_write_context(uint8_t count, uint8_t *data)
+{
+    uint8_t total = BDMCF_CONTEXT_SIZE / 4 + count;
+    uint8_t n = 17;                     /* SR */
+    uint8_t i;
+    uint8_t *value;
+
+    for (i = 0; i < count; i++)
+    {
+        context_creg[2 + i] = get_be16(data + BDMCF_CONTEXT_SIZE + 6 * i);
+    }
+
+    bdmcf_shadow_invalidate();          /* the control registers may not read back as written */
+    if (count)
+    {
+        bdmcf_cache_invalidate();       /* and may move memory around */
+    }
+
+    bdmcf_tx_msg(BDMCF_CMD_WCREG);
+    context_addr(n);
+    for (i = 1; ; i++)
+    {
+        value = (n < 18) ? data + 4 * n : data + BDMCF_CONTEXT_SIZE + 6 * (n - 18) + 2;
+        bdmcf_tx_msg(get_be16(value));
+        bdmcf_tx_msg(get_be16(value + 2));
+        if (i == total)
+        {
+            if (bdmcf_complete_chk_rx())
+            {
+                return 1;
+            }
+            shadow_context_store(17, data);     /* D0-D7, A0-A7 & PC */
+            return 0;
+        }
+        n = (n == 17) ? 16 : ((n == 16) ? 18 : n + 1);  /* SR, PC, the other control registers, D0-A7 */
+        if (n == total)
+        {
+            n = 0;
+        }
+        if (bdmcf_complete_chk(context_cmd(n, BDMCF_CMD_WAREG, BDMCF_CMD_WCREG)))
+        {
+            return 1;                   /* the write has completed & the next command is in */
+        }
+        context_addr(n);
+    }
+}
+
+/*
+ * Shadow of the registers of a halted target, filled by the first read and kept coherent by the writes.
+ * Writes update the D/A registers and PC, which read back exactly what was written, and drop anything
+ * else written. The shadow is bypassed unless the target is known to be halted (bdmcf_target_halted)
+ * and dropped whenever it may have changed behind the probe's back: GO, STEP, HALT, reset and RSTO.
+ * The CSR is kept without the status bits (31-28), they clear when read, so a second read of the
+ * real register would not show them either.
+ */
+#define BDMCF_CREG_OTHER_A7 0x0800  /* the inactive stack pointer, swapped with A7 by a write of SR */
+
+static uint32_t shadow_reg[16];     /* D0-D7, A0-A7 */
+static uint16_t shadow_reg_valid;   /* bit n set when shadow_reg[n] holds register n */
+static uint32_t shadow_dmreg[16];
+static uint16_t shadow_dmreg_valid;
+static uint16_t shadow_creg_addr[BDMCF_SHADOW_CREGS];
+static uint32_t shadow_creg[BDMCF_SHADOW_CREGS];
+static uint8_t shadow_cregs;        /* number of control registers held */
+static uint8_t shadow_creg_next;    /* entry replaced when all are in use */
+static uint32_t shadow_hits;
+static uint32_t shadow_misses;
+
+/* forgets all registers */
+void bdmcf_shadow_invalidate(void)
+{
+    shadow_reg_valid = 0;
+    shadow_dmreg_valid = 0;
+    shadow_cregs = 0;
+}
+
+/* returns the shadow entry of control register creg, or BDMCF_SHADOW_CREGS if it is not held */
+static uint8_t shadow_creg_find(uint16_t creg)
+{
+    uint8_t i;
+
+    for (i = 0; i < shadow_cregs; i++)
+    {
+        if (shadow_creg_addr[i] == creg)
+        {
+            break;
+        }
+    }
+    return (i < shadow_cregs) ? i : BDMCF_SHADOW_CREGS;
+}
+
+/* keeps value as the contents of control register creg */
+static void shadow_creg_store(uint16_t creg, uint32_t value)
+{
+    uint8_t i = shadow_creg_find(creg);
+
+    if (i == BDMCF_SHADOW_CREGS)
+    {
+        if (shadow_cregs < BDMCF_SHADOW_CREGS)
+        {
+            i = shadow_cregs++;
+        }
+        else
+        {
+            i = shadow_creg_next;
+            shadow_creg_next = (shadow_creg_next + 1) % BDMCF_SHADOW_CREGS;
+        }
+        shadow_creg_addr[i] = creg;
+    }
+    shadow_creg[i] = value;
+}
+
+/* drops control register creg */
+static void shadow_creg_drop(uint16_t creg)
+{
+    uint8_t i = shadow_creg_find(creg);
+
+    if (i != BDMCF_SHADOW_CREGS)
+    {
+        shadow_cregs--;
+        shadow_creg_addr[i] = shadow_creg_addr[shadow_cregs];   /* the last entry takes its place */
+        shadow_creg[i] = shadow_creg[shadow_cregs];
+    }
+}
+
+/* copies the context of total entries (see bdmcf_read_context()) from the shadow into data */
+/* returns non-zero if all of them were there */
+static uint8_t shadow_context(uint8_t total, uint8_t *data)
+{
+    uint8_t n;
+
+    if (!bdmcf_target_halted || (shadow_reg_valid != 0xffff))
+    {
+        shadow_misses += total;
+        return 0;
+    }
+    for (n = 16; n < total; n++)
+    {
+        if (shadow_creg_find(context_creg[n - 16]) == BDMCF_SHADOW_CREGS)
+        {
+            shadow_misses += total;
+            return 0;
+        }
+    }
+    shadow_hits += total;
+    for (n = 0; n < 16; n++)
+    {
+        put_be32(data + 4 * n, shadow_reg[n]);
+    }
+    for (n = 16; n < total; n++)
+    {
+        put_be32(data + 4 * n, shadow_creg[shadow_creg_find(context_creg[n - 16])]);
+    }
+    return 1;
+}
+
+/* keeps the first total entries of the context in data */
+static void shadow_context_store(uint8_t total, uint8_t *data)
+{
+    uint8_t n;
+
+    if (!bdmcf_target_halted)
+    {
+        return;
+    }
+    for (n = 0; n < 16; n++)
+    {
+        shadow_reg[n] = get_be32(data + 4 * n);
+    }
+    shadow_reg_valid = 0xffff;
+    for (n = 16; n < total; n++)
+    {
+        shadow_creg_store(context_creg[n - 16], get_be32(data + 4 * n));
+    }
+}
+
+/* reads address/data register reg (0-15) into data */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_read_reg(uint8_t reg, uint8_t *data)
+{
+    reg &= 0x0f;
+    if (bdmcf_target_halted && (shadow_reg_valid & (1 << reg)))
+    {
+        shadow_hits++;
+        put_be32(data, shadow_reg[reg]);
+        return 0;
+    }
+    shadow_misses++;
+    bdmcf_tx_msg(BDMCF_CMD_RAREG + reg);
+    if (bdmcf_rx(2, data))
+    {
+        return 1;
+    }
+    if (bdmcf_target_halted)
+    {
+        shadow_reg[reg] = get_be32(data);
+        shadow_reg_valid |= 1 << reg;
+    }
+    return 0;
+}
+
+/* writes data to address/data register reg (0-15) */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_write_reg(uint8_t reg, uint8_t *data)
+{
+    reg &= 0x0f;
+    shadow_reg_valid &= ~(1 << reg);
+    bdmcf_tx_msg(BDMCF_CMD_WAREG + reg);
+    if (bdmcf_tx_msg_half_rx(get_be16(data)))
+    {
+        return 1;
+    }
+    bdmcf_tx_msg(get_be16(data + 2));
+#ifdef CMD_COMPLETE_CHECK
+    if (bdmcf_complete_chk_rx())
+    {
+        return 1;
+    }
+#endif
+    if (bdmcf_target_halted)
+    {
+        shadow_reg[reg] = get_be32(data);
+        shadow_reg_valid |= 1 << reg;
+    }
+    return 0;
+}
+
+/* reads control register creg into data */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_read_creg(uint16_t creg, uint8_t *data)
+{
+    uint8_t i = shadow_creg_find(creg);
+
+    if (bdmcf_target_halted && (i != BDMCF_SHADOW_CREGS))
+    {
+        shadow_hits++;
+        put_be32(data, shadow_creg[i]);
+        return 0;
+    }
+    shadow_misses++;
+    bdmcf_tx_msg(BDMCF_CMD_RCREG);
+    bdmcf_tx_msg(0);
+    bdmcf_tx_msg(creg);
+    if (bdmcf_rx(2, data))
+    {
+        return 1;
+    }
+    if (bdmcf_target_halted)
+    {
+        shadow_creg_store(creg, get_be32(data));
+    }
+    return 0;
+}
+
+/* writes data to control register creg */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_write_creg(uint16_t creg, uint8_t *data)
+{
+    shadow_creg_drop(creg);
+    if (creg == BDMCF_CREG_SR)
+    {
+        shadow_reg_valid &= ~(1 << 15); /* the S bit selects the stack pointer A7 refers to */
+        shadow_creg_drop(BDMCF_CREG_OTHER_A7);
+    }
+    else if (creg != BDMCF_CREG_PC)
+    {
+        bdmcf_cache_invalidate();       /* may move memory around (RAMBAR, MBAR, ...) */
+    }
+    bdmcf_tx_msg(BDMCF_CMD_WCREG);
+    bdmcf_tx_msg(0);
+    bdmcf_tx_msg(creg);
+    bdmcf_tx_msg(get_be16(data));
+    bdmcf_tx_msg(get_be16(data + 2));
+#ifdef CMD_COMPLETE_CHECK
+    if (bdmcf_complete_chk_rx())
+    {
+        return 1;
+    }
+#endif
+    if (bdmcf_target_halted && (creg == BDMCF_CREG_PC))
+    {
+        shadow_creg_store(creg, get_be32(data));
+    }
+    return 0;
+}
+
+/* reads debug module register reg (0-15) into data */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_read_dmreg(uint8_t reg, uint8_t *data)
+{
+    reg &= 0x0f;
+    if (bdmcf_target_halted && (shadow_dmreg_valid & (1 << reg)))
+    {
+        shadow_hits++;
+        put_be32(data, shadow_dmreg[reg]);
+        return 0;
+    }
+    shadow_misses++;
+    bdmcf_tx_msg(BDMCF_CMD_RDMREG + reg);
+    if (bdmcf_rx(2, data))
+    {
+        return 1;
+    }
+    if (bdmcf_running && (reg == 0) && (get_be32(data) & ~BDMCF_CSR_STATIC_MASK))
+    {
+        bdmcf_halted(get_be32(data));   /* reading the CSR has cleared the status bits, bdmcf_halt_poll() would miss the halt */
+    }
+    if (bdmcf_target_halted)
+    {
+        shadow_dmreg[reg] = get_be32(data) & (reg ? 0xffffffff : BDMCF_CSR_STATIC_MASK);
+        shadow_dmreg_valid |= 1 << reg;
+    }
+    return 0;
+}
+
+/* writes data to debug module register reg (0-15) */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_write_dmreg(uint8_t reg, uint8_t *data)
+{
+    reg &= 0x0f;
+    shadow_dmreg_valid &= ~(1 << reg);  /* not all the bits read back as written */
+    bdmcf_tx_msg(BDMCF_CMD_WDMREG + reg);
+    if (bdmcf_tx_msg_half_rx(get_be16(data)))
+    {
+        return 1;
+    }
+    bdmcf_tx_msg(get_be16(data + 2));
+#ifdef CMD_COMPLETE_CHECK
+    if (bdmcf_complete_chk_rx())
+    {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* reads the CSR without the status bits for bdmcf_go(), from the shadow when it is there */
+/* returns 0 on success and non-zero on error */
+uint8_t bdmcf_read_csr(uint32_t *csr)
+{
+    uint8_t data[4];
+
+    if (bdmcf_read_dmreg(0, data))
+    {
+        return 1;
+    }
+    *csr = get_be32(data) & BDMCF_CSR_STATIC_MASK;
+    return 0;
+}
+
+/* keeps the CSR written by bdmcf_go() for the next single step */
+void bdmcf_shadow_csr(uint32_t csr)
+{
+    shadow_dmreg[0] = csr & BDMCF_CSR_STATIC_MASK;
+    shadow_dmreg_valid |= 1;
+}
+
+/* stores the 32-bit hit & miss counts of the shadow into data, clears them if clear is non-zero */
+void bdmcf_shadow_stats(uint8_t clear, uint8_t *data)
+{
+    put_be32(data, shadow_hits);
+    put_be32(data + 4, shadow_misses);
+    if (clear)
+    {
+        shadow_hits = 0;
+        shadow_misses = 0;
+    }
+}
@@ -0,0 +1,317 @@
+/*
+ * bdmcf_spi.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * BDM Tx/Rx functions using the SPI0 module instead of bit-banging.
+ *
+ * The BDM signals are expected on the SPI0 pins for this transport:
+ *
+ * DSCLK:       PTC5 (PIN 13)       SPI0_SCK (shared with the LED)
+ * DSI:         PTC7 (PIN 12)       SPI0_SIN  <-- DSO of the target
+ * DSO:         PTC6 (PIN 11)       SPI0_SOUT --> DSI of the target
+ *
+ * Speeds BDMCF_SPEED_SPI and up select the DSCLK rate from bdmcf_spi_ctar[], CMD_SET_TARGET negotiates
+ * the fastest one the target takes. The LED on PTC5 loads DSCLK, which may limit the fastest rates.
+ *
+ * A 17 bit message is shifted as a 9 bit frame (status bit + MSB, CTAR0) followed by an 8 bit frame (LSB, CTAR1)
+ * with continuous chip select. The modified transfer format (MTFE) moves the sample point of the master
+ * after the falling edge of SCK which is when the target presents its next bit.
+ * Block transfers prepare the PUSHR words in RAM and let eDMA channel 1 feed the Tx FIFO while
+ * channel 0 empties the Rx FIFO, the CPU only waits for the end of the major loop. A transfer never
+ * goes past a message whose answer decides what to send next: the target ignores a message it answers
+ * not ready, so the data of a FILL must not go out before the FILL has been taken, otherwise the target
+ * would take the data words for commands.
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+
+#define BDMCF_SPI_MAX_FRAMES    3                                       /* largest transfer: a dword & the next FILL32 */
+
+#define DMAMUX_SPI0_RX          14
+#define DMAMUX_SPI0_TX          15
+
+#define BDMCF_SPI_PUSHR_MSB(cmd)    (SPI_PUSHR_CONT_MASK | SPI_PUSHR_CTAS(0) | (((cmd) >> 8) & 0xff))
+#define BDMCF_SPI_PUSHR_LSB(cmd)    (SPI_PUSHR_CTAS(1) | ((cmd) & 0xff))
+
+/* DSCLK rate of each SPI0 speed: 48MHz bus / PBR prescaler / BR scaler, slowest first */
+static const uint32_t bdmcf_spi_ctar[BDMCF_SPEEDS - BDMCF_SPEED_SPI] =
+{
+    SPI_CTAR_PBR(1) | SPI_CTAR_BR(4),   /* 48MHz / 3 / 16 = 1MHz */
+    SPI_CTAR_PBR(1) | SPI_CTAR_BR(3),   /* 48MHz / 3 / 8 = 2MHz */
+    SPI_CTAR_PBR(1) | SPI_CTAR_BR(1),   /* 48MHz / 3 / 4 = 4MHz */
+    SPI_CTAR_PBR(0) | SPI_CTAR_BR(1),   /* 48MHz / 2 / 4 = 6MHz */
+    SPI_CTAR_PBR(1) | SPI_CTAR_BR(0),   /* 48MHz / 3 / 2 = 8MHz */
+    SPI_CTAR_PBR(0) | SPI_CTAR_BR(0),   /* 48MHz / 2 / 2 = 12MHz */
+};
+
+static uint32_t spi_tx[2 * BDMCF_SPI_MAX_FRAMES];
+static uint16_t spi_rx[2 * BDMCF_SPI_MAX_FRAMES];
+
+/* routes DSCLK, DSI and DSO to SPI0 and sets up the module for the rate of bdmcf_speed and the DMA channels */
+void bdmcf_init_spi(void)
+{
+    uint32_t ctar = bdmcf_spi_ctar[bdmcf_speed - BDMCF_SPEED_SPI];
+
+    SIM_SCGC6 |= SIM_SCGC6_SPI0_MASK | SIM_SCGC6_DMAMUX_MASK;
+    SIM_SCGC7 |= SIM_SCGC7_DMA_MASK;
+
+    GPIOA_PDDR &= ~(1 << 12);           /* release the pins of the GPIO transport */
+    GPIOD_PDDR &= ~(1 << 7);
+    PORTA_PCR12 = PORT_PCR_MUX(0x0);
+    PORTA_PCR13 = PORT_PCR_MUX(0x0);
+    PORTD_PCR7 = PORT_PCR_MUX(0x0);
+
+    PORTC_PCR5 = PORT_PCR_MUX(0x2) | PORT_PCR_DSE_MASK;     /* SPI0_SCK */
+    PORTC_PCR6 = PORT_PCR_MUX(0x2) | PORT_PCR_DSE_MASK;     /* SPI0_SOUT */
+    PORTC_PCR7 = PORT_PCR_MUX(0x2);                         /* SPI0_SIN */
+
+    SPI0_MCR = SPI_MCR_MSTR_MASK | SPI_MCR_MTFE_MASK | SPI_MCR_HALT_MASK
+             | SPI_MCR_CLR_TXF_MASK | SPI_MCR_CLR_RXF_MASK;
+    SPI0_CTAR0 = SPI_CTAR_FMSZ(8) | ctar;                   /* 9 bits: status + MSB */
+    SPI0_CTAR1 = SPI_CTAR_FMSZ(7) | ctar;                   /* 8 bits: LSB */
+    SPI0_RSER = 0;
+    SPI0_SR = SPI0_SR;                                      /* clear all flags */
+    SPI0_MCR &= ~SPI_MCR_HALT_MASK;
+
+    DMAMUX_CHCFG0 = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(DMAMUX_SPI0_RX);
+    DMAMUX_CHCFG1 = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(DMAMUX_SPI0_TX);
+}
+
+/* transmits and receives one 17 bit message, the received status bit is returned in bit 16 */
+uint32_t bdmcf_txrx17_spi(uint32_t mess)
+{
+    uint32_t res;
+
+    SPI0_PUSHR = BDMCF_SPI_PUSHR_MSB(mess);
+    SPI0_PUSHR = BDMCF_SPI_PUSHR_LSB(mess);
+    while (((SPI0_SR & SPI_SR_RXCTR_MASK) >> SPI_SR_RXCTR_SHIFT) < 2)
+    {
+        ;
+    }
+    res = (SPI0_POPR & 0x1ff) << 8;
+    res |= SPI0_POPR & 0xff;
+    SPI0_SR = SPI_SR_TCF_MASK | SPI_SR_RFDF_MASK;
+
+    return res;
+}
+
+/* transmits and receives an arbitrary number of bits (up to 32) */
+/* the SPI module cannot shift less than 4 bits, so the pins are bit-banged for this (only used during resync) */
+uint32_t bdmcf_txrx_bits_spi(uint32_t mess, uint8_t bits)
+{
+    uint32_t res = 0;
+    uint32_t mask = 1 << (bits - 1);
+    volatile uint32_t i;
+
+    GPIOC_PCOR = (1 << 5) | (1 << 6);
+    GPIOC_PDDR = (GPIOC_PDDR | (1 << 5) | (1 << 6)) & ~(1 << 7);
+    PORTC_PCR5 = PORT_PCR_MUX(0x1) | PORT_PCR_DSE_MASK;
+    PORTC_PCR6 = PORT_PCR_MUX(0x1) | PORT_PCR_DSE_MASK;
+    PORTC_PCR7 = PORT_PCR_MUX(0x1);
+
+    do
+    {
+        if (mess & mask)
+            GPIOC_PSOR = (1 << 6);
+        else
+            GPIOC_PCOR = (1 << 6);
+        for (i = 0; i < BDMCF_DELAY_4; i++);
+        GPIOC_PSOR = (1 << 5);          /* rising edge on DSCLK */
+        for (i = 0; i < BDMCF_DELAY_4; i++);
+        GPIOC_PCOR = (1 << 5);          /* falling edge on DSCLK */
+        res <<= 1;
+        if (GPIOC_PDIR & (1 << 7))
+            res |= 1;
+        mask >>= 1;
+    } while (mask);
+
+    GPIOC_PCOR = (1 << 6);
+    PORTC_PCR5 = PORT_PCR_MUX(0x2) | PORT_PCR_DSE_MASK;     /* back to SPI0 */
+    PORTC_PCR6 = PORT_PCR_MUX(0x2) | PORT_PCR_DSE_MASK;
+    PORTC_PCR7 = PORT_PCR_MUX(0x2);
+
+    return res;
+}
+
+/* puts a 17 bit message into the DMA Tx buffer */
+static inline void bdmcf_spi_frame(uint16_t frame, unsigned int cmd)
+{
+    spi_tx[2 * frame] = BDMCF_SPI_PUSHR_MSB(cmd);
+    spi_tx[2 * frame + 1] = BDMCF_SPI_PUSHR_LSB(cmd);
+}
+
+/* shifts the prepared messages through SPI0 by DMA and waits until the last one has been received */
+static void bdmcf_spi_dma(uint16_t frames)
+{
+    uint16_t n = 2 * frames;
+    uint32_t start = CYCCNT();
+    uint16_t f;
+
+    DMA_TCD0_SADDR = (uint32_t) &SPI0_POPR;                 /* channel 0: Rx FIFO -> spi_rx */
+    DMA_TCD0_SOFF = 0;
+    DMA_TCD0_ATTR = DMA_ATTR_SSIZE(1) | DMA_ATTR_DSIZE(1);
+    DMA_TCD0_NBYTES_MLNO = 2;
+    DMA_TCD0_SLAST = 0;
+    DMA_TCD0_DADDR = (uint32_t) spi_rx;
+    DMA_TCD0_DOFF = 2;
+    DMA_TCD0_CITER_ELINKNO = n;
+    DMA_TCD0_BITER_ELINKNO = n;
+    DMA_TCD0_DLASTSGA = 0;
+    DMA_TCD0_CSR = DMA_CSR_DREQ_MASK;
+
+    DMA_TCD1_SADDR = (uint32_t) spi_tx;                     /* channel 1: spi_tx -> Tx FIFO */
+    DMA_TCD1_SOFF = 4;
+    DMA_TCD1_ATTR = DMA_ATTR_SSIZE(2) | DMA_ATTR_DSIZE(2);
+    DMA_TCD1_NBYTES_MLNO = 4;
+    DMA_TCD1_SLAST = 0;
+    DMA_TCD1_DADDR = (uint32_t) &SPI0_PUSHR;
+    DMA_TCD1_DOFF = 0;
+    DMA_TCD1_CITER_ELINKNO = n;
+    DMA_TCD1_BITER_ELINKNO = n;
+    DMA_TCD1_DLASTSGA = 0;
+    DMA_TCD1_CSR = DMA_CSR_DREQ_MASK;
+
+    SPI0_SR = SPI0_SR;
+    SPI0_RSER = SPI_RSER_RFDF_RE_MASK | SPI_RSER_RFDF_DIRS_MASK | SPI_RSER_TFFF_RE_MASK | SPI_RSER_TFFF_DIRS_MASK;
+    DMA_SERQ = 0;
+    DMA_SERQ = 1;
+
+    while ((DMA_TCD0_CSR & DMA_CSR_DONE_MASK) == 0)
+    {
+        ;
+    }
+
+    SPI0_RSER = 0;
+    DMA_CDNE = 0;
+    DMA_CDNE = 1;
+
+    if (bdmcf_trace_on)
+    {
+        uint32_t duration = CYCCNT() - start;
+
+        for (f = 0; f < frames; f++)
+        {
+            bdmcf_trace_frame(start, duration, ((spi_tx[2 * f] & 0xff) << 8) | (spi_tx[2 * f + 1] & 0xff),
+                              (spi_rx[2 * f] << 8) | spi_rx[2 * f + 1], TRACE_DMA);
+        }
+    }
+}
+
+/* receives count elements of 'words' 17 bit messages each (1 = 8/16 bit, 2 = 32 bit), one DMA transfer per element */
+/* the data is stored MSB of the first message first, like bdmcf_rxtx() does */
+/* next_cmd goes out with the last message of each element but the last one, which is followed by a NOP */
+/* a message answered not ready is ignored and the target takes a command only with the last word of a result, */
+/* so the words missing after a not ready are read with bdmcf_rxtx(), which repeats the message until they come */
+/* returns non-zero on error (bus error, illegal command or retries exhausted) */
+uint8_t bdmcf_spi_dump(uint8_t count, uint8_t words, uint8_t *data, unsigned int next_cmd)
+{
+    unsigned int cmd;
+    uint32_t mess;
+    uint8_t received;
+    uint8_t f;
+
+    if (count == 0 || words > BDMCF_SPI_MAX_FRAMES)
+    {
+        return 1;
+    }
+
+    while (count--)
+    {
+        cmd = count ? next_cmd : BDMCF_CMD_NOP;
+        for (f = 0; f < words; f++)
+        {
+            bdmcf_spi_frame(f, (f == words - 1) ? cmd : BDMCF_CMD_NOP);
+        }
+
+        bdmcf_spi_dma(words);
+
+        received = 0;
+        for (f = 0; f < words; f++)
+        {
+            mess = (spi_rx[2 * f] << 8) | spi_rx[2 * f + 1];
+            if (BDMCF_STATUS(mess))
+            {
+                if ((mess & 0xffff) != 0x0000)
+                {
+                    bdmcf_bus_error |= BDMCF_BUS_ERROR(mess);
+                    return 1;
+                }
+                continue;               /* not ready, the message has been ignored */
+            }
+            *(data++) = mess >> 8;
+            *(data++) = mess;
+            received++;
+        }
+        if (received < words)
+        {
+            if (bdmcf_rxtx(words - received, data, cmd))
+            {
+                return 1;
+            }
+            data += 2 * (words - received);
+        }
+    }
+
+    return 0;
+}
+
+/* transmits count elements of 'words' 17 bit messages each (1 = 8/16 bit, 2 = 32 bit) by DMA */
+/* each element is preceded by fill_cmd, its status acknowledges the previous write (see bdmcf_fill()) */
+/* the data of an element goes out only once its fill_cmd has been taken, together with the next fill_cmd, */
+/* which is repeated like bdmcf_fill() does while the target answers not ready */
+/* returns non-zero on error (bus error, illegal command or retries exhausted) */
+uint8_t bdmcf_spi_fill(uint8_t count, uint8_t words, uint8_t *data, unsigned int fill_cmd)
+{
+    uint32_t mess;
+    uint8_t f = 0;
+    uint8_t i;
+
+    if (count == 0 || words + 1 > BDMCF_SPI_MAX_FRAMES)
+    {
+        return 1;
+    }
+
+    while (count--)
+    {
+        bdmcf_spi_frame(f, fill_cmd);
+        bdmcf_spi_dma(f + 1);           /* the data of the previous element & this fill_cmd */
+
+        i = BDMCF_RETRY;
+        mess = (spi_rx[2 * f] << 8) | spi_rx[2 * f + 1];
+        while (BDMCF_STATUS(mess))
+        {
+            if (((mess & 0xffff) != 0x0000) || ((i--) == 0))
+            {
+                bdmcf_bus_error |= BDMCF_BUS_ERROR(mess);
+                return 1;
+            }
+            mess = bdmcf_txrx17_ptr(fill_cmd);
+        }
+
+        for (f = 0; f < words; f++, data += 2)
+        {
+            bdmcf_spi_frame(f, (*data << 8) | *(data + 1));
+        }
+    }
+
+    bdmcf_spi_dma(words);               /* the data of the last element */
+    return 0;
+}
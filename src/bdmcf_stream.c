@@ -0,0 +1,264 @@
+/*
+ * bdmcf_stream.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Memory transfers larger than a single command (MAX_DATA_SIZE).
+ *
+ * CMD_STREAM_READ/CMD_STREAM_WRITE set up a transfer of any number of dwords. The BDM side runs from the
+ * main loop (bdmcf_stream_poll()) and keeps a single READ32/WRITE32 going with DUMP32/FILL32, so the target
+ * increments the address itself. The host side moves the data with CMD_STREAM_DATA through a ring buffer:
+ * reads are dumped ahead until the ring is full, writes are filled in as soon as data is in the ring. A full
+ * (write) or empty (read) ring is reported as STREAM_BUSY and the host simply tries again.
+ * The last CMD_STREAM_DATA response carries a trailer with the number of bytes transferred over BDM and
+ * their CRC-32.
+ *
+ * The ring indices run freely, each one is only written by one side (command processing or the main loop).
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+#include "crc32.h"
+#include "rle.h"
+
+#define BDMCF_STREAM_BUF_SIZE   2048                        /* must be a power of two */
+#define BDMCF_STREAM_BUF_MASK   (BDMCF_STREAM_BUF_SIZE - 1)
+
+static uint8_t stream_buf[BDMCF_STREAM_BUF_SIZE];
+static volatile uint32_t stream_head;       /* next byte to put into the ring */
+static volatile uint32_t stream_tail;       /* next byte to take out of the ring */
+
+static volatile uint8_t stream_state = BDMCF_STREAM_IDLE;
+static volatile uint8_t stream_abort;
+static uint8_t stream_write;                /* direction of the current (or just finished) stream */
+static uint8_t stream_rle;                  /* read data goes to the host run length encoded */
+static uint8_t stream_error;
+static uint8_t stream_first;                /* WRITE32 + address still to be sent */
+static uint32_t stream_address;
+static uint32_t stream_length;              /* total number of bytes of the stream */
+static uint32_t stream_accepted;            /* bytes of a write stream received from the host so far */
+static volatile uint32_t stream_remaining;  /* bytes still to be transferred over BDM */
+static uint32_t stream_crc;
+
+/* sets up a stream of length bytes (a multiple of 4) from/to address, flags see STREAM_x */
+/* returns 0 on success and non-zero if a stream is already running or the length is not usable */
+uint8_t bdmcf_stream_start(uint8_t write, uint32_t address, uint32_t length, uint8_t flags)
+{
+    if ((stream_state != BDMCF_STREAM_IDLE) || (length == 0) || (length & 3))
+    {
+        return 1;
+    }
+
+    stream_head = 0;
+    stream_tail = 0;
+    stream_abort = 0;
+    stream_error = 0;
+    stream_write = write;
+    stream_rle = !write && (flags & STREAM_RLE);
+    stream_address = address;
+    stream_length = length;
+    stream_accepted = 0;
+    stream_remaining = length;
+    stream_crc = 0;
+
+    if (write)
+    {
+        stream_first = 1;                   /* WRITE32 goes out together with the first dword */
+        stream_state = BDMCF_STREAM_WRITE;
+        bdmcf_cache_invalidate();
+    }
+    else
+    {
+        bdmcf_tx_msg(BDMCF_CMD_READ32);     /* the first dword is read, the rest dumped */
+        bdmcf_tx_msg(address >> 16);
+        bdmcf_tx_msg(address & 0xffff);
+        stream_state = BDMCF_STREAM_READ;
+    }
+    return 0;
+}
+
+/* returns the state of the stream, BDMCF_STREAM_IDLE when none is set up */
+uint8_t bdmcf_stream_active(void)
+{
+    return stream_state;
+}
+
+/* returns non-zero when the running stream writes to the target */
+uint8_t bdmcf_stream_writing(void)
+{
+    return stream_write;
+}
+
+/* requests the stream to be dropped, the BDM is purged from the main loop */
+void bdmcf_stream_abort(void)
+{
+    if (stream_state != BDMCF_STREAM_IDLE)
+    {
+        stream_abort = 1;
+    }
+}
+
+/* takes up to max bytes (a multiple of 4) read from the target out of the ring, returns the number of bytes copied */
+uint8_t bdmcf_stream_get(uint8_t *data, uint8_t max)
+{
+    uint32_t tail = stream_tail;
+    uint32_t used = stream_head - tail;
+    uint32_t consumed;
+    uint8_t i;
+
+    if (stream_rle)
+    {
+        i = rle_encode(stream_buf, BDMCF_STREAM_BUF_MASK, tail, used, data, max, &consumed);
+        stream_tail = tail + consumed;
+        return i;
+    }
+    if (used > max)
+    {
+        used = max;
+    }
+    for (i = 0; i < used; i++)
+    {
+        data[i] = stream_buf[(tail + i) & BDMCF_STREAM_BUF_MASK];
+    }
+    stream_tail = tail + used;
+    return used;
+}
+
+/* puts len bytes (a multiple of 4) to be written to the target into the ring */
+/* returns 0 when the data was accepted, 1 when the ring has no room (try again later) and 2 on error */
+uint8_t bdmcf_stream_put(uint8_t *data, uint8_t len)
+{
+    uint32_t head = stream_head;
+    uint8_t i;
+
+    if ((stream_state != BDMCF_STREAM_WRITE) || (len & 3) || (stream_accepted + len > stream_length))
+    {
+        return 2;
+    }
+    if (BDMCF_STREAM_BUF_SIZE - (head - stream_tail) < len)
+    {
+        return 1;
+    }
+    for (i = 0; i < len; i++)
+    {
+        stream_buf[(head + i) & BDMCF_STREAM_BUF_MASK] = data[i];
+    }
+    stream_accepted += len;
+    stream_head = head + len;
+    return 0;
+}
+
+/* returns STREAM_MORE while the stream is running, STREAM_DONE or STREAM_ERROR once it has finished */
+/* in the latter case the 32-bit byte count and CRC-32 are stored into trailer and the stream is closed */
+uint8_t bdmcf_stream_status(uint8_t *trailer)
+{
+    if ((stream_state != BDMCF_STREAM_END) || (stream_head != stream_tail))
+    {
+        return STREAM_MORE;                 /* still busy or read data not collected yet */
+    }
+    put_be32(trailer, stream_length - stream_remaining);
+    put_be32(trailer + 4, stream_crc);
+    stream_state = BDMCF_STREAM_IDLE;
+    return stream_error ? STREAM_ERROR : STREAM_DONE;
+}
+
+/* drives the BDM side of a stream, to be called from the main loop */
+void bdmcf_stream_poll(void)
+{
+    uint8_t data[4];
+    uint8_t *ptr;
+
+    if (stream_abort)
+    {
+        if (stream_state != BDMCF_STREAM_END)
+        {
+            bdmcf_complete_chk_rx();        /* send at least 2 nops to purge the BDM of the pending command */
+            bdmcf_complete_chk_rx();
+        }
+        stream_abort = 0;
+        stream_state = BDMCF_STREAM_IDLE;
+        return;
+    }
+
+    if (stream_state == BDMCF_STREAM_READ)
+    {
+        while (stream_remaining && (BDMCF_STREAM_BUF_SIZE - (stream_head - stream_tail) >= 4) && !stream_abort)
+        {
+            /* get the result & send in the next DUMP command, NOP after the last dword */
+            if (bdmcf_rxtx(2, data, (stream_remaining > 4) ? BDMCF_CMD_DUMP32 : BDMCF_CMD_NOP))
+            {
+                stream_error = 1;
+                break;
+            }
+            ptr = stream_buf + (stream_head & BDMCF_STREAM_BUF_MASK);   /* dwords never wrap in the ring */
+            ptr[0] = data[0];
+            ptr[1] = data[1];
+            ptr[2] = data[2];
+            ptr[3] = data[3];
+            stream_crc = crc32_update(stream_crc, data, 4);
+            stream_remaining -= 4;
+            stream_head += 4;
+        }
+    }
+    else if (stream_state == BDMCF_STREAM_WRITE)
+    {
+        while ((stream_head - stream_tail >= 4) && !stream_abort)
+        {
+            ptr = stream_buf + (stream_tail & BDMCF_STREAM_BUF_MASK);
+            if (stream_first)
+            {
+                bdmcf_tx_msg(BDMCF_CMD_WRITE32);
+                bdmcf_tx_msg(stream_address >> 16);
+                bdmcf_tx_msg(stream_address & 0xffff);
+                bdmcf_tx(2, ptr);
+                stream_first = 0;
+            }
+            else if (bdmcf_fill(1, 4, ptr, BDMCF_CMD_FILL32))
+            {
+                stream_error = 1;
+                break;
+            }
+            stream_crc = crc32_update(stream_crc, ptr, 4);
+            stream_remaining -= 4;
+            stream_tail += 4;
+        }
+        if ((stream_remaining == 0) && !stream_error && bdmcf_complete_chk_rx())
+        {
+            stream_error = 1;               /* the last write has not completed */
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    if (stream_error)
+    {
+        bdmcf_complete_chk_rx();            /* send at least 2 nops to purge the BDM of the offending command */
+        bdmcf_complete_chk_rx();
+        if (stream_write)
+        {
+            stream_tail = stream_head;      /* nothing more goes to the target, data already read is still delivered */
+        }
+    }
+    if (stream_error || (stream_remaining == 0))
+    {
+        stream_state = BDMCF_STREAM_END;
+    }
+}
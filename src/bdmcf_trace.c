@@ -0,0 +1,123 @@
+/*
+ * bdmcf_trace.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Trace of the 17 bit BDM messages (CMD_TRACE_CONTROL, CMD_TRACE_DRAIN).
+ *
+ * While the trace is on bdmcf_txrx17_ptr points to bdmcf_txrx17_trace(), which calls the Tx/Rx function
+ * of the selected speed and records the message sent, the one received and the core cycle counter
+ * before and after it. Switching the trace off puts the plain function back, so it costs nothing then.
+ * Blocks moved by DMA (bdmcf_spi.c) are recorded once they are complete, all messages of a block get the
+ * start time and the duration of the whole block.
+ * Messages are dropped and counted once the ring is full, the host is expected to drain it often enough.
+ */
+
+#include "bdmcf.h"
+#include "commands.h"
+#include "cmd_processing.h"
+
+#define BDMCF_TRACE_ENTRIES     256     /* must be a power of two */
+
+typedef struct
+{
+    uint32_t cycles;                    /* cycle counter when the message started */
+    uint16_t duration;                  /* in cycles, 0xffff if it took longer */
+    uint16_t tx;
+    uint16_t rx;
+    uint8_t flags;                      /* TRACE_x */
+} trace_entry_t;
+
+uint8_t bdmcf_trace_on;
+
+static trace_entry_t trace_ring[BDMCF_TRACE_ENTRIES];
+static uint16_t trace_head;             /* next entry to write */
+static uint16_t trace_tail;             /* next entry to drain */
+static uint16_t trace_lost;             /* messages dropped since the last drain */
+
+/* appends a message to the ring, cycles is when it started and duration how long it took */
+void bdmcf_trace_frame(uint32_t cycles, uint32_t duration, uint16_t tx, uint32_t rx, uint8_t flags)
+{
+    trace_entry_t *entry;
+
+    if ((uint16_t) (trace_head - trace_tail) == BDMCF_TRACE_ENTRIES)
+    {
+        if (trace_lost < 0xffff)
+        {
+            trace_lost++;
+        }
+        return;
+    }
+
+    entry = &trace_ring[trace_head & (BDMCF_TRACE_ENTRIES - 1)];
+    entry->cycles = cycles;
+    entry->duration = (duration > 0xffff) ? 0xffff : duration;
+    entry->tx = tx;
+    entry->rx = rx;
+    entry->flags = flags | (BDMCF_STATUS(rx) ? TRACE_STATUS : 0);
+    trace_head++;
+}
+
+/* sends & receives one 17 bit message with the function of the selected speed and records it */
+uint32_t bdmcf_txrx17_trace(uint32_t mess)
+{
+    uint32_t start = CYCCNT();
+    uint32_t res = bdmcf_txrx17_ptrs[bdmcf_speed](mess);
+
+    bdmcf_trace_frame(start, CYCCNT() - start, mess, res, 0);
+    return res;
+}
+
+/* empties the ring and switches the trace on (on != 0) or off */
+void bdmcf_trace_enable(uint8_t on)
+{
+    trace_head = 0;
+    trace_tail = 0;
+    trace_lost = 0;
+    bdmcf_trace_on = on;
+    bdmcf_txrx17_ptr = on ? bdmcf_txrx17_trace : bdmcf_txrx17_ptrs[bdmcf_speed];
+}
+
+/* moves up to BDMCF_TRACE_DRAIN of the oldest messages into data: 8-bit count, 16-bit number of messages */
+/* lost since the last drain & per message 32-bit cycle counter, 16-bit duration, 16-bit message sent, */
+/* 16-bit message received & 8-bit flags */
+/* returns the number of bytes stored */
+uint8_t bdmcf_trace_drain(uint8_t *data)
+{
+    trace_entry_t *entry;
+    uint8_t count = 0;
+    uint8_t *p = data + 3;
+
+    while ((trace_tail != trace_head) && (count < BDMCF_TRACE_DRAIN))
+    {
+        entry = &trace_ring[trace_tail & (BDMCF_TRACE_ENTRIES - 1)];
+        put_be32(p, entry->cycles);
+        put_be16(p + 4, entry->duration);
+        put_be16(p + 6, entry->tx);
+        put_be16(p + 8, entry->rx);
+        p[10] = entry->flags;
+        p += BDMCF_TRACE_ENTRY_SIZE;
+        trace_tail++;
+        count++;
+    }
+
+    data[0] = count;
+    put_be16(data + 1, trace_lost);
+    trace_lost = 0;
+    return p - data;
+}
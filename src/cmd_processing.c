@@ -21,16 +21,131 @@
 #include "commands.h"
 #include "cmd_processing.h"
 #include "version.h"
+#include "xstring.h"
+#include "events.h"
 #include <stdint.h>
 
 cable_status_t cable_status;
 
+#define BATCH_RESULT_MAX    10  /* longest result of a sub-command which does not state its result length (CMD_STEP_N) */
+
+static uint8_t batch_in[MAX_DATA_SIZE];         /* the sub-commands, the results are built in the command buffer */
+static uint8_t batch_cmd[2 + MAX_DATA_SIZE];    /* status, command & parameters of a single sub-command */
+
+/* returns non-zero for the commands whose result length is neither fixed nor set by the bytes requested */
+static uint8_t batch_unbounded(uint8_t cmd)
+{
+    switch (cmd)
+    {
+        case CMD_BATCH:                         /* no nesting */
+        case CMD_STREAM_DATA:
+        case CMD_FLASH_STATUS:
+        case CMD_GET_EVENTS:
+        case CMD_SEARCH_MEM:
+        case CMD_TRACE_DRAIN:
+            return 1;
+    }
+    return 0;
+}
+
+/* returns non-zero for the commands reading data which take more than the 4 parameter bytes of an EP0 IN request */
+static uint8_t command_bulk_only(uint8_t cmd, uint32_t command_size)
+{
+    switch (cmd)
+    {
+        case CMD_BATCH:
+        case CMD_CRC32_MEMBLOCK:
+        case CMD_STEP_N:
+        case CMD_BREAKPOINT:
+        case CMD_SEARCH_MEM:
+        case CMD_READ_MEMBLOCK_RLE:
+        case CMD_WRITE_MEMBLOCK_DIFF:
+            return 1;
+        case CMD_READ_CONTEXT:              /* wValue & wIndex hold 2 control register addresses */
+            return (command_size >= BDMCF_CONTEXT_SIZE) && (((command_size - BDMCF_CONTEXT_SIZE) >> 2) > 2);
+    }
+    return 0;
+}
+
+/* executes the sub-commands of CMD_BATCH back to back and puts their results behind each other */
+/* each sub-command is: 8-bit parameter count, 8-bit result length (as requested by the host, 0 unless */
+/* the command reads data), the command number and the parameters */
+/* returns the response length: CMD_BATCH, 8-bit number of sub-commands executed & the results */
+static uint8_t command_batch(uint8_t *command_buffer, uint32_t command_size)
+{
+    uint8_t *in = batch_in;
+    uint8_t *end;
+    uint8_t *out = command_buffer + 2;
+    uint8_t flags = command_buffer[2];
+    uint8_t count = 0;
+    uint8_t cmd;
+    uint8_t params;
+    uint8_t result;
+    uint8_t length;
+
+    if ((command_size < 1) || (command_size > MAX_DATA_SIZE))
+    {
+        command_buffer[0] = CMD_FAILED;
+        return 1;
+    }
+    memcpy(batch_in, command_buffer + 3, command_size - 1);   /* the results overwrite the sub-commands */
+    end = batch_in + command_size - 1;
+
+    while (in + 3 <= end)
+    {
+        params = in[0];
+        result = in[1];
+        cmd = in[2];
+        if (in + 3 + params > end)
+        {
+            break;                              /* truncated sub-command */
+        }
+        if (out + (result ? result : BATCH_RESULT_MAX) > command_buffer + 1 + MAX_DATA_SIZE)
+        {
+            break;                              /* the result would not fit, do not execute the rest */
+        }
+
+        batch_cmd[1] = cmd;
+        memcpy(batch_cmd + 2, in + 3, params);
+        if (batch_unbounded(cmd))
+        {
+            batch_cmd[0] = CMD_FAILED;          /* the result might not fit */
+            length = 1;
+        }
+        else
+        {
+            length = command_exec(batch_cmd, result ? result - 1 : params, TRANSPORT_BULK);
+        }
+        if (out + length > command_buffer + 1 + MAX_DATA_SIZE)
+        {
+            *(out++) = CMD_FAILED;              /* executed, but the result does not fit, stop here */
+            count++;
+            break;
+        }
+        memcpy(out, batch_cmd, length);
+        out += length;
+        in += 3 + params;
+        count++;
+
+        if ((flags & BATCH_STOP_ON_ERROR) && (batch_cmd[0] != cmd))
+        {
+            break;
+        }
+    }
+    command_buffer[1] = count;
+    return out - command_buffer;
+}
+
 
 /* processes all commands received over USB */
 /* the command is expected to be in command_buffer+1  */
+/* transport tells how the command arrived, the commands needing more parameters than an EP0 IN request carries fail */
 /* returns number of bytes left in the buffer (at position command_buffer+0) to be sent back as response */
-uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
+uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size, transport_e transport)
 {
+    uint32_t param = get_be32(command_buffer + 2);  /* for EVENT_BUS_ERROR, results may overwrite it */
+    uint8_t cached;
+
     // led_state = LED_BLINK;                          /* blink the LED to indicate a command */
     if (command_buffer[1] == CMD_GET_LAST_STATUS)
     {
@@ -38,12 +153,17 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
         return 1;
     }
     command_buffer[0] = command_buffer[1];      /* assume the command will execute OK */
+    if ((transport == TRANSPORT_EP0_IN) && command_bulk_only(command_buffer[1], command_size))
+    {
+        command_buffer[0] = CMD_FAILED;         /* the parameters past wValue & wIndex are missing */
+        return 1;
+    }
 
     switch (command_buffer[1])
     {
         /* commands which execute the same way irrespective of selected target type */
         case CMD_GET_VER:                         /* get HW & SW version */
-            *((unsigned int *)(command_buffer + 1)) = VERSION;
+            put_be16(command_buffer + 1, VERSION);
             return 3;                              /* return cmd + 2 bytes of version */
 
         case CMD_SET_TARGET:                      /* set target type */
@@ -51,9 +171,15 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
             if (cable_status.target_type == CF_BDM)
             {
                 bdmcf_init();                         /* initialise the BDM interface */
-                bdmcf_resync();                       /* synchronize with the target */
-
-                return 1;
+                /* synchronize with the target at the fastest speed of the selected transport it can handle */
+                if (bdmcf_negotiate_speed(command_buffer + 2))
+                {
+                    command_buffer[0] = CMD_FAILED;   /* the target did not answer at any speed, still report the probes */
+                    command_buffer[1] = 0xff;
+                    return 3;
+                }
+                command_buffer[1] = bdmcf_speed;
+                return 3;
             }
             if (cable_status.target_type == JTAG)
             {
@@ -83,6 +209,7 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
             return 1;
 
         case CMD_GET_STATUS:                      /* returns 16-bit status of the cable; bit0 - target reset detected, bit1 - current state of the RSTO pin */
+            rsto_poll();                            /* take the edges recorded so far */
             command_buffer[1] = 0;									  /* the PCB has a pull-down on the input, so only trust that RSTO is low if an edge was detected */
             command_buffer[2] = 0;									  /* cannot put a pull-up on the pin as the single layer PCB is too tight to allow it */
             if (cable_status.reset == RESET_DETECTED)
@@ -102,6 +229,21 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
             }
 #endif
             return 3;
+        case CMD_GET_EVENTS:                    /* returns 8-bit number of events & the events */
+            {
+                uint8_t i = 0;
+
+                while ((2 + (i + 1) * EVENT_SIZE <= 1 + MAX_DATA_SIZE) && event_pop(command_buffer + 2 + i * EVENT_SIZE))
+                {
+                    i++;
+                }
+                command_buffer[1] = i;
+                return 2 + i * EVENT_SIZE;
+            }
+
+        case CMD_BATCH:                         /* parameters 8-bit flags & the sub-commands, returns 8-bit number of sub-commands executed & their results */
+            return command_batch(command_buffer, command_size);
+
 #ifdef STACK_SIZE_EVALUATION
 
         case CMD_GET_STACK_SIZE:                /* parameters: none, returns 16-bit stack size required by the application so far */
@@ -112,14 +254,20 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                 {
                     ptr++;
                 }
-                *((unsigned int *)(command_buffer + 1)) = (uint8_t *) __SEG_END_SSTACK - ptr;
+                put_be16(command_buffer + 1, (uint8_t *) __SEG_END_SSTACK - ptr);
             }
-            return 2;
+            return 3;
 #endif
         default:
             if (cable_status.target_type == CF_BDM)
             {
+                if (bdmcf_stream_active() && ((command_buffer[1] < CMD_STREAM_READ) || (command_buffer[1] > CMD_STREAM_ABORT)))
+                {
+                    command_buffer[0] = CMD_FAILED;     /* the BDM belongs to the stream until it is finished or aborted */
+                    return 1;
+                }
                 /* commands which execute depending on the selected target type */
+                bdmcf_bus_error = 0;
                 switch (command_buffer[1])
                 {
                     case CMD_HALT:                        /* stop execution of user code by asserting the BKPT line; no parameters */
@@ -127,115 +275,89 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                         return 1;
 
                     case CMD_GO:                          /* start code execution from current PC address; no parameters */
-                        bdmcf_tx_msg(BDMCF_CMD_RDMREG);     /* get CSR */
-                        if (bdmcf_rx(2, command_buffer + 12))
-                            break; /* CSR is received into command_data+12,+13,+14,+15 */
-                        *(command_buffer + 15) &= ~0x10;        /* clear the SSM bit */
-                        *((unsigned int *)(command_buffer+10)) = BDMCF_CMD_WDMREG;
-                        bdmcf_tx(3, command_buffer + 10);			/* write the CSR back */
-                        if (bdmcf_complete_chk(BDMCF_CMD_GO))
-                            break; /* GO */
-#ifdef CMD_COMPLETE_CHECK
-                        if (bdmcf_complete_chk_rx())
+                        if (bdmcf_go(0))
                             break;
-#endif
                         return 1;
 
                     case CMD_STEP:                        /* step over a single instruction; no parameters */
-                        bdmcf_tx_msg(BDMCF_CMD_RDMREG);     /* get CSR */
-                        if (bdmcf_rx(2, command_buffer + 12))
-                        {
-                            break; /* CSR is received into command_data+12,+13,+14,+15 */
-                        }
-                        *(command_buffer + 15) |= 0x10;         /* set the SSM bit - Single Step Mode */
-                        *((unsigned int *)(command_buffer + 10)) = BDMCF_CMD_WDMREG;
-                        bdmcf_tx(3, command_buffer + 10);			/* write the CSR back */
-                        if (bdmcf_complete_chk(BDMCF_CMD_GO))
-                        {
-                            break; /* GO */
-                        }
-#ifdef CMD_COMPLETE_CHECK
-                        if (bdmcf_complete_chk_rx())
+                        if (bdmcf_go(1))
                         {
                             break;
                         }
-#endif
                         return 1;
 
+                    case CMD_STEP_N:                      /* step repeatedly; parameters 32-bit count, 32-bit range start & end, 8-bit mode & 16-bit timeout */
+                        {
+                            uint32_t pc;
+                            uint32_t steps;
+
+                            command_buffer[1] = bdmcf_step_n(param, get_be32(command_buffer + 6), get_be32(command_buffer + 10),
+                                                             command_buffer[14], get_be16(command_buffer + 15), &pc, &steps);
+                            if (command_buffer[1] == STEP_ERROR)
+                            {
+                                bdmcf_complete_chk_rx();  /* purge the BDM, still report how far it got */
+                                bdmcf_complete_chk_rx();
+                            }
+                            put_be32(command_buffer + 2, pc);
+                            put_be32(command_buffer + 6, steps);
+                            return 10;
+                        }
+
                     case CMD_READ_CREG:                   /* read control register; parameter 16-bit register address, returns 32-bit control register contents */
-                        bdmcf_tx_msg(BDMCF_CMD_RCREG);      /* send the command */
-                        bdmcf_tx_msg(0);                    /* and the register address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2)));
-                        if (bdmcf_rx(2,command_buffer + 1))
+                        if (bdmcf_read_creg(get_be16(command_buffer + 2), command_buffer + 1))
                         {
                             break; /* the 4 bytes of the register contents are received into command_buffer+1,+2,+3,+4 */
                         }
                         return 5;
 
                     case CMD_WRITE_CREG:									/* write control register; parameter 16-bit register address & the 32-bit control register contents to be written */
-                        bdmcf_tx_msg(BDMCF_CMD_WCREG);      /* send the command */
-                        bdmcf_tx_msg(0);                    /* the register address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2)));
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4))); /* and the register value */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 6)));
-#ifdef CMD_COMPLETE_CHECK
-                        if (bdmcf_complete_chk_rx())
+                        if (bdmcf_write_creg(get_be16(command_buffer + 2), command_buffer + 4))
                         {
                             break;
                         }
-#endif
                         return 1;
 
                     case CMD_READ_DREG:										/* read debug register; parameter 8-bit register number to read, returns 32-bit debug module register contents */
-                        bdmcf_tx_msg(BDMCF_CMD_RDMREG + command_buffer[2]);   /* send the command */
-                        if (bdmcf_rx(2, command_buffer + 1))
+                        if (bdmcf_read_dmreg(command_buffer[2], command_buffer + 1))
                         {
                             break;            /* the 4 bytes of the register contents are received into command_buffer+1,+2,+3,+4 */
                         }
                         return 5;
 
                     case CMD_WRITE_DREG:                  /* write debug register; parameter 8-bit register number to write & the 32-bit debug module register contents to be written */
-                        bdmcf_tx_msg(BDMCF_CMD_WDMREG + command_buffer[2]);   /* send the command */
-                        if (bdmcf_tx_msg_half_rx(*((unsigned int *)(command_buffer + 3))))
-                        {
-                            break;	 /* and the register value */
-                        }
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 5)));
-#ifdef CMD_COMPLETE_CHECK
-                        if (bdmcf_complete_chk_rx())
+                        if (bdmcf_write_dmreg(command_buffer[2], command_buffer + 3))
                         {
                             break;
                         }
-#endif
                         return 1;
 
                     case CMD_READ_REG:                    /* read address/data register; parameter 8-bit register number to read, returns 32-bit register contents */
-                        bdmcf_tx_msg(BDMCF_CMD_RAREG + command_buffer[2]);   /* send the command */
-                        if (bdmcf_rx(2, command_buffer + 1))
+                        if (bdmcf_read_reg(command_buffer[2], command_buffer + 1))
                         {
                             break;           /* the 4 bytes of the register contents are received into command_buffer+1,+2,+3,+4 */
                         }
                         return 5;
 
                     case CMD_WRITE_REG:                   /* write address/data register; parameter 8-bit register number to write & the 32-bit register contents to be written */
-                        bdmcf_tx_msg(BDMCF_CMD_WAREG + command_buffer[2]);    /* send the command */
-                        if (bdmcf_tx_msg_half_rx(*((unsigned int *)(command_buffer + 3))))
-                        {
-                            break;	 /* and the register value */
-                        }
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 5)));
-#ifdef CMD_COMPLETE_CHECK
-                        if (bdmcf_complete_chk_rx())
+                        if (bdmcf_write_reg(command_buffer[2], command_buffer + 3))
                         {
                             break;
                         }
-#endif
                         return 1;
 
                     case CMD_READ_MEM8:                   /* read a byte from memory; parameter 32bit address, returns 8bit value read from address */
+                        cached = bdmcf_cache_read(param, 1, 1, command_buffer + 1);
+                        if (cached == BDMCF_CACHE_ERROR)
+                        {
+                            break;
+                        }
+                        if (cached == BDMCF_CACHE_HIT)
+                        {
+                            return 2;
+                        }
                         bdmcf_tx_msg(BDMCF_CMD_READ8);      /* send the command */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* and the address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                        bdmcf_tx_msg(get_be16(command_buffer + 2)); /* and the address */
+                        bdmcf_tx_msg(get_be16(command_buffer + 4));
                         if (bdmcf_rx(1, command_buffer + 1))
                         {
                             break; /* read the result into command_buffer+1 */
@@ -244,9 +366,18 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                         return 2;
 
                     case CMD_READ_MEM16:                  /* read a word from memory; parameter 32bit address, returns 16bit value read from address */
+                        cached = bdmcf_cache_read(param, 2, 2, command_buffer + 1);
+                        if (cached == BDMCF_CACHE_ERROR)
+                        {
+                            break;
+                        }
+                        if (cached == BDMCF_CACHE_HIT)
+                        {
+                            return 3;
+                        }
                         bdmcf_tx_msg(BDMCF_CMD_READ16);     /* send the command */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* and the address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                        bdmcf_tx_msg(get_be16(command_buffer + 2)); /* and the address */
+                        bdmcf_tx_msg(get_be16(command_buffer + 4));
                         if (bdmcf_rx(1, command_buffer + 1))
                         {
                             break; /* read the result into command_buffer+1,+2 */
@@ -254,9 +385,18 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                         return 3;
 
                     case CMD_READ_MEM32:                  /* read a double-word from memory; parameter 32bit address, returns 32bit value read from address */
+                        cached = bdmcf_cache_read(param, 4, 4, command_buffer + 1);
+                        if (cached == BDMCF_CACHE_ERROR)
+                        {
+                            break;
+                        }
+                        if (cached == BDMCF_CACHE_HIT)
+                        {
+                            return 5;
+                        }
                         bdmcf_tx_msg(BDMCF_CMD_READ32);     /* send the command */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* and the address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                        bdmcf_tx_msg(get_be16(command_buffer + 2)); /* and the address */
+                        bdmcf_tx_msg(get_be16(command_buffer + 4));
                         if (bdmcf_rx(2,command_buffer + 1))
                         {
                             break; /* read the result into command_buffer+1,+2,+3,+4 */
@@ -265,8 +405,8 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
 
                     case CMD_WRITE_MEM8:                  /* write a byte to memory; parameter 32bit address & an 8-bit value to be written to the address */
                         bdmcf_tx_msg(BDMCF_CMD_WRITE8);     /* send the command */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* the address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                        bdmcf_tx_msg(get_be16(command_buffer + 2)); /* the address */
+                        bdmcf_tx_msg(get_be16(command_buffer + 4));
                         bdmcf_tx_msg(*(command_buffer + 6));  /* and the data to be written */
 #ifdef CMD_COMPLETE_CHECK
                         if (bdmcf_complete_chk_rx())
@@ -274,33 +414,36 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                             break;
                         }
 #endif
+                        bdmcf_cache_write(param, 1, command_buffer + 6);
                         return 1;
 
                     case CMD_WRITE_MEM16:                 /* write a word to memory; parameter 32bit address & a 16-bit value to be written to the address */
                         bdmcf_tx_msg(BDMCF_CMD_WRITE16);    /* send the command */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* the address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 6))); /* and the data to be written */
+                        bdmcf_tx_msg(get_be16(command_buffer + 2)); /* the address */
+                        bdmcf_tx_msg(get_be16(command_buffer + 4));
+                        bdmcf_tx_msg(get_be16(command_buffer + 6)); /* and the data to be written */
 #ifdef CMD_COMPLETE_CHECK
                         if (bdmcf_complete_chk_rx())
                         {
                             break;
                         }
 #endif
+                        bdmcf_cache_write(param, 2, command_buffer + 6);
                         return 1;
 
                     case CMD_WRITE_MEM32:                 /* write a double-word to memory; parameter 32bit address & a 32-bit value to be written to the address */
                         bdmcf_tx_msg(BDMCF_CMD_WRITE32);    /* send the command */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* the address */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 6))); /* and the data to be written */
-                        bdmcf_tx_msg(*((unsigned int *)(command_buffer + 8)));
+                        bdmcf_tx_msg(get_be16(command_buffer + 2)); /* the address */
+                        bdmcf_tx_msg(get_be16(command_buffer + 4));
+                        bdmcf_tx_msg(get_be16(command_buffer + 6)); /* and the data to be written */
+                        bdmcf_tx_msg(get_be16(command_buffer + 8));
 #ifdef CMD_COMPLETE_CHECK
                         if (bdmcf_complete_chk_rx())
                         {
                             break;
                         }
 #endif
+                        bdmcf_cache_write(param, 4, command_buffer + 6);
                         return 1;
 
                     case CMD_READ_MEMBLOCK8:                /* reads a block of bytes; parameter 32bit address; the number of bytes to read is given by command_size (the number of bytes requested by the host -1) */
@@ -308,9 +451,18 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                             uint8_t i;
                             uint8_t *ptr;
 
+                            cached = bdmcf_cache_read(param, 1, command_size, command_buffer + 1);
+                            if (cached == BDMCF_CACHE_ERROR)
+                            {
+                                break;
+                            }
+                            if (cached == BDMCF_CACHE_HIT)
+                            {
+                                return command_size + 1;
+                            }
                             bdmcf_tx_msg(BDMCF_CMD_READ8);      /* send read byte command */
-                            bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* and the address */
-                            bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                            bdmcf_tx_msg(get_be16(command_buffer + 2)); /* and the address */
+                            bdmcf_tx_msg(get_be16(command_buffer + 4));
                             i = command_size;
                             ptr = command_buffer + 1;               /* where first result should go */
                             do
@@ -347,9 +499,18 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                             uint8_t i;
                             uint8_t *ptr;
 
+                            cached = bdmcf_cache_read(param, 2, command_size, command_buffer + 1);
+                            if (cached == BDMCF_CACHE_ERROR)
+                            {
+                                break;
+                            }
+                            if (cached == BDMCF_CACHE_HIT)
+                            {
+                                return command_size + 1;
+                            }
                             bdmcf_tx_msg(BDMCF_CMD_READ16);     /* send read byte command */
-                            bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* and the address */
-                            bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                            bdmcf_tx_msg(get_be16(command_buffer + 2)); /* and the address */
+                            bdmcf_tx_msg(get_be16(command_buffer + 4));
                             i = (command_size >> 1);                /* the number of words is the bytecount/2 */
                             ptr = command_buffer + 1;               /* where first result should go */
 
@@ -386,12 +547,30 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                 uint8_t i;
                 uint8_t *ptr;
 
+                cached = bdmcf_cache_read(param, 4, command_size, command_buffer + 1);
+                if (cached == BDMCF_CACHE_ERROR)
+                {
+                    break;
+                }
+                if (cached == BDMCF_CACHE_HIT)
+                {
+                    return command_size + 1;
+                }
                 bdmcf_tx_msg(BDMCF_CMD_READ32);     /* send read byte command */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* and the address */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                bdmcf_tx_msg(get_be16(command_buffer + 2)); /* and the address */
+                bdmcf_tx_msg(get_be16(command_buffer + 4));
                 i = (command_size >> 2);                /* the number of dwords is the bytecount/4 */
                 ptr = command_buffer + 1;               /* where first result should go */
 
+                if (bdmcf_speed >= BDMCF_SPEED_SPI)
+                {
+                if (bdmcf_spi_dump(i, 2, ptr, BDMCF_CMD_DUMP32))
+                {
+                    break;                       /* DMA the DUMP sequence, an error has occured */
+                }
+                return command_size + 1;
+                }
+
                 do {
                 i--;                              /* decrement the number of bytes to read */
                 if (i)
@@ -425,24 +604,14 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                 uint8_t *ptr;
 
                 bdmcf_tx_msg(BDMCF_CMD_WRITE8);     /* send write byte command */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* the address */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
+                bdmcf_tx_msg(get_be16(command_buffer + 2)); /* the address */
+                bdmcf_tx_msg(get_be16(command_buffer + 4));
                 bdmcf_tx_msg(*(command_buffer + 6));  /* and the data */
                 i = command_size - 4 - 1;                 /* the address has 4 bytes & done 1 byte already */
                 ptr = command_buffer + 7;
-                while (i)
-                {
-                if (bdmcf_complete_chk(BDMCF_CMD_FILL8))
+                if (i && bdmcf_fill(i, 1, ptr, BDMCF_CMD_FILL8))
                 {
-                    break; /* send write byte command */
-                }
-                bdmcf_tx_msg(*ptr);               /* and the data */
-                ptr++;
-                i--;
-                }
-                if (i)
-                {
-                break;                       /* an error has occured */
+                break;                       /* stream the remaining bytes, an error has occured */
                 }
 
 #ifdef CMD_COMPLETE_CHECK
@@ -451,6 +620,7 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                 break;
                 }
 #endif
+                bdmcf_cache_write(param, command_size - 4, command_buffer + 6);
                 return 1;
             }
 
@@ -460,27 +630,20 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                 uint8_t *ptr;
 
                 bdmcf_tx_msg(BDMCF_CMD_WRITE16);    /* send write byte command */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* the address */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 6))); /* and the data */
+                bdmcf_tx_msg(get_be16(command_buffer + 2)); /* the address */
+                bdmcf_tx_msg(get_be16(command_buffer + 4));
+                bdmcf_tx_msg(get_be16(command_buffer + 6)); /* and the data */
                 i = (command_size - 4 - 2) >> 1;            /* the address has 4 bytes & done 1 word already, every word has 2 bytes */
                 ptr = command_buffer + 8;
 
-                while(i)
-                {
-                if (bdmcf_complete_chk(BDMCF_CMD_FILL16))
+                if (i && bdmcf_fill(i, 2, ptr, BDMCF_CMD_FILL16))
                 {
-                    break; /* send write word command */
+                break;                       /* stream the remaining words, an error has occured */
                 }
-                bdmcf_tx_msg(*(unsigned int *)ptr); /* and the data */
-                ptr += 2;
-                i--;
-                }
-
-                if (i) break;                       /* an error has occured */
 #ifdef CMD_COMPLETE_CHECK
                 if (bdmcf_complete_chk_rx()) break;
 #endif
+                bdmcf_cache_write(param, command_size - 4, command_buffer + 6);
                 return 1;
             }
 
@@ -490,24 +653,27 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
                 uint8_t *ptr;
 
                 bdmcf_tx_msg(BDMCF_CMD_WRITE32);    /* send write byte command */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 2))); /* the address */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 4)));
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 6))); /* and the data */
-                bdmcf_tx_msg(*((unsigned int *)(command_buffer + 8)));
+                bdmcf_tx_msg(get_be16(command_buffer + 2)); /* the address */
+                bdmcf_tx_msg(get_be16(command_buffer + 4));
+                bdmcf_tx_msg(get_be16(command_buffer + 6)); /* and the data */
+                bdmcf_tx_msg(get_be16(command_buffer + 8));
                 i = (command_size - 4 - 4) >> 2;            /* the address has 4 bytes & done 1 dword already, every dword has 4 bytes */
                 ptr = command_buffer + 10;
-                while(i)
+                if (i && bdmcf_speed >= BDMCF_SPEED_SPI)
                 {
-                if (bdmcf_complete_chk(BDMCF_CMD_FILL32)) break; /* send write dword command */
-                bdmcf_tx_msg(*(unsigned int *)(ptr + 0)); /* and the data */
-                bdmcf_tx_msg(*(unsigned int *)(ptr + 2));
-                ptr += 4;
-                i--;
+                if (bdmcf_spi_fill(i, 2, ptr, BDMCF_CMD_FILL32))
+                {
+                    break;                       /* DMA the FILL sequence, an error has occured */
+                }
+                }
+                else if (i && bdmcf_fill(i, 4, ptr, BDMCF_CMD_FILL32))
+                {
+                break;                       /* stream the remaining dwords, an error has occured */
                 }
-                if (i) break;                       /* an error has occured */
 #ifdef CMD_COMPLETE_CHECK
                 if (bdmcf_complete_chk_rx()) break;
 #endif
+                bdmcf_cache_write(param, command_size - 4, command_buffer + 6);
                 return 1;
             }
 
@@ -519,10 +685,208 @@ uint8_t command_exec(uint8_t *command_buffer, uint32_t command_size)
             bdmcf_ta(command_buffer[2]);
             return 1;
 
+            case CMD_SET_SPEED:                     /* select the DSCLK speed, parameter: 8-bit speed index */
+            if (bdmcf_select_speed(command_buffer[2])) break;
+            return 1;
+
+            case CMD_GET_SPEED:                     /* returns 8-bit selected speed index & 8-bit number of speeds */
+            command_buffer[1] = bdmcf_speed;
+            command_buffer[2] = BDMCF_SPEEDS;
+            return 3;
+
+            case CMD_STREAM_READ:                   /* parameters 32-bit address, 32-bit byte count & optional 8-bit flags */
+            case CMD_STREAM_WRITE:
+            if (bdmcf_stream_start(command_buffer[1] == CMD_STREAM_WRITE, get_be32(command_buffer + 2), get_be32(command_buffer + 6),
+                                   (command_size > 8) ? command_buffer[10] : 0))
+            {
+                command_buffer[0] = CMD_FAILED;     /* do not purge the BDM, a stream may be running */
+                return 1;
+            }
+            return 1;
+
+            case CMD_STREAM_DATA:                   /* read: returns stream status & data; write: parameter data, returns stream status */
+            {
+                uint8_t i = 0;
+                uint8_t status;
+                uint32_t max;
+
+                if (!bdmcf_stream_active())
+                {
+                    break;                          /* no stream */
+                }
+                if (!bdmcf_stream_writing())
+                {
+                    max = (command_size < 1 + 8) ? 0 : ((command_size - 1 - 8) & ~3);  /* the status & a trailer have to fit too */
+                    if (max == 0)
+                    {
+                        command_buffer[0] = CMD_FAILED; /* the host asked for less than a dword */
+                        return 1;
+                    }
+                    i = bdmcf_stream_get(command_buffer + 2, (max < BDMCF_STREAM_CHUNK) ? max : BDMCF_STREAM_CHUNK);
+                }
+                else if (command_size)
+                {
+                    status = bdmcf_stream_put(command_buffer + 2, command_size);
+                    if (status > 1)
+                    {
+                        command_buffer[0] = CMD_FAILED; /* more or misaligned data */
+                        return 1;
+                    }
+                    if (status)
+                    {
+                        command_buffer[1] = STREAM_BUSY;    /* no room, the host has to send the data again */
+                        return 2;
+                    }
+                }
+                status = bdmcf_stream_status(command_buffer + 2 + i);
+                if (status != STREAM_MORE)
+                {
+                    command_buffer[1] = status;
+                    return i + 2 + 8;               /* data & the trailer */
+                }
+                command_buffer[1] = (i || bdmcf_stream_writing()) ? STREAM_MORE : STREAM_BUSY;
+                return i + 2;
+            }
+
+            case CMD_STREAM_ABORT:                  /* drop the running stream */
+            bdmcf_stream_abort();
+            return 1;
+
+            case CMD_CRC32_MEMBLOCK:                /* parameters 32-bit address & 32-bit byte count, returns 32-bit CRC */
+            {
+                uint32_t crc;
+
+                if (bdmcf_mem_crc32(get_be32(command_buffer + 2), get_be32(command_buffer + 6), &crc))
+                {
+                    break;                       /* an error has occured */
+                }
+                put_be32(command_buffer + 1, crc);
+                return 5;
+            }
+
+            case CMD_FILL_MEM:                      /* parameters 32-bit address, 32-bit byte count, 8-bit width & 32-bit pattern */
+            if (bdmcf_mem_fill(param, get_be32(command_buffer + 6), command_buffer[10], get_be32(command_buffer + 11))) break;
+            return 1;
+
+            case CMD_SEARCH_MEM:                    /* parameters 32-bit address, 32-bit byte count, 8-bit step, 8-bit max, 8-bit size, pattern & mask */
+            {
+                uint32_t cursor;
+                uint8_t max = (command_buffer[11] > BDMCF_SEARCH_MATCHES) ? BDMCF_SEARCH_MATCHES : command_buffer[11];
+                uint8_t size = command_buffer[12];
+
+                if (bdmcf_mem_search(param, get_be32(command_buffer + 6), command_buffer[10], size, command_buffer + 13,
+                                     command_buffer + 13 + size, max, command_buffer + 6, command_buffer + 1, &cursor))
+                {
+                    break;
+                }
+                put_be32(command_buffer + 2, cursor);
+                return 6 + 4 * command_buffer[1];
+            }
+
+            case CMD_READ_MEMBLOCK_RLE:             /* parameters 32-bit address & 32-bit byte count, the size of the result is given by command_size */
+            {
+                uint16_t covered;
+                uint8_t size;
+
+                if ((command_size < 3) || bdmcf_mem_read_rle(param, get_be32(command_buffer + 6), command_buffer + 3,
+                                                             ((command_size > MAX_DATA_SIZE) ? MAX_DATA_SIZE : command_size) - 2, &covered, &size))
+                {
+                    break;
+                }
+                put_be16(command_buffer + 1, covered);
+                return 3 + size;
+            }
+
+            case CMD_WRITE_MEMBLOCK_DIFF:           /* parameters 32-bit address & data, the number of bytes is given by command_size, returns 8-bit dwords skipped */
+            {
+                uint8_t skipped;
+
+                if ((command_size < 8) || ((command_size - 4) & 3) ||
+                    bdmcf_mem_write_diff(param, (command_size - 4) >> 2, command_buffer + 6, &skipped))
+                {
+                    break;
+                }
+                command_buffer[1] = skipped;
+                return 2;
+            }
+
+            case CMD_READ_MEMBLOCK:                 /* parameter 32-bit address; the number of bytes to read is given by command_size (the number of bytes requested by the host -1) */
+            if (bdmcf_mem_transfer(0, param, command_size, command_buffer + 1)) break;
+            return command_size + 1;
+
+            case CMD_WRITE_MEMBLOCK:                /* parameters 32-bit address & data to write; the number of bytes to write is given by command_size */
+            if ((command_size < 4) || bdmcf_mem_transfer(1, param, command_size - 4, command_buffer + 6)) break;
+            return 1;
+
+            case CMD_FLASH_SETUP:                   /* parameters 32-bit entry, mailbox, buffer 0 & buffer 1 address, 16-bit buffer size */
+            if (bdmcf_flash_setup(get_be32(command_buffer + 2), get_be32(command_buffer + 6), get_be32(command_buffer + 10),
+                                  get_be32(command_buffer + 14), get_be16(command_buffer + 18))) break;
+            return 1;
+
+            case CMD_FLASH_PROGRAM:                 /* parameters 32-bit flash address & data */
+            if ((command_size < 4) || bdmcf_flash_program(get_be32(command_buffer + 2), command_buffer + 6, command_size - 4)) break;
+            return 1;
+
+            case CMD_FLASH_FLUSH:                   /* program the rest & wait for the stub */
+            if (bdmcf_flash_flush()) break;
+            return 1;
+
+            case CMD_FLASH_STATUS:                  /* returns stub status & the programming time of the last buffers */
+            return 1 + bdmcf_flash_status(command_buffer + 1);
+
+            case CMD_READ_CONTEXT:                  /* parameters 16-bit control register addresses, their number is given by command_size (bytes requested - 1) */
+            {
+                uint8_t count;
+
+                if (command_size < BDMCF_CONTEXT_SIZE) break;
+                count = (command_size - BDMCF_CONTEXT_SIZE) >> 2;
+                if ((count > BDMCF_CONTEXT_CREGS) || bdmcf_read_context(count, command_buffer + 2, command_buffer + 1)) break;
+                return 1 + BDMCF_CONTEXT_SIZE + 4 * count;
+            }
+
+            case CMD_WRITE_CONTEXT:                 /* parameters the context & 16-bit address + 32-bit value of the control registers */
+            {
+                uint8_t count;
+
+                if (command_size < BDMCF_CONTEXT_SIZE) break;
+                count = (command_size - BDMCF_CONTEXT_SIZE) / 6;
+                if ((count > BDMCF_CONTEXT_CREGS) || bdmcf_write_context(count, command_buffer + 2)) break;
+                return 1;
+            }
+
+            case CMD_MEM_CACHE_WINDOW:              /* parameters 8-bit window number, 32-bit address & 32-bit length (0 disables the window) */
+            if (bdmcf_cache_window(command_buffer[2], get_be32(command_buffer + 3), get_be32(command_buffer + 7))) break;
+            return 1;
+
+            case CMD_BREAKPOINT:                    /* parameters 8-bit operation & 32-bit address, returns 8-bit number of breakpoints */
+            if (bdmcf_break_set(command_buffer[2], get_be32(command_buffer + 3)))
+            {
+                command_buffer[0] = CMD_FAILED; /* nothing to purge */
+                return 1;
+            }
+            command_buffer[1] = bdmcf_break_count();
+            return 2;
+
+            case CMD_GET_SHADOW_STATS:              /* parameter 8-bit clear flag, returns 32-bit hit & miss counts of the register shadow */
+            bdmcf_shadow_stats(command_buffer[2], command_buffer + 1);
+            return 9;
+
+            case CMD_TRACE_CONTROL:                 /* parameter 8-bit enable */
+            bdmcf_trace_enable(command_buffer[2]);
+            return 1;
+
+            case CMD_TRACE_DRAIN:                   /* returns 8-bit count, 16-bit lost count & the messages */
+            return 1 + bdmcf_trace_drain(command_buffer + 1);
+
             default:                                /* unknown command */
             command_buffer[0] = CMD_UNKNOWN;
             return 1;
         }
+        if (bdmcf_bus_error)
+        {
+            event_push(EVENT_BUS_ERROR, event_time_us(), command_buffer[0], param);
+        }
+        bdmcf_cache_invalidate();                 /* a failed write may have changed part of the memory */
         bdmcf_complete_chk_rx();                  /* send at least 2 nops to purge the BDM of the offending command */
         bdmcf_complete_chk_rx();
     }
@@ -0,0 +1,138 @@
+/*
+ * events.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ * Queue of cable and target events (target halted, ...) for the host, with sequence numbers and microsecond
+ * timestamps. The host gets them on the interrupt endpoint (EP3) or with CMD_GET_EVENTS.
+ *
+ * The EP3 handler takes the events sent out of the queue from interrupt context, so the queue is only
+ * changed with the USB interrupt disabled.
+ */
+
+#include "events.h"
+#include "commands.h"
+#include "cmd_processing.h"
+#include "arm_cm4.h"
+
+static event_t event_queue[EVENT_QUEUE_SIZE];
+static uint32_t event_head;         /* next event to be queued */
+static uint32_t event_tail;         /* next event to be taken */
+static uint16_t event_seq;          /* sequence number of the next event */
+
+static uint32_t event_us;           /* microseconds since start-up */
+static uint32_t event_cycles;       /* cycle counter at the last update of event_us */
+
+/*
+ * returns the microseconds since start-up. The 32 bit cycle counter wraps after about 44s at 96MHz,
+ * it is extended here, which is why the main loop keeps calling this through events_poll()
+ */
+uint32_t event_time_us(void)
+{
+    uint32_t now = CYCCNT();
+    uint32_t us = CYCCNT_US(now - event_cycles);
+
+    event_us += us;
+    event_cycles += us * (core_clk_khz / 1000);    /* keep the fraction of a microsecond */
+    return event_us;
+}
+
+/* converts a cycle counter value taken in the last 44s to the microseconds since start-up */
+uint32_t event_cycles_to_us(uint32_t cycles)
+{
+    return event_time_us() - CYCCNT_US(CYCCNT() - cycles);
+}
+
+/* returns non-zero if there are events queued */
+uint8_t event_pending(void)
+{
+    return event_head != event_tail;
+}
+
+/* queues an event with the next sequence number */
+/* when the queue is full, the newest entry is turned into an EVENT_OVERFLOW which counts the events lost */
+void event_push(uint8_t type, uint32_t time_us, uint32_t arg0, uint32_t arg1)
+{
+    event_t *event;
+    uint16_t seq = event_seq++;
+
+    disable_irq(IRQ(INT_USB0));
+    if (event_head - event_tail >= EVENT_QUEUE_SIZE)
+    {
+        event = &event_queue[(event_head - 1) & (EVENT_QUEUE_SIZE - 1)];
+        if (event->type != EVENT_OVERFLOW)
+        {
+            event->type = EVENT_OVERFLOW;
+            event->arg[0] = 1;          /* the event replaced */
+            event->arg[1] = event->seq; /* sequence number of the first event lost */
+        }
+        event->arg[0]++;
+        event->time_us = time_us;
+        enable_irq(IRQ(INT_USB0));
+        return;
+    }
+
+    event = &event_queue[event_head & (EVENT_QUEUE_SIZE - 1)];
+    event->type = type;
+    event->seq = seq;
+    event->time_us = time_us;
+    event->arg[0] = arg0;
+    event->arg[1] = arg1;
+    event_head++;
+    enable_irq(IRQ(INT_USB0));
+}
+
+/* stores the event n places after the oldest into data as it is sent to the host (8-bit type, 16-bit */
+/* sequence number, 32-bit timestamp in us, 2 32-bit arguments), returns 0 if there are not that many queued */
+uint8_t event_peek(uint8_t n, uint8_t *data)
+{
+    event_t *event;
+
+    if (event_head - event_tail <= n)
+    {
+        return 0;
+    }
+    event = &event_queue[(event_tail + n) & (EVENT_QUEUE_SIZE - 1)];
+    data[0] = event->type;
+    put_be16(data + 1, event->seq);
+    put_be32(data + 3, event->time_us);
+    put_be32(data + 7, event->arg[0]);
+    put_be32(data + 11, event->arg[1]);
+    return 1;
+}
+
+/* takes the oldest event out of the queue and stores it into data like event_peek(), returns 0 if the queue is empty */
+uint8_t event_pop(uint8_t *data)
+{
+    uint8_t found;
+
+    disable_irq(IRQ(INT_USB0));
+    found = event_peek(0, data);
+    if (found)
+    {
+        event_tail++;
+    }
+    enable_irq(IRQ(INT_USB0));
+    return found;
+}
+
+/* keeps the time base going, to be called from the main loop */
+void events_poll(void)
+{
+    event_time_us();
+}
@@ -30,6 +30,10 @@
 #include "xprintf.h"
 #include "xstring.h"
 
+#include "commands.h"
+#include "cmd_processing.h"
+#include "events.h"
+
 #define DBG_TUSB
 #ifdef DBG_TUSB
 #define dbg(format, arg...) do { xprintf("DEBUG (%s()): " format, __FUNCTION__, ##arg);} while(0)
@@ -48,7 +52,7 @@ enum
     PID_SETUP = 0x0d,
     PID_STALL = 0x0e,
     PID_DERR = 0x0f
-} pid_t;
+};
 
 /*
  * request types
@@ -72,7 +76,9 @@ enum
  * interface request types
  */
 #define ENDP0_SIZE 64
+#define ENDP1_SIZE 64
 #define ENDP2_SIZE 64
+#define ENDP3_SIZE 64
 
 struct setup
 {
@@ -85,9 +91,9 @@ struct setup
                 uint8_t bmRequestType;
                 struct
                 {
-                    uint8_t transfer_direction      : 1;    /* 0=host to device, 1=device to host */
-                    uint8_t type                    : 2;    /* see enum r_type below */
                     uint8_t recipient               : 5;    /* see r_recip below */
+                    uint8_t type                    : 2;    /* see enum r_type below */
+                    uint8_t transfer_direction      : 1;    /* 0=host to device, 1=device to host */
                 };
             };
             uint8_t bRequest;
@@ -228,7 +234,7 @@ static uint8_t cfg_descriptor[] =
 {
     9,                  // bLength
     2,                  // bDescriptorType
-    9 + 9 + 7 + 7, 0x00, // wTotalLength
+    9 + 9 + 7 + 7 + 7, 0x00, // wTotalLength
     1,                  // bNumInterfaces
     1,                  // bConfigurationValue,
     0,                  // iConfiguration
@@ -239,7 +245,7 @@ static uint8_t cfg_descriptor[] =
     4,                  // bDescriptorType
     0,                  // bInterfaceNumber
     0,                  // bAlternateSetting
-    2,                  // bNumEndpoints
+    3,                  // bNumEndpoints
     0xff,               // bInterfaceClass
     0xff,               // bInterfaceSubClass,
     0xff,               // bInterfaceProtocol
@@ -259,6 +265,15 @@ static uint8_t cfg_descriptor[] =
     0x02,               // bmAttributes
     ENDP0_SIZE, 0x00,   // wxMaxPacketSize
     1,                  // bInterval
+    /* INTERFACE 0, ENDPOINT 2 END */
+    /* INTERFACE 0, ENDPOINT 3 BEGIN */
+    7,                  // bLength
+    5,                  // bDescriptorType
+    0x83,               // bEndpointAddress
+    0x03,               // bmAttributes, interrupt endpoint
+    ENDP3_SIZE, 0x00,   // wMaxPacketSize
+    1,                  // bInterval, 1ms
+    /* INTERFACE 0, ENDPOINT 3 END */
     /* INTERFACE 0 END */
 };
 
@@ -309,10 +324,88 @@ static const struct descriptor_entry descriptors[] =
 
 static uint8_t endp0_odd = 0;
 static uint8_t endp0_data = 0;
+static uint8_t endp0_rx_data = 0;   // data toggle of the next OUT packet on EP0
 
 static uint8_t endp2_odd = 0;
 static uint8_t endp2_data = 0;
 
+static uint8_t endp1_odd = 0;
+static uint8_t endp1_data = 0;
+
+static const uint8_t *endp1_tx_dataptr = NULL;  // pointer to current transmit chunk
+static uint16_t endp1_tx_datalen = 0;           // length of data remaining to send
+static uint8_t endp1_inflight = 0;              // number of packets handed to the USB module
+
+/*
+ * Bulk command transport: commands arrive on EP2 OUT, results go back on EP1 IN.
+ *
+ * A command transfer is [expected result length][command][parameters...] and ends with a short (or zero
+ * length) packet. The first byte is the number of bytes the host wants back from commands which read data
+ * (CMD_READ_MEMBLOCKx), it is 0 for all others. The byte is overwritten with the command status, so the
+ * command and result line up with command_exec() and no data has to be moved.
+ * There are two slots: the host can send the next command while the previous one executes or its result
+ * is still on EP1. When both are taken, the received packets stay in the EP2 buffers and the host is NAKed.
+ */
+#define BULK_SLOT_SIZE  (3 * ENDP2_SIZE)
+
+enum
+{
+    BULK_FREE,          // receiving a command
+    BULK_READY,         // command received, waiting for the main loop to execute it
+    BULK_DONE,          // result waiting for EP1
+    BULK_SENDING        // result being sent on EP1
+};
+
+struct bulk_slot
+{
+    uint8_t buffer[BULK_SLOT_SIZE];
+    uint16_t length;                // bytes received, then length of the result
+    volatile uint8_t state;
+};
+
+static struct bulk_slot bulk_slots[2];
+static uint8_t bulk_rx = 0;         // slot receiving from EP2
+static uint8_t bulk_exec = 0;       // slot to execute next
+static uint8_t bulk_tx = 0;         // slot to send next
+
+static struct bdt *endp2_held[2];   // received packets waiting for a free slot, oldest first
+static uint8_t endp2_nheld = 0;
+
+static uint8_t last_status = CMD_FAILED;
+
+/*
+ * Events (see events.c) are pushed to the host on the interrupt endpoint EP3, up to 4 per packet, once the
+ * device is configured. The host polls the endpoint and is NAKed while there are none. The events stay
+ * queued until the packet has gone out, so none are lost to a USB reset or to CMD_GET_EVENTS meanwhile.
+ */
+#define EVENTS_PER_PACKET   (ENDP3_SIZE / EVENT_SIZE)
+
+static uint8_t endp3_tx[2][EVENTS_PER_PACKET * EVENT_SIZE];
+static uint8_t endp3_odd = 0;
+static uint8_t endp3_data = 0;
+static volatile uint8_t endp3_busy = 0;
+static uint16_t endp3_seq;          // sequence number of the first event in the packet
+static uint8_t endp3_count;         // events in the packet
+
+static volatile uint8_t usb_configured = 0;     // SET_CONFIGURATION with a non-zero value received
+
+/*
+ * executes a command received by any of the transports, the command is expected in buffer[1]
+ * CMD_GET_LAST_STATUS returns the status of the previous command whichever transport it came through
+ */
+static uint8_t usb_command_exec(uint8_t *buffer, uint32_t size, transport_e transport)
+{
+    uint8_t cmd = buffer[1];
+    uint8_t length;
+
+    buffer[0] = last_status;
+    length = command_exec(buffer, size, transport);
+    if (cmd != CMD_GET_LAST_STATUS)
+        last_status = buffer[0];
+
+    return length;
+}
+
 
 static void usb_endp0_transmit(const void *data, uint8_t length)
 {
@@ -326,7 +419,284 @@ static void usb_endp0_transmit(const void *data, uint8_t length)
     endp0_data ^= 1;
 }
 
-static unsigned char cmd_buffer[ENDP0_SIZE];
+/*
+ * TBLCF vendor requests: bRequest is the command, wValue and wIndex carry the first 4 parameter bytes (in the
+ * order the host put them in, i.e. as they are on the wire) and an OUT data stage the rest. The command is
+ * executed by the main loop, the host is NAKed until the result (IN) or the status stage (OUT) is ready.
+ * cmd_buffer[0] is where command_exec() puts the command status, the result is sent straight from there.
+ * Every SETUP and bus reset counts vendor_generation up, a result is only sent if it has not changed since
+ * the command was taken. A vendor SETUP arriving while the command executes is stalled, cmd_buffer is in use.
+ */
+enum
+{
+    VENDOR_IDLE,
+    VENDOR_DATA,        // receiving the OUT data stage
+    VENDOR_READY,       // waiting for the main loop to execute the command
+    VENDOR_EXEC         // the main loop is executing the command
+};
+
+static unsigned char cmd_buffer[6 + MAX_DATA_SIZE];
+static volatile uint8_t vendor_state = VENDOR_IDLE;
+static volatile uint8_t vendor_generation;  // SETUPs & bus resets seen
+static uint8_t vendor_in;           // command returns data in the IN data stage
+static uint16_t vendor_length;      // wLength of the request
+static uint16_t vendor_received;    // bytes of the OUT data stage received so far
+
+static void usb_endp1_transmit(const void *data, uint8_t length)
+{
+    table[BDT_INDEX(1, TX, endp1_odd)].addr = (void *) data;
+    table[BDT_INDEX(1, TX, endp1_odd)].desc = BDT_DESC(length, endp1_data);
+
+    /*
+     * toggle the odd and data bits
+     */
+    endp1_odd ^= 1;
+    endp1_data ^= 1;
+    endp1_inflight++;
+}
+
+/*
+ * hands the next chunk of the current result to EP1, a result which fills the last packet is ended with
+ * a zero length packet
+ */
+static void usb_endp1_next(void)
+{
+    const uint8_t *data = endp1_tx_dataptr;
+    uint32_t size;
+
+    if (data == NULL)
+        return;
+
+    size = endp1_tx_datalen;
+    if (size > ENDP1_SIZE)
+        size = ENDP1_SIZE;
+    usb_endp1_transmit(data, size);
+    data += size;
+    endp1_tx_datalen -= size;
+    endp1_tx_dataptr = (endp1_tx_datalen > 0 || size == ENDP1_SIZE) ? data : NULL;
+}
+
+/*
+ * starts sending the next result if EP1 is idle, both ping-pong buffers are used
+ */
+static void usb_endp1_start(void)
+{
+    struct bulk_slot *slot = &bulk_slots[bulk_tx];
+
+    if (endp1_inflight || slot->state != BULK_DONE)
+        return;
+
+    slot->state = BULK_SENDING;
+    endp1_tx_dataptr = slot->buffer;
+    endp1_tx_datalen = slot->length;
+    usb_endp1_next();
+    usb_endp1_next();
+}
+
+/*
+ * copies a packet received on EP2 into the receiving slot and gives the buffer back to the USB module
+ * returns 0 (and keeps the buffer) if there is no free slot
+ */
+static uint8_t usb_endp2_receive(struct bdt *bdt)
+{
+    struct bulk_slot *slot = &bulk_slots[bulk_rx];
+    uint16_t length = (bdt->desc >> BDT_BC_SHIFT) & 0x3ff;
+
+    if (slot->state != BULK_FREE)
+        return 0;
+
+    if (slot->length + length <= BULK_SLOT_SIZE)
+        memcpy(slot->buffer + slot->length, bdt->addr, length);
+    slot->length += length;
+
+    /*
+     * the EVEN buffer always receives DATA0, the ODD buffer DATA1
+     */
+    bdt->desc = BDT_DESC(ENDP2_SIZE, (bdt == &table[BDT_INDEX(2, RX, ODD)]));
+
+    if (length < ENDP2_SIZE)
+    {
+        if (slot->length < 2 || slot->length > BULK_SLOT_SIZE)
+        {
+            slot->length = 0;           // runt or overlong command, drop it
+        }
+        else
+        {
+            slot->state = BULK_READY;
+            bulk_rx ^= 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * takes up packets held back while both slots were busy
+ */
+static void usb_endp2_resume(void)
+{
+    while (endp2_nheld && usb_endp2_receive(endp2_held[0]))
+    {
+        endp2_held[0] = endp2_held[1];
+        endp2_nheld--;
+    }
+}
+
+/*
+ * (re)initializes the bulk endpoints, all pending commands and results are dropped
+ */
+static void usb_bulk_reset(void)
+{
+    bulk_slots[0].state = BULK_FREE;
+    bulk_slots[0].length = 0;
+    bulk_slots[1].state = BULK_FREE;
+    bulk_slots[1].length = 0;
+    bulk_rx = bulk_exec = bulk_tx = 0;
+    endp2_nheld = 0;
+
+    endp1_odd = 0;
+    endp1_data = 0;
+    endp1_inflight = 0;
+    endp1_tx_dataptr = NULL;
+    table[BDT_INDEX(1, TX, EVEN)].desc = 0;
+    table[BDT_INDEX(1, TX, ODD)].desc = 0;
+
+    endp2_odd = 0;
+    table[BDT_INDEX(2, RX, EVEN)].desc = BDT_DESC(ENDP2_SIZE, 0);
+    table[BDT_INDEX(2, RX, EVEN)].addr = endp2_rx[0];
+    table[BDT_INDEX(2, RX, ODD)].desc = BDT_DESC(ENDP2_SIZE, 1);
+    table[BDT_INDEX(2, RX, ODD)].addr = endp2_rx[1];
+}
+
+/*
+ * (re)initializes the event endpoint
+ */
+static void usb_event_reset(void)
+{
+    endp3_odd = 0;
+    endp3_data = 0;
+    endp3_busy = 0;
+    table[BDT_INDEX(3, TX, EVEN)].desc = 0;
+    table[BDT_INDEX(3, TX, ODD)].desc = 0;
+}
+
+/*
+ * sends the queued events on EP3, to be called from the main loop
+ * they are copied into the packet only, usb_endp3_handler() takes them out of the queue when it is sent
+ */
+void usb_event_process(void)
+{
+    uint8_t *data = endp3_tx[endp3_odd];
+    uint8_t n = 0;
+
+    if (!usb_configured || endp3_busy || !event_pending())
+        return;
+
+    while (n < EVENTS_PER_PACKET && event_peek(n, data + n * EVENT_SIZE))
+        n++;
+
+    disable_irq(IRQ(INT_USB0));
+    if (usb_configured)     // unless a USB reset came in meanwhile
+    {
+        endp3_busy = 1;
+        endp3_seq = get_be16(data + 1);
+        endp3_count = n;
+        table[BDT_INDEX(3, TX, endp3_odd)].addr = data;
+        table[BDT_INDEX(3, TX, endp3_odd)].desc = BDT_DESC(n * EVENT_SIZE, endp3_data);
+        endp3_odd ^= 1;
+        endp3_data ^= 1;
+    }
+    enable_irq(IRQ(INT_USB0));
+}
+
+/*
+ * executes the next command received on EP2
+ */
+static void usb_bulk_process(void)
+{
+    struct bulk_slot *slot = &bulk_slots[bulk_exec];
+    uint32_t size;
+
+    if (slot->state != BULK_READY)
+        return;
+
+    /*
+     * commands reading data get the number of bytes requested by the host -1 (as over EP0),
+     * all others the number of parameter bytes; like vendor requests neither may exceed the command buffer
+     */
+    if (slot->buffer[0] > 1 + MAX_DATA_SIZE || slot->length - 2 > MAX_DATA_SIZE)
+    {
+        dbg("bulk command too long (%d bytes), failed.\r\n", slot->buffer[0] ? slot->buffer[0] : slot->length - 2);
+        slot->buffer[0] = CMD_FAILED;
+        slot->length = 1;
+        last_status = CMD_FAILED;
+    }
+    else
+    {
+        size = slot->buffer[0] ? slot->buffer[0] - 1 : slot->length - 2;
+        slot->length = usb_command_exec(slot->buffer, size, TRANSPORT_BULK);
+    }
+
+    disable_irq(IRQ(INT_USB0));
+    slot->state = BULK_DONE;
+    bulk_exec ^= 1;
+    usb_endp1_start();
+    enable_irq(IRQ(INT_USB0));
+}
+
+/*
+ * sends data in the IN data stage of a control transfer, two packets are handed to the USB module
+ * right away, the rest is sent from the endpoint 0 handler
+ */
+static void usb_endp0_send(const uint8_t *data, uint32_t data_length, uint16_t wLength)
+{
+    uint32_t size;
+
+    LED_OFF();
+    /*
+     * truncate the data length to whatever the setup packet is expecting
+     */
+
+    if (data_length > wLength)
+        data_length = wLength;
+    endp0_tx_dataptr = NULL;
+
+    /*
+     * transmit 1st chunk
+     */
+    size = data_length;
+    if (size > ENDP0_SIZE)
+        size = ENDP0_SIZE;
+
+    usb_endp0_transmit(data, size);
+    data += size;           // move the pointer down
+    data_length -= size;    // move the size down
+    if (data_length == 0 && size < ENDP0_SIZE)
+    {
+        LED_ON();
+        return;             // all done!
+    }
+
+    /*
+     * transmit 2nd chunk
+     */
+    size = data_length;
+    if (size > ENDP0_SIZE)
+        size = ENDP0_SIZE;
+
+    usb_endp0_transmit(data, size);
+    data += size;           // move the pointer down
+    data_length -= size;    // move the size down
+    if (data_length == 0 && size < ENDP0_SIZE)
+        return;             // all done!
+
+    /*
+     * if any data remains to be transmitted, we need to store it
+     */
+    endp0_tx_dataptr = data;
+    endp0_tx_datalen = data_length;
+
+    LED_ON();
+}
 
 /*
  * Endpoint 0 setup handler
@@ -336,7 +706,6 @@ static void usb_endp0_handle_setup(struct setup *packet)
     const struct descriptor_entry *entry;
     const uint8_t *data = NULL;
     uint8_t data_length = 0;
-    uint32_t size = 0;
 
     dbg("\r\n"
         "bmRequestType: direction: %s\r\n"
@@ -361,15 +730,18 @@ static void usb_endp0_handle_setup(struct setup *packet)
         case R_SET_CONFIGURATION:    // set configuration
             dbg("set configuration %d\r\n", packet->wValue);
             dbg("enable endpoint 2\r\n");
+            usb_event_reset();
             if (packet->lo)
             {
                 /* non-zero configuration number */
-                /* initialize EP2 */
-
+                /* initialize EP1, EP2 and EP3 */
+                usb_bulk_reset();
+                usb_configured = 1;
             }
             else
             {
                 /* configuration zero means back to addressed state */
+                usb_configured = 0;
             }
 
             /* next send back the confirmation */
@@ -410,71 +782,92 @@ static void usb_endp0_handle_setup(struct setup *packet)
      */
 
 send:
+    usb_endp0_send(data, data_length, packet->wLength);
+    return;
 
-    LED_OFF();
     /*
-     * truncate the data length to whatever the setup packet is expecting
+     * if we make it here, we are not able to send data and have stalled
      */
+stall:
+    dbg("stalled.\r\n");
+end:
+    USB0_ENDPT0 = USB_ENDPT_EPSTALL_MASK | USB_ENDPT_EPRXEN_MASK | USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+}
 
-    if (data_length > packet->wLength)
-        data_length = packet->wLength;
+void usb_endp0_handle_vendor(struct setup *setup)
+{
+    if (vendor_state == VENDOR_EXEC)
+    {
+        dbg("command still executing, stalled.\r\n");
+        USB0_ENDPT0 = USB_ENDPT_EPSTALL_MASK | USB_ENDPT_EPRXEN_MASK | USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+        return;
+    }
 
-    /*
-     * transmit 1st chunk
-     */
-    size = data_length;
-    if (size > ENDP0_SIZE)
-        size = ENDP0_SIZE;
+    vendor_in = setup->transfer_direction;
+    vendor_length = setup->wLength;
+    vendor_received = 0;
 
-    usb_endp0_transmit(data, size);
-    data += size;           // move the pointer down
-    data_length -= size;    // move the size down
-    if (data_length == 0 && size < ENDP0_SIZE)
+    if (vendor_length > (vendor_in ? 1 + MAX_DATA_SIZE : MAX_DATA_SIZE))
     {
-        LED_ON();
-        return;             // all done!
+        dbg("request too long (%d bytes), stalled.\r\n", vendor_length);
+        vendor_state = VENDOR_IDLE;
+        USB0_ENDPT0 = USB_ENDPT_EPSTALL_MASK | USB_ENDPT_EPRXEN_MASK | USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+        return;
     }
 
-    /*
-     * transmit 2nd chunk
-     */
-    size = data_length;
-    if (size > ENDP0_SIZE)
-        size = ENDP0_SIZE;
-
-    usb_endp0_transmit(data, size);
-    data += size;           // move the pointer down
-    data_length -= size;    // move the size down
-    if (data_length == 0 && size < ENDP0_SIZE)
-        return;             // all done!
+    cmd_buffer[1] = setup->bRequest;
+    memcpy(cmd_buffer + 2, &setup->wValue, 4);    // wValue & wIndex
 
-    /*
-     * if any data remains to be transmitted, we need to store it
-     */
-    endp0_tx_dataptr = data;
-    endp0_tx_datalen = data_length;
+    vendor_state = (vendor_in || vendor_length == 0) ? VENDOR_READY : VENDOR_DATA;
+}
 
-    LED_ON();
+/*
+ * executes a command received as vendor request, to be called from the main loop
+ */
+static void usb_vendor_process(void)
+{
+    uint8_t length;
+    uint8_t generation;
 
-    return;
+    disable_irq(IRQ(INT_USB0));
+    if (vendor_state != VENDOR_READY)
+    {
+        enable_irq(IRQ(INT_USB0));
+        return;
+    }
+    vendor_state = VENDOR_EXEC;
+    generation = vendor_generation;
+    enable_irq(IRQ(INT_USB0));
 
     /*
-     * if we make it here, we are not able to send data and have stalled
+     * reading commands get the number of bytes requested by the host -1, writing commands the number of
+     * parameter bytes
      */
-stall:
-    dbg("stalled.\r\n");
-end:
-    USB0_ENDPT0 = USB_ENDPT_EPSTALL_MASK | USB_ENDPT_EPRXEN_MASK | USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+    if (vendor_in)
+        length = usb_command_exec(cmd_buffer, vendor_length ? vendor_length - 1 : 0, TRANSPORT_EP0_IN);
+    else
+        length = usb_command_exec(cmd_buffer, 4 + vendor_length, TRANSPORT_EP0_OUT);
+
+    disable_irq(IRQ(INT_USB0));
+    vendor_state = VENDOR_IDLE;
+    if (generation == vendor_generation)    // unless the host has given up and sent a new SETUP meanwhile
+    {
+        if (vendor_in)
+            usb_endp0_send(cmd_buffer, length, vendor_length);
+        else
+            usb_endp0_transmit(NULL, 0);    // status stage, the host reads the result with CMD_GET_LAST_STATUS
+    }
+    enable_irq(IRQ(INT_USB0));
 }
 
-void usb_endp0_handle_vendor(struct setup *setup)
+/*
+ * executes commands received as vendor requests on EP0 and on EP2, to be called from the main loop so that
+ * the BDM communication does not run in interrupt context
+ */
+void usb_command_process(void)
 {
-    const struct descriptor_entry *entry;
-    const uint8_t *data = NULL;
-    uint8_t data_length = 0;
-    uint32_t size = 0;
-
-    dbg("\r\n");
+    usb_vendor_process();
+    usb_bulk_process();
 }
 
 /**
@@ -486,11 +879,12 @@ void usb_endp0_handler(uint8_t stat)
 
     const uint8_t *data = NULL;
     uint32_t size = 0;
+    uint8_t odd = (stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT;
 
     /*
      * determine which bdt we are looking at here
      */
-    struct bdt *bdt = &table[BDT_INDEX(0, (stat & USB_STAT_TX_MASK) >> USB_STAT_TX_SHIFT, (stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT)];
+    struct bdt *bdt = &table[BDT_INDEX(0, (stat & USB_STAT_TX_MASK) >> USB_STAT_TX_SHIFT, odd)];
 
     switch (BDT_PID(bdt->desc))
     {
@@ -503,9 +897,12 @@ void usb_endp0_handler(uint8_t stat)
             last_setup = *((struct setup *) (bdt->addr));
 
             /*
-             * we are now done with the buffer
+             * we are now done with the buffer; the packets after a SETUP start with DATA1 and go to the
+             * other buffer first, this one gets the DATA0 packet following it
              */
-            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            endp0_rx_data = 1;
+            table[BDT_INDEX(0, RX, (odd ^ 1))].desc = BDT_DESC(ENDP0_SIZE, 1);
+            bdt->desc = BDT_DESC(ENDP0_SIZE, 0);
 
             /*
              * clear any pending IN stuff
@@ -518,6 +915,9 @@ void usb_endp0_handler(uint8_t stat)
              * cast the data into our setup type and run the setup
              * check for vendor specific command (needed for TBLCF)
              */
+            vendor_generation++;
+            if (vendor_state != VENDOR_EXEC)
+                vendor_state = VENDOR_IDLE;
             if (last_setup.type == VENDOR_SPECIFIC)
                 usb_endp0_handle_vendor(&last_setup);
             else
@@ -547,7 +947,7 @@ void usb_endp0_handler(uint8_t stat)
                 endp0_tx_dataptr = (endp0_tx_datalen > 0 || size == ENDP0_SIZE) ? data : NULL;
             }
 
-            if (last_setup.bRequest == R_SET_ADDRESS)
+            if (last_setup.type == STANDARD && last_setup.bRequest == R_SET_ADDRESS)
             {
                 dbg("set address to %d\r\n", last_setup.wValue);
                 USB0_ADDR = last_setup.wValue;
@@ -557,9 +957,24 @@ void usb_endp0_handler(uint8_t stat)
         case PID_OUT:
             dbg("PID_OUT\r\n");
             /*
-             * nothing to do here..just give the buffer back
+             * collect the data stage of a vendor request, anything else (status stages) is just given back
              */
-            bdt->desc = BDT_DESC(ENDP0_SIZE, 1);
+            if (vendor_state == VENDOR_DATA)
+            {
+                size = (bdt->desc >> BDT_BC_SHIFT) & 0x3ff;
+                if (size > vendor_length - vendor_received)
+                    size = vendor_length - vendor_received;
+                memcpy(cmd_buffer + 6 + vendor_received, bdt->addr, size);
+                vendor_received += size;
+                if (vendor_received == vendor_length)
+                    vendor_state = VENDOR_READY;
+            }
+
+            /*
+             * the buffers take turns, so this one gets the packet after next, which has the toggle of this one
+             */
+            endp0_rx_data ^= 1;
+            bdt->desc = BDT_DESC(ENDP0_SIZE, endp0_rx_data ^ 1);
             break;
 
         default:
@@ -570,6 +985,54 @@ void usb_endp0_handler(uint8_t stat)
     USB0_CTL = USB_CTL_USBENSOFEN_MASK;
 }
 
+/*
+ * Endpoint 1 handler
+ */
+void usb_endp1_handler(uint8_t stat)
+{
+    struct bulk_slot *slot;
+
+    /*
+     * a packet of the current result has been sent
+     */
+    endp1_inflight--;
+    usb_endp1_next();
+    if (endp1_inflight)
+        return;
+
+    /*
+     * result complete, the slot can take the next command
+     */
+    slot = &bulk_slots[bulk_tx];
+    slot->length = 0;
+    slot->state = BULK_FREE;
+    bulk_tx ^= 1;
+
+    usb_endp2_resume();
+    usb_endp1_start();
+}
+
+/*
+ * Endpoint 3 handler
+ */
+void usb_endp3_handler(uint8_t stat)
+{
+    uint8_t data[EVENT_SIZE];
+
+    /*
+     * the host has the events now, take them out of the queue unless CMD_GET_EVENTS has done so meanwhile
+     * (the events queued after that have other sequence numbers); the main loop can send the next ones
+     */
+    while (endp3_count && event_peek(0, data) && get_be16(data + 1) == endp3_seq)
+    {
+        event_pop(data);
+        endp3_seq++;
+        endp3_count--;
+    }
+    endp3_count = 0;
+    endp3_busy = 0;
+}
+
 /*
  * Endpoint 2 handler
  */
@@ -580,15 +1043,14 @@ void usb_endp2_handler(uint8_t stat)
      */
     struct bdt *bdt = &table[BDT_INDEX(2, (stat & USB_STAT_TX_MASK) >> USB_STAT_TX_SHIFT, (stat & USB_STAT_ODD_MASK) >> USB_STAT_ODD_SHIFT)];
 
-    dbg("\r\n");
     switch (BDT_PID(bdt->desc))
     {
         case PID_OUT:
-            dbg("PID_OUT\r\n");
             /*
-             * nothing to do here..just give the buffer back
+             * packets are taken in order, keep this one if an older one is still waiting or no slot is free
              */
-            bdt->desc = BDT_DESC(ENDP2_SIZE, bdt);
+            if (endp2_nheld || !usb_endp2_receive(bdt))
+                endp2_held[endp2_nheld++] = bdt;
             break;
 
         default:
@@ -629,8 +1091,6 @@ static void usb_endp_default_handler(uint8_t stat)
 
 // weak aliases as "defaults" for the usb endpoint handlers
 
-void usb_endp1_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
-void usb_endp3_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 void usb_endp4_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 void usb_endp5_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
 void usb_endp6_handler(uint8_t) __attribute__((weak, alias("usb_endp_default_handler")));
@@ -732,14 +1192,16 @@ void USBOTG_IRQHandler(void)
         table[BDT_INDEX(0, TX, ODD)].desc = 0;
 
 
-        endp2_odd = 0;
-        table[BDT_INDEX(2, RX, EVEN)].desc = BDT_DESC(ENDP2_SIZE, 0);
-        table[BDT_INDEX(2, RX, EVEN)].addr = endp2_rx[0];
-        table[BDT_INDEX(2, RX, ODD)].desc = BDT_DESC(ENDP2_SIZE, 0);
-        table[BDT_INDEX(2, RX, ODD)].addr = endp2_rx[1];
+        usb_bulk_reset();
+        usb_event_reset();
+        usb_configured = 0;
+        vendor_generation++;
+        if (vendor_state != VENDOR_EXEC)
+            vendor_state = VENDOR_IDLE;
 
         USB0_ENDPT1 = USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
         USB0_ENDPT2 = USB_ENDPT_EPRXEN_MASK | USB_ENDPT_EPHSHK_MASK;
+        USB0_ENDPT3 = USB_ENDPT_EPTXEN_MASK | USB_ENDPT_EPHSHK_MASK;
 
         /*
          * initialize endpoint0 to 0x0d (41.5.23)
@@ -30,6 +30,7 @@
 #include "xprintf.h"
 #include "wait.h"
 #include "bdm.h"
+#include "events.h"
 
 
 #define DBG_MAIN
@@ -73,6 +74,8 @@ int main(void)
     GPIOD_PCOR = (1 << 7);
 
 
+    CYCCNT_INIT();                      /* start the cycle counter used for timestamps */
+
     v = (uint32_t) mcg_clk_hz;
     v = v / 1000000;
 
@@ -120,7 +123,12 @@ int main(void)
 
     while(1)
     {
-
+        usb_command_process();          /* commands received on EP0 and EP2 */
+        bdmcf_stream_poll();            /* keep long memory transfers going */
+        bdmcf_halt_poll();              /* watch a running target */
+        rsto_poll();                    /* target resets */
+        events_poll();
+        usb_event_process();            /* push events to the host */
     }
 
     return  0;                        // should never get here!
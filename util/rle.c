@@ -0,0 +1,123 @@
+/*
+ * rle.c
+ *
+ * This file is part of tbdm.
+ *
+ * tbdm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * tbdm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tbdm.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2016        M. Froeschle
+ *
+ */
+
+#include "rle.h"
+
+/*
+ * Run length encoding of the PackBits kind, no state beyond a single call and no memory besides the output.
+ * Runs of RLE_RUN_MIN or more equal bytes cost 2 bytes, anything else 1 byte per RLE_LITERAL_MAX bytes, so
+ * erased flash and cleared RAM shrink ~65 times while other data grows by less than 1%.
+ */
+#define AT(i)   buf[(start + (i)) & mask]
+
+uint32_t rle_encode(const uint8_t *buf, uint32_t mask, uint32_t start, uint32_t len,
+                    uint8_t *out, uint32_t max, uint32_t *consumed)
+{
+    uint32_t in = 0;
+    uint32_t o = 0;
+    uint32_t run;
+    uint32_t lit;
+    uint32_t i;
+
+    while (in < len)
+    {
+        run = 1;
+        while ((in + run < len) && (run < RLE_RUN_MAX) && (AT(in + run) == AT(in)))
+        {
+            run++;
+        }
+        if (run >= RLE_RUN_MIN)
+        {
+            if (o + 2 > max)
+            {
+                break;
+            }
+            out[o++] = 0x80 + run - RLE_RUN_MIN;
+            out[o++] = AT(in);
+            in += run;
+            continue;
+        }
+
+        lit = 0;                        /* literals up to where the next run starts */
+        while ((in + lit < len) && (lit < RLE_LITERAL_MAX) &&
+               !((in + lit + 2 < len) && (AT(in + lit) == AT(in + lit + 1)) && (AT(in + lit) == AT(in + lit + 2))))
+        {
+            lit++;
+        }
+        if (o + 2 > max)
+        {
+            break;                      /* no room for a single literal */
+        }
+        if (lit > max - o - 1)
+        {
+            lit = max - o - 1;
+        }
+        out[o++] = lit - 1;
+        for (i = 0; i < lit; i++)
+        {
+            out[o++] = AT(in + i);
+        }
+        in += lit;
+    }
+    *consumed = in;
+    return o;
+}
+
+uint32_t rle_decode(const uint8_t *in, uint32_t len, uint8_t *out, uint32_t max, uint32_t *consumed)
+{
+    uint32_t i = 0;
+    uint32_t o = 0;
+    uint32_t n;
+    uint32_t k;
+
+    while (i < len)
+    {
+        if (in[i] >= 0x80)
+        {
+            n = in[i] - 0x80 + RLE_RUN_MIN;
+            if ((i + 2 > len) || (o + n > max))
+            {
+                break;
+            }
+            for (k = 0; k < n; k++)
+            {
+                out[o++] = in[i + 1];
+            }
+            i += 2;
+        }
+        else
+        {
+            n = in[i] + 1;
+            if ((i + 1 + n > len) || (o + n > max))
+            {
+                break;
+            }
+            for (k = 0; k < n; k++)
+            {
+                out[o++] = in[i + 1 + k];
+            }
+            i += 1 + n;
+        }
+    }
+    *consumed = i;
+    return o;
+}